@@ -0,0 +1,23 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include "types.h"
+#include "blockdev.h"
+
+
+
+/**
+ * @brief      Measures sequential and random read/write throughput and IOPS
+ *             at different block sizes and queue depths. All data in the region is destroyed.
+ *
+ * @param      dev          The block device. Must not have requests in flight.
+ * @param[in]  startSector  The first sector of the scratch region.
+ * @param[in]  sectors      The size of the scratch region in sectors. Minimum 1 MiB.
+ * @param[in]  alignment    The alignment of the region in sectors. Only used for reporting.
+ * @param[in]  jsonPath     If not nullptr also write the results as JSON to this file. "-" for stdout.
+ *
+ * @return     Returns 0 on success or errno.
+ */
+int benchmarkDev(BlockDev &dev, const u64 startSector, const u64 sectors, const u32 alignment, const char *const jsonPath);
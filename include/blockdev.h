@@ -3,16 +3,127 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2023 profi200
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sys/uio.h> // struct iovec.
 #include "types.h"
+#include "uring_queue.h"
 
 
+// Request queue limits from sysfs. All in bytes. 0 = unknown.
+typedef struct
+{
+	u32 maxIoSize;          // queue/max_sectors_kb. Bigger requests are split by the kernel.
+	u32 optimalIoSize;      // queue/optimal_io_size.
+	u32 discardGranularity; // queue/discard_granularity.
+	u32 discardMaxBytes;    // queue/discard_max_bytes. Bigger discards are split by the kernel.
+	u32 preferredEraseSize; // device/preferred_erase_size. MMC/SD only (allocation unit).
+} QueueLimits;
+
+// Latency histogram bucket i counts requests taking [2^i, 2^(i+1)) us.
+// The first bucket includes everything faster and the last one everything slower.
+#define IO_LATENCY_BUCKETS  (24u)
+
+// I/O counters since opening the device. Latencies are from submission to completion.
+typedef struct
+{
+	u64 readBytes;
+	u64 writeBytes;   // Including zeros written by the caller.
+	u64 zeroBytes;    // Zeroed by offload.
+	u64 reads;
+	u64 writes;
+	u64 zeroOuts;     // Offload requests.
+	u64 syscalls;     // All I/O syscalls including io_uring_enter().
+	u64 zeroNs;       // Time spent in zeroOut().
+	u64 flushNs;      // fsync() in flush() and close().
+	u64 rescanNs;     // Partition rescan in close().
+	u64 eraseBytes;
+	u64 erases;       // Erase (discard) requests.
+	u64 eraseNs;      // Time spent in eraseAll().
+	u64 writeLatency[IO_LATENCY_BUCKETS];
+	u64 eraseLatency[IO_LATENCY_BUCKETS];
+} IoStats;
+
 
 class BlockDev
 {
-	static constexpr u32 m_sectorSize = 512;
+public:
+	enum AsyncBackend : u8
+	{
+		ASYNC_SYNC   = 0u, // Synchronous pwrite().
+		ASYNC_URING  = 1u, // io_uring.
+		ASYNC_THREAD = 2u  // Background writer thread.
+	};
+
+	enum ZeroMethod : u8
+	{
+		ZERO_NONE         = 0u, // Zeros must be written.
+		ZERO_WRITE_ZEROES = 1u, // BLKZEROOUT with device WRITE ZEROES support.
+		ZERO_DISCARD      = 2u, // BLKDISCARD. Verified by reading back once.
+		ZERO_PUNCH_HOLE   = 3u  // fallocate() hole punching for image files.
+	};
+
+
+private:
+	static constexpr u32 m_sectorSize    = 512;
+	static constexpr u32 m_bufAlignment  = 4096; // Memory alignment for O_DIRECT.
+	static constexpr u32 m_maxQueueDepth = 16;
+	static constexpr u32 m_maxAsyncTags  = m_maxQueueDepth + 1;
+	static constexpr u32 m_eraseChunk    = 1024 * 1024 * 256; // Upper limit for one erase request.
+	static inline std::atomic<bool> m_eraseCancel = false;    // Set by cancelErase(). Shared by all devices.
+
+	typedef struct
+	{
+		iovec iov;
+		u64 offset;
+		u64 startNs; // Submission time.
+		u32 tag;
+		bool write;
+		bool used;
+	} AsyncSlot;
+
 	bool m_dirty;
+	bool m_direct;
+	bool m_image;
 	int m_fd;
 	u64 m_sectors;
+	u32 m_ioAlignment; // In bytes.
+	QueueLimits m_limits;
+	mutable IoStats m_stats; // Everything not done by the writer thread.
+	mutable std::atomic<u64> m_progressBytes;   // Completed bytes for progress reporting. Read from other threads.
+	mutable std::atomic<u64> m_progressDropped; // Bytes of erases which ended early and will never be done.
+
+	// Zero-fill offloading.
+	ZeroMethod m_zeroMethod;
+	bool m_zeroVerified;
+	u32 m_zeroAlignment; // In bytes.
+
+	// Asynchronous I/O (io_uring or writer thread).
+	u32 m_queueDepth;
+	int m_asyncErr;
+	AsyncBackend m_backend;
+	UringQueue m_uring;
+	AsyncSlot m_asyncSlots[m_maxQueueDepth];
+	u16 m_asyncPending[m_maxAsyncTags];
+
+	// Writer thread state. Everything below m_thread is protected by m_threadMutex.
+	std::thread m_thread;
+	std::mutex m_threadMutex;
+	std::condition_variable m_jobCv;  // Signaled when a job was queued or on stop.
+	std::condition_variable m_doneCv; // Signaled when a job completed.
+	u8 m_jobQueue[m_maxQueueDepth];   // FIFO of slot indices.
+	u32 m_jobHead;
+	u32 m_jobCount;
+	u32 m_threadInFlight;
+	bool m_threadStop;
+	IoStats m_threadStats;
+
+	// Background erase. The stats and result belong to the erase thread until it is joined.
+	std::thread m_eraseThread;
+	IoStats m_eraseStats;
+	int m_eraseRes;
 
 
 	BlockDev(const BlockDev&) noexcept = delete; // Copy
@@ -21,9 +132,24 @@ class BlockDev
 	BlockDev& operator =(const BlockDev&) noexcept = delete; // Copy
 	BlockDev& operator =(BlockDev&&) noexcept = delete;      // Move
 
+	bool enableDirect(const int fd) noexcept;
+	int eraseRange(const u64 start, const u64 end, const bool secure, IoStats &stats) const noexcept;
+	void probeQueueLimits(void) noexcept;
+	void probeZeroOut(void) noexcept;
+	int reapAsync(void) noexcept;
+	int startThread(void) noexcept;
+	void stopThread(void) noexcept;
+	void threadMain(void) noexcept;
+	int submitAsyncThread(const bool write, void *buf, const u64 sector, const u64 count, const u32 tag) noexcept;
+	int submitAsync(const bool write, void *buf, const u64 sector, const u64 count, const u32 tag) noexcept;
+
 
 public:
-	BlockDev(void) noexcept : m_dirty(false), m_fd(-1), m_sectors(0) {}
+	BlockDev(void) noexcept : m_dirty(false), m_direct(false), m_image(false), m_fd(-1), m_sectors(0), m_ioAlignment(m_sectorSize), m_limits{}, m_stats{}, m_progressBytes(0), m_progressDropped(0),
+	                          m_zeroMethod(ZERO_NONE), m_zeroVerified(false),
+	                          m_zeroAlignment(m_sectorSize), m_queueDepth(1), m_asyncErr(0), m_backend(ASYNC_SYNC), m_asyncSlots{}, m_asyncPending{},
+	                          m_jobQueue{}, m_jobHead(0), m_jobCount(0), m_threadInFlight(0), m_threadStop(false), m_threadStats{},
+	                          m_eraseStats{}, m_eraseRes(0) {}
 	~BlockDev(void) noexcept
 	{
 		if(m_fd != -1) close();
@@ -32,12 +158,32 @@ public:
 	/**
 	 * @brief      Opens the block device.
 	 *
+	 * @param[in]  path    The path.
+	 * @param[in]  rw      When true open device in read + write mode.
+	 * @param[in]  direct  When true bypass the page cache (O_DIRECT). Silently falls back to
+	 *                     buffered I/O if the device refuses it. See isDirect().
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int open(const char *const path, const bool rw = false, const bool direct = false) noexcept;
+
+	/**
+	 * @brief      Opens or creates a regular (image) file instead of a block device.
+	 *             The file is resized to size. Zeroed ranges are punched out to keep it sparse.
+	 *
 	 * @param[in]  path  The path.
-	 * @param[in]  rw    When true open device in read + write mode.
+	 * @param[in]  size  The size in bytes. Must be a multiple of the sector size.
 	 *
 	 * @return     Returns 0 on success or errno.
 	 */
-	int open(const char *const path, const bool rw = false) noexcept;
+	int openImage(const char *const path, const u64 size) noexcept;
+
+	/**
+	 * @brief      Returns whether the target is an image file.
+	 *
+	 * @return     True if an image file is open.
+	 */
+	bool isImage(void) const noexcept {return m_image;}
 
 	/**
 	 * @brief      Returns the sector size in bytes.
@@ -46,6 +192,76 @@ public:
 	 */
 	static constexpr u32 getSectorSize(void) {return m_sectorSize;}
 
+	/**
+	 * @brief      Returns the memory alignment buffers need for O_DIRECT.
+	 *
+	 * @return     The alignment in bytes.
+	 */
+	static constexpr u32 getBufAlignment(void) {return m_bufAlignment;}
+
+	/**
+	 * @brief      Returns whether the page cache is bypassed (O_DIRECT).
+	 *
+	 * @return     True if O_DIRECT is in use.
+	 */
+	bool isDirect(void) const noexcept {return m_direct;}
+
+	/**
+	 * @brief      Enables or disables O_DIRECT. Must not be called with I/O in flight.
+	 *
+	 * @param[in]  direct  When true bypass the page cache.
+	 *
+	 * @return     Returns 0 on success, EOPNOTSUPP if the device refuses O_DIRECT or errno.
+	 */
+	int setDirect(const bool direct) noexcept;
+
+	/**
+	 * @brief      Waits for and flushes all writes and enables O_DIRECT so following
+	 *             reads come from the device and not the page cache. Undo with endDirectIo().
+	 *
+	 * @param      wasDirect  Set to the previous O_DIRECT state.
+	 *
+	 * @return     Returns 0 on success, EOPNOTSUPP if the device refuses O_DIRECT or errno.
+	 */
+	int beginDirectIo(bool &wasDirect) noexcept;
+
+	/**
+	 * @brief      Restores the O_DIRECT state saved by beginDirectIo(). Must not be called with I/O in flight.
+	 *
+	 * @param[in]  wasDirect  The state returned by beginDirectIo().
+	 */
+	void endDirectIo(const bool wasDirect) noexcept {setDirect(wasDirect);}
+
+	/**
+	 * @brief      Returns the alignment of offsets and sizes for writes.
+	 *             This is the logical block size with O_DIRECT and the sector size otherwise.
+	 *
+	 * @return     The alignment in bytes. Always a power of 2.
+	 */
+	u32 getIoAlignment(void) const noexcept {return m_ioAlignment;}
+
+	/**
+	 * @brief      Returns the request queue limits of the device.
+	 *             All zero for image files.
+	 *
+	 * @return     The queue limits.
+	 */
+	const QueueLimits& getQueueLimits(void) const noexcept {return m_limits;}
+
+	/**
+	 * @brief      Returns the maximum supported queue depth.
+	 *
+	 * @return     The maximum queue depth.
+	 */
+	static constexpr u32 getMaxQueueDepth(void) {return m_maxQueueDepth;}
+
+	/**
+	 * @brief      Returns the number of tags available for asynchronous writes.
+	 *
+	 * @return     The number of tags.
+	 */
+	static constexpr u32 getMaxAsyncTags(void) {return m_maxAsyncTags;}
+
 	/**
 	 * @brief      Returns the number of sectors.
 	 *
@@ -75,15 +291,194 @@ public:
 	 */
 	int write(const void *buf, const u64 sector, const u64 count) noexcept;
 
+	/**
+	 * @brief      Sets the number of asynchronous writes kept in flight.
+	 *             Depths >1 use io_uring or a background writer thread.
+	 *             If io_uring is not available the writer thread is used instead.
+	 *             On failure the depth falls back to 1 and writeAsync() behaves like write().
+	 *             Also clears a latched asynchronous I/O error.
+	 *
+	 * @param[in]  depth      The queue depth. Clamped to 1-getMaxQueueDepth().
+	 * @param[in]  useThread  When true use the writer thread even if io_uring is available.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int setQueueDepth(const u32 depth, const bool useThread = false) noexcept;
+
+	/**
+	 * @brief      Returns the backend used for asynchronous writes.
+	 *
+	 * @return     The backend.
+	 */
+	AsyncBackend getAsyncBackend(void) const noexcept {return m_backend;}
+
+	/**
+	 * @brief      Returns the queue depth in use.
+	 *
+	 * @return     The queue depth.
+	 */
+	u32 getQueueDepth(void) const noexcept {return m_queueDepth;}
+
+	/**
+	 * @brief      Queues a write of sectors to the block device.
+	 *             buf must stay valid and unmodified until waitAsync() for the same tag returned.
+	 *
+	 * @param[in]  buf     The input buffer.
+	 * @param[in]  sector  The start sector.
+	 * @param[in]  count   The number of sectors to write. Maximum 1 GiB.
+	 * @param[in]  tag     The tag used to wait for completion. Must be <getMaxAsyncTags().
+	 *
+	 * @return     Returns 0 on success or errno (including errors of earlier writes).
+	 */
+	int writeAsync(const void *buf, const u64 sector, const u64 count, const u32 tag) noexcept;
+
+	/**
+	 * @brief      Queues a read of sectors from the block device.
+	 *             buf must stay valid and unused until waitAsync() for the same tag returned.
+	 *
+	 * @param      buf     The output buffer.
+	 * @param[in]  sector  The start sector.
+	 * @param[in]  count   The number of sectors to read. Maximum 1 GiB.
+	 * @param[in]  tag     The tag used to wait for completion. Must be <getMaxAsyncTags().
+	 *
+	 * @return     Returns 0 on success or errno (including errors of earlier requests).
+	 */
+	int readAsync(void *buf, const u64 sector, const u64 count, const u32 tag) noexcept;
+
+	/**
+	 * @brief      Waits until all requests with the given tag completed.
+	 *
+	 * @param[in]  tag   The tag.
+	 *
+	 * @return     Returns 0 on success or errno of the first failed request.
+	 */
+	int waitAsync(const u32 tag) noexcept;
+
+	/**
+	 * @brief      Waits until all queued requests completed.
+	 *
+	 * @return     Returns 0 on success or errno of the first failed request.
+	 */
+	int waitAllAsync(void) noexcept;
+
+	/**
+	 * @brief      Returns the method used by zeroOut().
+	 *
+	 * @return     The zero method.
+	 */
+	ZeroMethod getZeroMethod(void) const noexcept {return m_zeroMethod;}
+
+	/**
+	 * @brief      Returns the alignment required for zeroOut() ranges.
+	 *
+	 * @return     The alignment in bytes. Always a power of 2.
+	 */
+	u32 getZeroAlignment(void) const noexcept {return m_zeroAlignment;}
+
+	/**
+	 * @brief      Zeros sectors without transferring zero buffers to the device.
+	 *             Uses WRITE ZEROES or a discard that was verified to read back as zeros.
+	 *             If this returns EOPNOTSUPP the caller must write zeros itself.
+	 *
+	 * @param[in]  sector  The start sector. Must be aligned to getZeroAlignment().
+	 * @param[in]  count   The number of sectors. Must be a multiple of getZeroAlignment().
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int zeroOut(const u64 sector, const u64 count) noexcept;
+
 	/**
 	 * @brief      Perform a TRIM/erase on the whole block device.
+	 *             Image files are deallocated instead.
+	 *             The device is erased in chunks aligned to the erase unit so progress
+	 *             is counted and the erase can be cancelled between chunks.
 	 *
 	 * @param[in]  secure  If true do a secure erase. Currently unsupported by Linux.
 	 *
-	 * @return     Returns 0 on success or errno.
+	 * @return     Returns 0 on success, ECANCELED if cancelled or errno.
 	 */
 	int eraseAll(const bool secure = false) const noexcept;
 
+	/**
+	 * @brief      Starts erasing from sector to the end of the device on a background thread.
+	 *             Other I/O may run at the same time but must stay below sector until
+	 *             finishErase() returned.
+	 *
+	 * @param[in]  sector  The first sector to erase.
+	 * @param[in]  secure  If true do a secure erase. Currently unsupported by Linux.
+	 *
+	 * @return     Returns 0 on success or errno if the thread can't be started.
+	 */
+	int startErase(const u64 sector, const bool secure = false) noexcept;
+
+	/**
+	 * @brief      Returns whether a background erase was started and not finished yet.
+	 *
+	 * @return     True if erasing in the background.
+	 */
+	bool isErasing(void) const noexcept {return m_eraseThread.joinable();}
+
+	/**
+	 * @brief      Waits for the background erase if it is still running.
+	 *
+	 * @return     Returns the result of the last background erase like eraseAll() or 0 if none was started.
+	 */
+	int finishErase(void) noexcept;
+
+	/**
+	 * @brief      Cancels running and future erases of all devices until reset.
+	 *             Async-signal-safe.
+	 *
+	 * @param[in]  cancel  true to cancel and false to allow erasing again.
+	 */
+	static void cancelErase(const bool cancel = true) noexcept {m_eraseCancel.store(cancel, std::memory_order_relaxed);}
+
+	/**
+	 * @brief      Returns whether erases are cancelled. Long running erases done
+	 *             with writes check this between requests.
+	 *
+	 * @return     True if cancelled.
+	 */
+	static bool isEraseCancelled(void) noexcept {return m_eraseCancel.load(std::memory_order_relaxed);}
+
+	/**
+	 * @brief      Returns the number of bytes written, zeroed or erased since opening the device.
+	 *             Lock-free and safe to call from any thread.
+	 *
+	 * @return     The number of bytes.
+	 */
+	u64 getProgressBytes(void) const noexcept {return m_progressBytes.load(std::memory_order_relaxed);}
+
+	/**
+	 * @brief      Returns the number of bytes of erases which ended early since opening the device.
+	 *             Progress reports subtract them from the expected total. Lock-free like getProgressBytes().
+	 *
+	 * @return     The number of bytes.
+	 */
+	u64 getProgressDropped(void) const noexcept {return m_progressDropped.load(std::memory_order_relaxed);}
+
+	/**
+	 * @brief      Counts bytes as done which didn't need any I/O (for example unchanged blocks).
+	 *
+	 * @param[in]  bytes  The number of bytes.
+	 */
+	void addProgress(const u64 bytes) noexcept {m_progressBytes.fetch_add(bytes, std::memory_order_relaxed);}
+
+	/**
+	 * @brief      Returns the I/O counters since opening the device.
+	 *             They are kept after close() until the next open.
+	 *
+	 * @return     The counters.
+	 */
+	IoStats getIoStats(void) noexcept;
+
+	/**
+	 * @brief      Waits for all requests and flushes all written data to the device.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int flush(void) noexcept;
+
 	/**
 	 * @brief      Closes the block device.
 	 */
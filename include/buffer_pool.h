@@ -0,0 +1,54 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "types.h"
+
+
+// Hands out aligned I/O buffers to many writers while keeping the total below a budget.
+// Released buffers are cached for reuse by writers asking for the same size.
+class BufferPool final
+{
+	std::mutex m_mutex;
+	std::condition_variable m_releasedCv;
+	const u64 m_budget;
+	u64 m_used;   // Bytes handed out.
+	u64 m_cached; // Bytes in m_free.
+	std::vector<std::pair<u8*, size_t>> m_free;
+
+
+	BufferPool(const BufferPool&) noexcept = delete; // Copy
+	BufferPool(BufferPool&&) noexcept = delete;      // Move
+
+	BufferPool& operator =(const BufferPool&) noexcept = delete; // Copy
+	BufferPool& operator =(BufferPool&&) noexcept = delete;      // Move
+
+
+public:
+	BufferPool(const u64 budget) noexcept : m_budget(budget), m_used(0), m_cached(0) {}
+	~BufferPool(void) noexcept;
+
+	/**
+	 * @brief      Takes a buffer from the pool. Blocks until enough of the budget is free.
+	 *             A buffer bigger than the budget is handed out once nothing else is in use.
+	 *
+	 * @param[in]  size  The size in bytes.
+	 *
+	 * @return     The buffer aligned to BlockDev::getBufAlignment() or nullptr if out of memory.
+	 */
+	u8* acquire(const size_t size) noexcept;
+
+	/**
+	 * @brief      Returns a buffer to the pool.
+	 *
+	 * @param      buf   The buffer from acquire().
+	 * @param[in]  size  The size given to acquire().
+	 */
+	void release(u8 *const buf, const size_t size) noexcept;
+};
@@ -3,23 +3,100 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2023 profi200
 
+#include <cstdlib>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 #include "types.h"
 #include "blockdev.h"
+#include "buffer_pool.h"
 
 
+typedef struct
+{
+	u64 dataBytes;    // Bytes of data recorded.
+	u64 fileBytes;    // Bytes copied from files. Part of dataBytes.
+	u64 zeroBytes;    // Bytes of zeros recorded.
+	u64 writeBytes;   // Bytes that will be written including zero gaps and padding.
+	u64 offloadBytes; // Zero bytes offloaded to the device.
+	u64 skippedBytes; // Bytes not written because the device already had them. Only known after execution.
+	u32 extents;      // Number of recorded extents.
+	u32 writes;       // Number of write requests.
+	u32 offloads;     // Number of zero offload requests.
+} PlanStats;
+
+// Bytes replacing planned data on one device of a broadcast.
+typedef struct
+{
+	u64 offset;
+	std::vector<u8> data;
+} PlanPatch;
+
 
 // Warning: This class is only suitable for overwriting like reformatting.
 //          Padding for alignment is filled with zeros (no read-modify-write).
 class BufferedFsWriter final : private BlockDev
 {
-	static constexpr u32 m_blkSize = 1024 * 1024 * 8; // Must be >=512 and power of 2.
-	static constexpr u32 m_blkMask = m_blkSize - 1;
-	static_assert(m_blkSize > 512 && (m_blkSize & m_blkMask) == 0, "Invalid buffer size for BufferedFsWriter.");
+	static constexpr u32 m_defBlkSize = 1024 * 1024 * 8;  // Buffer size if the device has no request size limit.
+	static constexpr u32 m_minBlkSize = 1024 * 64;        // Must be >=getBufAlignment() and power of 2.
+	static constexpr u32 m_maxBlkSize = 1024 * 1024 * 32; // Must be power of 2.
+	static constexpr u32 m_callerTag = BlockDev::getMaxAsyncTags() - 1; // Tag for writes directly from caller buffers.
+	static constexpr u32 m_minZeroOffload = 1024 * 128; // Smaller zero extents are written as part of data runs.
+
+	typedef struct
+	{
+		u64 offset;
+		u64 length;
+		u64 dataOffset; // Offset in m_planData, m_planFile | index in m_planFiles or m_planZero for zeros.
+	} PlanExtent;
+	static constexpr u64 m_planZero = ~0ull;
+	static constexpr u64 m_noErase  = ~0ull;
+	static constexpr u64 m_planFile = 1ull<<63;
+
+	// State of executePlanBroadcast().
+	typedef struct
+	{
+		const std::vector<BufferedFsWriter*> *targets;
+		const std::vector<std::vector<PlanPatch>> *patches;
+		std::vector<int> *results;
+		u8 *scratch; // Patched chunks and zeros for devices which can't offload.
+	} Broadcast;
+
+	struct BufDeleter
+	{
+		BufferPool *pool; // nullptr if allocated with aligned_alloc().
+		size_t size;
+		void operator()(u8 *const ptr) const noexcept
+		{
+			if(pool != nullptr) pool->release(ptr, size);
+			else free(ptr);
+		}
+	};
 
-	const std::unique_ptr<u8[]> m_buf;
+	BufferPool *m_pool;
+	std::unique_ptr<u8[], BufDeleter> m_bufs; // One buffer per write in flight. Aligned for O_DIRECT.
+	u8 *m_buf;                    // Current buffer.
+	u32 m_blkSize;                // Size of each buffer and write request. Power of 2.
+	u32 m_blkMask;
+	u32 m_bufCount;
+	u32 m_bufIdx;
 	u64 m_pos;
+	std::unique_ptr<u8[]> m_cmpBuf; // Planned data for comparing in differential mode.
+	bool m_differential;
+
+	// Write planning.
+	bool m_planning;
+	u64 m_planStart;
+	std::vector<PlanExtent> m_planExtents; // Ordered and contiguous.
+	std::vector<u8> m_planData;
+	std::vector<std::string> m_planFiles; // Paths of files copied by file extents.
+	int m_planFd;                         // Open file of the last file extent read or -1.
+	size_t m_planFdIdx;
+	Broadcast *m_broadcast;               // Only set during executePlanBroadcast().
+	u64 m_eraseStart;                     // Start of the background erase or m_noErase.
+	void (*m_onEraseJoined)(void);        // Called once the background erase thread was joined or nullptr.
 
 
 	BufferedFsWriter(const BufferedFsWriter&) noexcept = delete; // Copy
@@ -28,9 +105,29 @@ class BufferedFsWriter final : private BlockDev
 	BufferedFsWriter& operator =(const BufferedFsWriter&) noexcept = delete; // Copy
 	BufferedFsWriter& operator =(BufferedFsWriter&&) noexcept = delete;      // Move
 
+	int setupBuffers(const u32 queueDepth, const bool useThread, BufferPool *const pool) noexcept;
+	int nextBuffer(void) noexcept;
+	int writeZeroBlocks(u64 start, const u64 end) noexcept;
+	int planAdd(const void *buf, const u64 size) noexcept;
+	int planReserve(const u64 size, u8 *&dst) noexcept;
+	int submitBuffer(void) noexcept;
+	int readPlanFile(const size_t fileIdx, u8 *dst, u64 offset, u64 size) noexcept;
+	void closePlanFile(void) noexcept;
+	int copyPlanData(u8 *const dst, const u64 start, const u64 end, size_t &extIdx) noexcept;
+	int joinErase(void) noexcept;
+	int waitErase(const u64 end) noexcept;
+	int writeChunk(const u64 start, const u32 size) noexcept;
+	int broadcastChunk(const u64 start, const u32 size) noexcept;
+	int broadcastZerosTo(BufferedFsWriter &dev, const u64 start, const u64 end) noexcept;
+	int broadcastZeros(const u64 start, const u64 end) noexcept;
+	int planRun(u64 start, const u64 end, size_t extIdx, PlanStats &stats, const bool execute) noexcept;
+	int planRunDiff(u64 start, const u64 end, size_t extIdx, PlanStats &stats) noexcept;
+	int walkPlan(PlanStats &stats, const bool execute) noexcept;
+	int planVerify(const u64 sampleSize, std::vector<std::pair<u64, u32>> &chunks, u64 &writtenEnd) noexcept;
+
 
 public:
-	BufferedFsWriter(void) noexcept : m_buf(new(std::nothrow) u8[m_blkSize]), m_pos(0) {}
+	BufferedFsWriter(void) noexcept : m_pool(nullptr), m_buf(nullptr), m_blkSize(m_defBlkSize), m_blkMask(m_defBlkSize - 1), m_bufCount(0), m_bufIdx(0), m_pos(0), m_differential(false), m_planning(false), m_planStart(0), m_planFd(-1), m_planFdIdx(0), m_broadcast(nullptr), m_eraseStart(m_noErase), m_onEraseJoined(nullptr) {}
 	~BufferedFsWriter(void) noexcept(false)
 	{
 		if(m_pos > 0)
@@ -43,15 +140,103 @@ public:
 	/**
 	 * @brief      Opens the block device.
 	 *
-	 * @param[in]  path  The path.
+	 * @param[in]  path        The path.
+	 * @param[in]  queueDepth  The number of writes kept in flight. Falls back to 1 if neither
+	 *                         io_uring nor the writer thread are available.
+	 * @param[in]  useThread   When true flush buffers from a background writer thread instead of io_uring.
+	 * @param[in]  direct      When true bypass the page cache (O_DIRECT) if the device supports it.
+	 * @param      pool        If not nullptr the buffers are taken from this pool by acquireBuffers()
+	 *                         instead of being allocated here. Must outlive the writer.
 	 *
 	 * @return     Returns 0 on success or errno.
 	 */
-	int open(const char *const path) noexcept
-	{
-		if(!m_buf) return ENOMEM;
-		return BlockDev::open(path, true);
-	}
+	int open(const char *const path, const u32 queueDepth = 1, const bool useThread = false, const bool direct = false,
+	         BufferPool *const pool = nullptr) noexcept;
+
+	/**
+	 * @brief      Takes the buffers from the pool given to open(). Blocks until the pool has
+	 *             enough memory. Must be called before writing. Does nothing without a pool.
+	 *             close() returns the buffers.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int acquireBuffers(void) noexcept;
+
+	/**
+	 * @brief      Opens or creates an image file instead of a block device.
+	 *
+	 * @param[in]  path        The path.
+	 * @param[in]  size        The image size in bytes. Must be a multiple of 512.
+	 * @param[in]  queueDepth  The number of writes kept in flight.
+	 * @param[in]  useThread   When true flush buffers from a background writer thread instead of io_uring.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int openImage(const char *const path, const u64 size, const u32 queueDepth = 1, const bool useThread = false) noexcept;
+
+	/**
+	 * @brief      Returns the queue depth in use.
+	 *
+	 * @return     The queue depth.
+	 */
+	u32 getQueueDepth(void) const noexcept {return BlockDev::getQueueDepth();}
+
+	/**
+	 * @brief      Returns the size of each buffer and write request.
+	 *
+	 * @return     The size in bytes.
+	 */
+	u32 getBufferSize(void) const noexcept {return m_blkSize;}
+
+	/**
+	 * @brief      Returns the pool given to open().
+	 *
+	 * @return     The pool or nullptr.
+	 */
+	BufferPool* getPool(void) const noexcept {return m_pool;}
+
+	/**
+	 * @brief      Returns the smallest size and alignment for I/O.
+	 *
+	 * @return     The alignment in bytes.
+	 */
+	u32 getIoAlignment(void) const noexcept {return BlockDev::getIoAlignment();}
+
+	/**
+	 * @brief      Returns the request queue limits of the device.
+	 *
+	 * @return     The queue limits.
+	 */
+	const QueueLimits& getQueueLimits(void) const noexcept {return BlockDev::getQueueLimits();}
+
+	/**
+	 * @brief      Returns the backend used for asynchronous writes.
+	 *
+	 * @return     The backend.
+	 */
+	AsyncBackend getAsyncBackend(void) const noexcept {return BlockDev::getAsyncBackend();}
+
+	/**
+	 * @brief      Returns whether the page cache is bypassed (O_DIRECT).
+	 *
+	 * @return     True if O_DIRECT is in use.
+	 */
+	bool isDirect(void) const noexcept {return BlockDev::isDirect();}
+
+	/**
+	 * @brief      Returns the method used to offload zero-fill to the device.
+	 *
+	 * @return     The zero method.
+	 */
+	ZeroMethod getZeroMethod(void) const noexcept {return BlockDev::getZeroMethod();}
+
+	/**
+	 * @brief      Returns the underlying block device for raw I/O.
+	 *             Only use it while the writer has no buffered data (after executePlan()).
+	 *
+	 * @return     The block device.
+	 */
+	BlockDev& getBlockDev(void) noexcept {return *this;}
 
 	/**
 	 * @brief      Returns the number of sectors.
@@ -102,6 +287,174 @@ public:
 		return res;
 	}
 
+	/**
+	 * @brief      Writes data generated directly into the internal buffers.
+	 *             Saves a temporary buffer and the overhead of many small writes.
+	 *             The data is split at multiples of the buffer size relative to
+	 *             the device start so element alignment of the position is kept.
+	 *
+	 * @param[in]  size  The number of bytes to write.
+	 * @param      gen   Called as gen(u8 *dst, u64 offset, u32 len) one or more times
+	 *                   to generate len bytes starting at offset relative to this write.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	template<typename Gen>
+	int writeGenerated(const u64 size, Gen &&gen) noexcept
+	{
+		if(m_planning)
+		{
+			u8 *dst;
+			const int res = planReserve(size, dst);
+			if(res != 0) return res;
+
+			for(u64 offset = 0; offset < size; offset += m_blkSize)
+				gen(dst + offset, offset, (size - offset > m_blkSize ? m_blkSize : size - offset));
+			m_pos += size;
+			return 0;
+		}
+
+		for(u64 offset = 0; offset < size;)
+		{
+			const u32 bufPos = m_pos & m_blkMask;
+			const u32 len = (size - offset > m_blkSize - bufPos ? m_blkSize - bufPos : size - offset);
+			gen(&m_buf[bufPos], offset, len);
+			offset += len;
+			m_pos += len;
+
+			if((m_pos & m_blkMask) == 0)
+			{
+				const int res = submitBuffer();
+				if(res != 0) return res;
+			}
+		}
+
+		return 0;
+	}
+
+	/**
+	 * @brief      Copies a file. While planning only the path is recorded and the
+	 *             file is read straight into the write buffers by executePlan().
+	 *
+	 * @param[in]  path  The path of the file.
+	 * @param[in]  size  The number of bytes to copy. The file must not be shorter.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int writeFile(const char *const path, const u64 size) noexcept;
+
+	/**
+	 * @brief      Starts recording all following fill() and write() calls as a list of
+	 *             data and zero extents instead of writing them. The current position
+	 *             must be a multiple of the buffer size.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int startPlan(void) noexcept;
+
+	/**
+	 * @brief      Calculates the number of bytes and requests the recorded plan needs.
+	 *             Zero offloading is assumed to succeed.
+	 *
+	 * @param      stats  The output stats.
+	 */
+	void getPlanStats(PlanStats &stats) noexcept {walkPlan(stats, false);}
+
+	/**
+	 * @brief      Enables or disables differential mode for executePlan(). Every block is
+	 *             read first and only written if it differs from the plan. Zeros are not
+	 *             offloaded in this mode since that may rewrite unchanged blocks.
+	 *
+	 * @param[in]  enable  True to enable.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int setDifferential(const bool enable) noexcept;
+
+	/**
+	 * @brief      Executes the recorded plan. Adjacent data extents and small zero gaps
+	 *             are merged into large writes and big zero extents are offloaded to the device.
+	 *             Afterwards only verifyPlan() if the plan was kept and close() may be called.
+	 *
+	 * @param      stats     Optional output of the stats of the execution.
+	 * @param[in]  keepPlan  Keep the plan for verifyPlan().
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int executePlan(PlanStats *const stats = nullptr, const bool keepPlan = false) noexcept;
+
+	/**
+	 * @brief      Flushes the device and reads back the plan kept by executePlan() with O_DIRECT
+	 *             (image files through the page cache). Data extents are compared completely.
+	 *             Zero and file extents are sampled at their start, middle and end.
+	 *             Reads are kept in flight in all buffers while comparing. The plan is released
+	 *             afterwards.
+	 *
+	 * @param[in]  sampleSize  The number of bytes compared per sample.
+	 * @param[out] matches     Set to true if everything compared equal.
+	 * @param[out] badOffset   The first byte which differs.
+	 *
+	 * @return     Returns 0 on success, EOPNOTSUPP if O_DIRECT is not supported or errno.
+	 */
+	int verifyPlan(const u64 sampleSize, bool &matches, u64 &badOffset) noexcept;
+
+	/**
+	 * @brief      Returns the number of bytes verifyPlan() will read back.
+	 *
+	 * @param[in]  sampleSize  The number of bytes compared per sample.
+	 *
+	 * @return     The number of bytes or 0 on error.
+	 */
+	u64 getVerifyBytes(const u64 sampleSize) noexcept;
+
+	/**
+	 * @brief      Executes the recorded plan on this and other devices at the same time.
+	 *             Every chunk is generated once and written to all devices from the same
+	 *             buffer. A slow device holds back the others by at most the number of buffers.
+	 *             Chunks overlapping patches are copied and patched for each device.
+	 *             A failing device is dropped and the others continue.
+	 *             Afterwards only close() may be called on this writer.
+	 *
+	 * @param      targets  The devices including this one. The others must be opened with the
+	 *                      same queue depth, have nothing buffered and be at least as big as the plan.
+	 * @param[in]  patches  Byte ranges which replace planned data per device. Same order as targets.
+	 * @param[out] results  0 or errno per device. Same order as targets.
+	 * @param      stats    Optional output of the stats of the execution.
+	 *
+	 * @return     Returns 0 if at least one device succeeded or errno.
+	 */
+	int executePlanBroadcast(const std::vector<BufferedFsWriter*> &targets, const std::vector<std::vector<PlanPatch>> &patches,
+	                         std::vector<int> &results, PlanStats *const stats = nullptr) noexcept;
+
+	/**
+	 * @brief      Copies recorded data from the plan. Zero extents and unplanned ranges read as zeros.
+	 *
+	 * @param      dst     The output buffer.
+	 * @param[in]  offset  The device offset in bytes.
+	 * @param[in]  size    The number of bytes.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int readPlan(void *const dst, const u64 offset, const u64 size) noexcept;
+
+	/**
+	 * @brief      Compares the recorded plan with the current device contents without writing.
+	 *             Data extents are compared completely and zero extents only up to zeroHead bytes.
+	 *             Reads are rounded to the I/O alignment and the padding is compared too.
+	 *
+	 * @param[in]  zeroHead  The number of bytes to compare at the start of each zero extent.
+	 * @param[out] matches   Set to true if everything compared equal.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int comparePlan(const u64 zeroHead, bool &matches) noexcept;
+
+	/**
+	 * @brief      Discards the recorded plan without writing anything.
+	 *             The position goes back to where startPlan() was called.
+	 */
+	void discardPlan(void) noexcept;
+
 	/**
 	 * @brief      Perform a TRIM/erase on the whole block device.
 	 *
@@ -112,9 +465,46 @@ public:
 	int eraseAll(const bool secure = false) noexcept
 	{
 		m_pos = 0;
+		const int res = BlockDev::waitAllAsync();
+		if(res != 0) return res;
 		return BlockDev::eraseAll(secure);
 	}
 
+	/**
+	 * @brief      Starts erasing from offset to the end of the device in the background.
+	 *             executePlan() writes everything below offset while erasing and waits for
+	 *             the erase before the first write at or behind offset. Not supported for
+	 *             differential mode and broadcasts.
+	 *
+	 * @param[in]  offset    The first byte to erase. Must be a multiple of 512.
+	 * @param[in]  secure    If true do a secure erase.
+	 * @param[in]  onJoined  If not nullptr called once as soon as the erase is over.
+	 *                       This can be in the middle of executePlan(). Not called on failure.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int startErase(const u64 offset, const bool secure = false, void (*const onJoined)(void) = nullptr) noexcept
+	{
+		if(offset % 512 != 0) return EINVAL;
+		const int res = BlockDev::startErase(offset / 512, secure);
+		if(res == 0)
+		{
+			m_eraseStart = offset;
+			m_onEraseJoined = onJoined;
+		}
+		return res;
+	}
+
+	/**
+	 * @brief      Waits for the background erase started by startErase().
+	 *
+	 * @return     Returns the result of the erase like eraseAll() or 0 if none was started.
+	 */
+	int finishErase(void) noexcept
+	{
+		return joinErase();
+	}
+
 	/**
 	 * @brief      Flushes the buffer and closes the block device.
 	 *
@@ -0,0 +1,23 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include "types.h"
+#include "blockdev.h"
+
+
+
+/**
+ * @brief      Detects the real capacity of fake cards by writing address tagged
+ *             pseudorandom patterns and reading them back. Samples at logarithmic
+ *             offsets are checked first. The optional full pass then checks every
+ *             sector up to the first bad sample. All data on the card is destroyed.
+ *
+ * @param      dev          The block device. Must not have requests in flight.
+ * @param[in]  full         Also check every sector instead of only samples.
+ * @param[out] goodSectors  The number of sectors from the start of the card which really store data.
+ *
+ * @return     Returns 0 on success or errno.
+ */
+int verifyCapacity(BlockDev &dev, const bool full, u64 &goodSectors);
@@ -0,0 +1,36 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <string>
+#include <vector>
+#include "types.h"
+#include "format.h"
+
+
+// Which appearing disks are formatted. Only hotpluggable disks (USB, MMC, removable) are considered.
+typedef struct
+{
+	u64 minSize;                      // In bytes. 0 = no limit.
+	u64 maxSize;                      // In bytes. 0 = no limit.
+	std::vector<std::string> serials; // Serial numbers of allowed readers. Empty = all.
+	bool any;                         // Explicitly allow all disks. Only valid without other rules.
+} DaemonRules;
+
+
+
+/**
+ * @brief      Waits for disks or media announced by udev and formats every
+ *             disk matching the rules with the given options on a worker thread.
+ *             The result of each card is logged as one block. Runs until SIGINT or SIGTERM
+ *             and waits for running formats before returning.
+ *
+ * @param[in]  rules  The rules a disk must match.
+ * @param[in]  label  The volume label.
+ * @param[in]  flags  The format options.
+ * @param[in]  args   The format arguments. jobs limits the number of cards formatted at the same time.
+ *
+ * @return     Returns 0 after a signal or an ERR_* code if the daemon can't start.
+ */
+u32 runDaemon(const DaemonRules &rules, const std::string &label, const ArgFlags flags, const FormatArgs &args);
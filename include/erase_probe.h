@@ -0,0 +1,22 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include "types.h"
+#include "blockdev.h"
+
+
+
+/**
+ * @brief      Detects the erase block (allocation unit) size by timing small writes
+ *             which straddle candidate boundaries in a scratch region in the middle
+ *             of the card. Writes crossing a real boundary are slower because they
+ *             touch 2 erase blocks. Data in the scratch region is destroyed.
+ *
+ * @param      dev           The block device. Must not have requests in flight.
+ * @param[out] eraseSectors  The erase block size in sectors or 0 if no boundary was found.
+ *
+ * @return     Returns 0 on success or errno.
+ */
+int probeEraseBlock(BlockDev &dev, u32 &eraseSectors);
@@ -16,5 +16,11 @@ enum
 	ERR_FORMAT        =  7,
 	ERR_CLOSE_DEV     =  8,
 	ERR_EXCEPTION     =  9,
-	ERR_UNK_EXCEPTION = 10
+	ERR_UNK_EXCEPTION = 10,
+	ERR_BENCH         = 11,
+	ERR_CAPACITY      = 12,
+	ERR_PROBE         = 13,
+	ERR_BATCH         = 14,
+	ERR_DAEMON        = 15,
+	ERR_VERIFY        = 16
 };
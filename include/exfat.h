@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: MIT
 
 #include <cstddef>
+#include <vector>
 #include "types.h"
 #include "format.h"
 #include "buffered_fs_writer.h"
@@ -168,7 +169,12 @@ static_assert(sizeof(ExfatDirEnt) == 32, "ExfatDirEnt is not 32 bytes.");
 #define TYPE_NAME                 (TYPE_IN_USE | TYPE_CATEGORY_SECONDARY | TYPE_IMPORTANCE_CRITICAL | 1u)
 #define TYPE_WIN_CE_AC            (TYPE_IN_USE | TYPE_CATEGORY_SECONDARY | TYPE_IMPORTANCE_CRITICAL | 2u)
 
+// Stream Extension Directory Entry.
+#define STREAM_FLAG_ALLOC_POSSIBLE  (1u)
+#define STREAM_FLAG_NO_FAT_CHAIN    (1u<<1)
+
 
 
 void calcFormatExFat(FormatParams &params);
-int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u16string &label);
+void setExfatVolId(u8 *const bootRegion, const u16 bytesPerSec, const u32 volId); // Also updates the boot checksum.
+int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u16string &label, std::vector<FsFile> &files);
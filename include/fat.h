@@ -4,6 +4,8 @@
 // Copyright (c) 2023 profi200
 
 #include <cstddef>
+#include <ctime>
+#include <vector>
 #include "types.h"
 #include "format.h"
 #include "buffered_fs_writer.h"
@@ -179,7 +181,13 @@ static inline u8 calcLdirChksum(const char *shortName)
 	return chksum;
 }
 
+// Returns the size of the entries of a directory in bytes.
+typedef u64 (*DirSizeFunc)(const FsFile &dir);
+
 u32 makeVolId(void);
+u32 makeFatTimestamp(const time_t t);
+bool allocFileClusters(std::vector<FsFile> &files, const u32 next, const u32 auClus, const u32 bytesPerClus,
+                       const u32 clusCount, const DirSizeFunc dirSize, std::vector<FsFile*> &order);
 void calcFormatFat(FormatParams &params);
 void calcFormatFat32(FormatParams &params);
-int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::string &label);
+int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::string &label, std::vector<FsFile> &files);
@@ -4,6 +4,7 @@
 // Copyright (c) 2023 profi200
 
 #include <string>
+#include <vector>
 #include "types.h"
 
 
@@ -18,21 +19,81 @@ union ArgFlags
 {
 	struct
 	{
-		u8 bigClusters : 1;
-		u8 erase       : 1;
-		u8 forceFat32  : 1;
-		u8 secErase    : 1;
-		u8 verbose     : 1;
+		u32 bench        : 1;
+		u32 benchOnly    : 1;
+		u32 bigClusters  : 1;
+		u32 broadcast    : 1;
+		u32 differential : 1;
+		u32 direct       : 1;
+		u32 erase        : 1;
+		u32 forceFat32   : 1;
+		u32 ifNeeded     : 1;
+		u32 overwrite    : 2; // OverwriteMode.
+		u32 probeAu      : 1;
+		u32 probeAuApply : 1;
+		u32 secErase     : 1;
+		u32 stats        : 1;
+		u32 statsJson    : 1;
+		u32 verbose      : 1;
+		u32 verify       : 1;
+		u32 verifyCap    : 1;
+		u32 verifyFull   : 1;
+		u32 writerThread : 1;
 	};
-	u8 allFlags;
+	u32 allFlags;
 };
 
+// A file with contiguous clusters created in the root directory.
+typedef struct
+{
+	std::string name; // As given on the command line.
+	u64 size;         // In bytes.
+} PreallocFile;
+
+// Non-boolean command line arguments.
+typedef struct
+{
+	u64 overrTotSec; // Capacity override in sectors. 0 = no override.
+	u64 imageSize;   // Size of the image file in bytes. 0 = format a block device.
+	const char *benchJson; // Benchmark JSON output file or nullptr.
+	u32 queueDepth;
+	u32 jobs;        // Maximum number of devices formatted at the same time.
+	std::vector<PreallocFile> prealloc;
+	const char *populateDir; // Host directory to copy into the root directory or nullptr.
+	int progressFd;          // File descriptor for JSON progress lines or -1.
+	bool progressBar;        // Draw a progress bar on stderr. Ignored for multiple devices.
+} FormatArgs;
+
+// A contiguous run of clusters. start is the index in the data area (cluster number - 2).
+typedef struct
+{
+	u32 start;
+	u32 count;
+} ClusterRun;
+
+// A file or directory created in the new filesystem.
+typedef struct FsFile
+{
+	std::u16string name;          // exFAT name and FAT long name.
+	char shortName[11];           // FAT 8.3 name. Space padded without the dot.
+	bool needsLfn;                // FAT long name entries are needed.
+	bool isDir;
+	u32 timestamp;                // FAT date and time. Also used by exFAT.
+	u64 size;                     // File size in bytes.
+	std::string srcPath;          // Host file or directory to copy. Empty for preallocated files.
+	std::vector<FsFile> children; // Directory contents.
+	ClusterRun run;               // Assigned while formatting.
+} FsFile;
+
 // Note: Unless specified otherwise everything is in logical sectors.
 typedef struct
 {
 	u64 totSec;
 	u32 alignment;          // In logical sectors.
+	u32 eraseBlockSize;     // In bytes.
 	u32 secPerClus;
+	u32 diskSig;            // MBR disk signature. 0 = generate a new one.
+	u32 volId;              // Volume ID/serial number. 0 = generate a new one.
 	union
 	{
 		struct // FAT12/16/32
@@ -61,4 +122,6 @@ typedef struct
 
 
 
-u32 formatSd(const char *const path, const std::string &label, const ArgFlags flags, const u64 overrTotSec);
+u32 formatSd(const char *const path, const std::string &label, const ArgFlags flags, const FormatArgs &args);
+u32 formatBatch(const std::vector<const char*> &paths, const std::string &label, const ArgFlags flags, const FormatArgs &args);
+u32 benchSd(const char *const path, const ArgFlags flags, const FormatArgs &args);
@@ -0,0 +1,38 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <string>
+
+
+/**
+ * @brief      Replaces stdout and stderr with unbuffered streams which can be captured
+ *             per thread. Output of threads not capturing goes to the original streams.
+ *             Must be called before any other thread prints.
+ *
+ * @return     Returns 0 on success or errno.
+ */
+int initOutputCapture(void);
+
+/**
+ * @brief      Starts collecting everything the calling thread prints to stdout and stderr.
+ *
+ * @param      out   Receives stdout output.
+ * @param      err   Receives stderr output.
+ */
+void startOutputCapture(std::string &out, std::string &err);
+
+/**
+ * @brief      Stops collecting output of the calling thread.
+ */
+void stopOutputCapture(void);
+
+/**
+ * @brief      Prints captured output to the original streams as one block
+ *             which is not interleaved with other threads using this function.
+ *
+ * @param[in]  out   The stdout output.
+ * @param[in]  err   The stderr output.
+ */
+void printCapturedOutput(const std::string &out, const std::string &err);
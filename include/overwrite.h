@@ -0,0 +1,34 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include "types.h"
+#include "blockdev.h"
+#include "buffer_pool.h"
+
+
+enum OverwriteMode : u8
+{
+	OVERWRITE_NONE    = 0u,
+	OVERWRITE_ZERO    = 1u, // Zeros.
+	OVERWRITE_PATTERN = 2u, // 0x55 and 0xAA alternating.
+	OVERWRITE_RANDOM  = 3u  // Pseudorandom data from a new seed on every run.
+};
+
+
+
+/**
+ * @brief      Overwrites every sector of the device with real writes. Unlike TRIM this
+ *             works behind USB card readers and doesn't leave the old data to the card.
+ *             All buffers are kept in flight. Random data for the next requests is generated
+ *             while the others are written. Afterwards samples spread over the device are read
+ *             back if O_DIRECT is supported. Can be cancelled with BlockDev::cancelErase().
+ *
+ * @param      dev   The block device. Must not have requests in flight.
+ * @param[in]  mode  The data to write. Must not be OVERWRITE_NONE.
+ * @param      pool  If not nullptr the buffers are taken from this pool.
+ *
+ * @return     Returns 0 on success, ECANCELED if cancelled, EIO if a sample doesn't match or errno.
+ */
+int overwriteDev(BlockDev &dev, const OverwriteMode mode, BufferPool *const pool = nullptr);
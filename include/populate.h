@@ -0,0 +1,34 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <vector>
+#include "types.h"
+#include "format.h"
+
+
+
+/**
+ * @brief      Reads a host directory tree to copy into the root directory of the new
+ *             filesystem. Names are converted and FAT short names are generated.
+ *             Symlinks are followed. Other special files are skipped.
+ *
+ * @param[in]  path     The host directory.
+ * @param[in]  fatBits  The FAT variant or 64 for exFAT.
+ * @param[out] files    Receives the files and directories.
+ *
+ * @return     Returns true on success.
+ */
+bool scanHostDir(const char *const path, const u8 fatBits, std::vector<FsFile> &files);
+
+/**
+ * @brief      Checks that all names in a directory are unique. Long names are compared
+ *             case-insensitive. For FAT short names must be unique too.
+ *
+ * @param[in]  files    The files and directories in the directory.
+ * @param[in]  fatBits  The FAT variant or 64 for exFAT.
+ *
+ * @return     Returns true if there are no duplicates.
+ */
+bool checkFileNames(const std::vector<FsFile> &files, const u8 fatBits);
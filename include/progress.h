@@ -0,0 +1,76 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "types.h"
+#include "blockdev.h"
+
+
+// Reports the progress of long phases from a background thread which samples the
+// lock-free byte counter of the device. Shows a progress bar on stderr and/or writes
+// newline-delimited JSON to a file descriptor. SIGUSR1 prints the status like dd does.
+class Progress final
+{
+	const char *const m_name; // Device path used in the output.
+	const int m_fd;           // JSON output or -1.
+	const bool m_bar;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_stopCv;
+	bool m_stop;
+
+	// The current phase. Only changed while the reporter thread is not running.
+	const char *m_phase;
+	const BlockDev *m_dev;
+	u64 m_base;        // Progress bytes of the device at the start of the phase.
+	u64 m_droppedBase; // Dropped bytes of the device at the start of the phase.
+	u64 m_total;       // 0 = unknown.
+	u64 m_startNs;
+	u32 m_statusGen;
+	bool m_barDrawn; // Short phases finish without ever drawing the bar.
+
+
+	Progress(const Progress&) noexcept = delete; // Copy
+	Progress(Progress&&) noexcept = delete;      // Move
+
+	Progress& operator =(const Progress&) noexcept = delete; // Copy
+	Progress& operator =(Progress&&) noexcept = delete;      // Move
+
+	void report(const bool final) noexcept;
+	void threadMain(void) noexcept;
+
+
+public:
+	/**
+	 * @brief      Creates a reporter. Nothing is printed until start().
+	 *
+	 * @param[in]  name  The device path. Must stay valid.
+	 * @param[in]  fd    File descriptor for JSON lines or -1.
+	 * @param[in]  bar   When true draw a progress bar on stderr.
+	 */
+	Progress(const char *const name, const int fd, const bool bar) noexcept
+		: m_name(name), m_fd(fd), m_bar(bar), m_stop(false), m_phase(nullptr), m_dev(nullptr), m_base(0), m_droppedBase(0), m_total(0), m_startNs(0), m_statusGen(0), m_barDrawn(false) {}
+	~Progress(void) noexcept
+	{
+		stop();
+	}
+
+	/**
+	 * @brief      Starts reporting a phase. A running phase is stopped first.
+	 *
+	 * @param[in]  phase  The phase name. Must stay valid.
+	 * @param[in]  dev    The device whose progress bytes are counted.
+	 * @param[in]  total  The expected number of bytes or 0 if unknown.
+	 */
+	void start(const char *const phase, const BlockDev &dev, const u64 total) noexcept;
+
+	/**
+	 * @brief      Stops reporting the current phase and prints the final status.
+	 */
+	void stop(void) noexcept;
+};
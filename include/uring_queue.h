@@ -0,0 +1,113 @@
+#pragma once
+
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <cstddef>
+#include "types.h"
+
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+
+
+// Minimal io_uring wrapper using the raw syscalls (no liburing dependency).
+// Every call to submit() is passed to the kernel immediately.
+class UringQueue
+{
+	int m_fd;
+	u32 m_inFlight;
+	u64 m_enters; // io_uring_enter() calls since init().
+
+	// Submission queue.
+	void *m_sqMap;
+	size_t m_sqMapSize;
+	io_uring_sqe *m_sqes;
+	size_t m_sqesSize;
+	u32 *m_sqTail;
+	u32 *m_sqArray;
+	u32 m_sqMask;
+
+	// Completion queue.
+	void *m_cqMap;
+	size_t m_cqMapSize;
+	io_uring_cqe *m_cqes;
+	u32 *m_cqHead;
+	u32 *m_cqTail;
+	u32 m_cqMask;
+
+
+	UringQueue(const UringQueue&) noexcept = delete; // Copy
+	UringQueue(UringQueue&&) noexcept = delete;      // Move
+
+	UringQueue& operator =(const UringQueue&) noexcept = delete; // Copy
+	UringQueue& operator =(UringQueue&&) noexcept = delete;      // Move
+
+
+public:
+	UringQueue(void) noexcept : m_fd(-1), m_inFlight(0), m_enters(0), m_sqMap(nullptr), m_sqes(nullptr), m_cqMap(nullptr) {}
+	~UringQueue(void) noexcept
+	{
+		if(m_fd != -1) destroy();
+	}
+
+	/**
+	 * @brief      Creates the io_uring instance.
+	 *
+	 * @param[in]  entries  The number of submission queue entries.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int init(const u32 entries) noexcept;
+
+	/**
+	 * @brief      Returns whether the io_uring instance was created successfully.
+	 *
+	 * @return     True if active.
+	 */
+	bool isActive(void) const noexcept {return m_fd != -1;}
+
+	/**
+	 * @brief      Returns the number of submitted but not yet reaped requests.
+	 *
+	 * @return     The number of requests in flight.
+	 */
+	u32 getInFlight(void) const noexcept {return m_inFlight;}
+
+	/**
+	 * @brief      Returns the number of io_uring_enter() syscalls since init().
+	 *
+	 * @return     The number of syscalls.
+	 */
+	u64 getEnters(void) const noexcept {return m_enters;}
+
+	/**
+	 * @brief      Submits a single vectored read or write request.
+	 *             The iovec and the buffers must stay valid until completion.
+	 *
+	 * @param[in]  opcode    The opcode. IORING_OP_READV or IORING_OP_WRITEV.
+	 * @param[in]  fd        The file descriptor.
+	 * @param[in]  iov       Pointer to a struct iovec.
+	 * @param[in]  offset    The offset in bytes.
+	 * @param[in]  userData  The user data returned on completion.
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int submit(const u8 opcode, const int fd, const void *const iov, const u64 offset, const u64 userData) noexcept;
+
+	/**
+	 * @brief      Waits for and reaps a single completion.
+	 *
+	 * @param      userData  The user data of the completed request.
+	 * @param      result    The result of the request (bytes transferred or -errno).
+	 *
+	 * @return     Returns 0 on success or errno.
+	 */
+	int wait(u64 &userData, s32 &result) noexcept;
+
+	/**
+	 * @brief      Destroys the io_uring instance. Requests in flight are not waited for.
+	 */
+	void destroy(void) noexcept;
+};
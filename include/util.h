@@ -5,6 +5,9 @@
 
 #include <climits>
 #include <concepts>
+#include <cstddef>
+#include <ctime>
+#include "types.h"
 
 
 #define BIT(x)            (1u<<(x))
@@ -80,4 +83,49 @@ constexpr static inline T udivCeil(const T dividend, const T2 divider) noexcept
 	return (dividend - 1) / divider + 1;
 }
 
+// Monotonic time in nanoseconds for measuring durations.
+static inline u64 getNs(void) noexcept
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Copies str to dst escaped for use inside a JSON string. Escapes are never cut
+// off if dst is too small. dst is always NUL terminated. Returns the length of dst.
+static inline size_t jsonEscape(char *const dst, const size_t size, const char *str) noexcept
+{
+	size_t len = 0;
+	for(; *str != '\0'; str++)
+	{
+		const unsigned char c = *str;
+		char esc[7];
+		size_t escLen = 2;
+		esc[0] = '\\';
+		if(c == '"' || c == '\\') esc[1] = c;
+		else if(c < 0x20)
+		{
+			// \u00XX.
+			const char *const hex = "0123456789abcdef";
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[c>>4];
+			esc[5] = hex[c & 0xFu];
+			escLen = 6;
+		}
+		else
+		{
+			esc[0] = c;
+			escLen = 1;
+		}
+
+		if(len + escLen >= size) break;
+		for(size_t i = 0; i < escLen; i++) dst[len++] = esc[i];
+	}
+	if(size > 0) dst[len] = '\0';
+
+	return len;
+}
+
 } // namespace util
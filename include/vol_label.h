@@ -4,9 +4,13 @@
 // Copyright (c) 2023 profi200
 
 #include <cstddef>
+#include <string>
 #include "types.h"
 
 
 
 size_t convertCheckFatLabel(const char *const label, char *dosLabel);
 size_t convertCheckExfatLabel(const char *const label, char16_t *utf16Label);
+bool convertCheckFatShortName(const char *const name, char *shortName);
+size_t convertCheckExfatName(const char *const name, std::u16string &utf16Name);
+bool makeFatBasisName(const std::u16string &name, char *shortName, bool &lossy);
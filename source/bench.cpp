@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include "types.h"
+#include "bench.h"
+#include "util.h"
+
+
+typedef struct
+{
+	const char *name;
+	bool random;
+	u32 blkSize;
+	u32 queueDepth;
+} BenchTest;
+
+typedef struct
+{
+	u64 ops;
+	u64 ns;
+	u32 queueDepth; // Depth actually used. 0 if the test was skipped.
+} BenchResult;
+
+
+static constexpr u64 g_benchNs = 1000000000u; // Duration of each test.
+static const BenchTest g_tests[] =
+{
+	{"SEQ512K Q16", false, 1024 * 512, 16},
+	{"SEQ512K Q1",  false, 1024 * 512,  1},
+	{"SEQ4K Q1",    false,       4096,  1},
+	{"RND512K Q1",  true,  1024 * 512,  1},
+	{"RND4K Q16",   true,        4096, 16},
+	{"RND4K Q4",    true,        4096,  4},
+	{"RND4K Q1",    true,        4096,  1}
+};
+
+
+
+// xorshift64.
+static u64 nextRandom(u64 &state)
+{
+	u64 x = state;
+	x ^= x<<13;
+	x ^= x>>7;
+	x ^= x<<17;
+	state = x;
+	return x;
+}
+
+static int runTest(BlockDev &dev, const BenchTest &test, const bool write, void *const buf,
+                   const u64 startSector, const u64 sectors, u64 &rngState, BenchResult &result)
+{
+	// The writer thread fallback runs requests one at a time which would
+	// make the result a mislabeled Q1 test. Skip these tests instead.
+	result = BenchResult{};
+	if(dev.setQueueDepth(test.queueDepth) != 0 || (test.queueDepth > 1 && dev.getAsyncBackend() != BlockDev::ASYNC_URING))
+		return 0;
+	result.queueDepth = dev.getQueueDepth();
+
+	const u64 blkSectors = test.blkSize / BlockDev::getSectorSize();
+	const u64 blocks = sectors / blkSectors;
+	u64 blk = 0;
+	u64 ops = 0;
+	int res = 0;
+	const u64 start = util::getNs();
+	do
+	{
+		const u64 sector = startSector + (test.random ? nextRandom(rngState) % blocks : blk++ % blocks) * blkSectors;
+		if(write) res = dev.writeAsync(buf, sector, blkSectors, 0);
+		else      res = dev.readAsync(buf, sector, blkSectors, 0);
+		if(res != 0) break;
+
+		ops++;
+	} while(util::getNs() - start < g_benchNs);
+
+	const int waitRes = dev.waitAllAsync();
+	if(res == 0) res = waitRes;
+
+	result.ops = ops;
+	result.ns  = util::getNs() - start;
+
+	return res;
+}
+
+static double toMBps(const BenchTest &test, const BenchResult &result)
+{
+	return (double)result.ops * test.blkSize / 1000000.0 / ((double)result.ns / 1000000000.0);
+}
+
+static double toIops(const BenchResult &result)
+{
+	return (double)result.ops / ((double)result.ns / 1000000000.0);
+}
+
+static int writeJson(const char *const jsonPath, const u64 startSector, const u64 sectors,
+                     const u32 alignment, const BenchResult (*const results)[2])
+{
+	FILE *const f = (strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w"));
+	if(f == nullptr)
+	{
+		const int res = errno;
+		perror("Failed to open JSON output file");
+		return res;
+	}
+
+	fprintf(f, "{\"region\":{\"start_sector\":%" PRIu64 ",\"sectors\":%" PRIu64 ",\"alignment\":%" PRIu32 "},\"tests\":[",
+	        startSector, sectors, alignment);
+	for(size_t i = 0; i < sizeof(g_tests) / sizeof(*g_tests); i++)
+	{
+		const BenchTest &test = g_tests[i];
+		for(unsigned w = 0; w < 2; w++)
+		{
+			const BenchResult &result = results[i][w];
+			fprintf(f, "%s{\"name\":\"%s\",\"op\":\"%s\",\"pattern\":\"%s\",\"block_size\":%" PRIu32 ",",
+			        (i == 0 && w == 0 ? "" : ","), test.name, (w ? "write" : "read"), (test.random ? "random" : "sequential"), test.blkSize);
+			if(result.queueDepth == 0) fputs("\"skipped\":true}", f);
+			else fprintf(f, "\"queue_depth\":%" PRIu32 ",\"ops\":%" PRIu64 ",\"ns\":%" PRIu64 ",\"mb_per_s\":%.2f,\"iops\":%.1f}",
+			             result.queueDepth, result.ops, result.ns, toMBps(test, result), toIops(result));
+		}
+	}
+	fputs("]}\n", f);
+
+	int res = 0;
+	if(f != stdout && fclose(f) != 0)
+	{
+		res = errno;
+		perror("Failed to write JSON output file");
+	}
+
+	return res;
+}
+
+int benchmarkDev(BlockDev &dev, const u64 startSector, const u64 sectors, const u32 alignment, const char *const jsonPath)
+{
+	if(sectors < 1024 * 1024 / BlockDev::getSectorSize()) return EINVAL;
+
+	// Finish outstanding writes first so they don't skew the results.
+	// Without O_DIRECT we would mostly measure the page cache.
+	bool wasDirect;
+	int res = dev.beginDirectIo(wasDirect);
+	if(res == EOPNOTSUPP) fputs("Error: Benchmark needs O_DIRECT which is not supported by the device.\n", stderr);
+	if(res != 0) return res;
+
+	// Random data in case the card or reader compresses/deduplicates.
+	constexpr u32 bufSize = 1024 * 512;
+	const std::unique_ptr<u64[], decltype(&free)> buf(reinterpret_cast<u64*>(aligned_alloc(BlockDev::getBufAlignment(), bufSize)), free);
+	if(!buf) return ENOMEM;
+	u64 rngState = util::getNs() | 1;
+	for(u32 i = 0; i < bufSize / 8; i++) buf[i] = nextRandom(rngState);
+
+	const u32 oldDepth = dev.getQueueDepth();
+	const BlockDev::AsyncBackend oldBackend = dev.getAsyncBackend();
+	printf("Benchmarking %" PRIu64 " MiB at sector %" PRIu64 "...\n", sectors * BlockDev::getSectorSize() / 1024 / 1024, startSector);
+	if(dev.setQueueDepth(BlockDev::getMaxQueueDepth()) != 0 || dev.getAsyncBackend() != BlockDev::ASYNC_URING)
+		puts("io_uring is not available. Skipping tests with queue depth >1.");
+	puts("Test            Write MB/s  Write IOPS   Read MB/s   Read IOPS");
+
+	// Write first so the reads hit written flash.
+	BenchResult results[sizeof(g_tests) / sizeof(*g_tests)][2]{}; // Read, write.
+	for(size_t i = 0; i < sizeof(g_tests) / sizeof(*g_tests) && res == 0; i++)
+	{
+		const BenchTest &test = g_tests[i];
+		res = runTest(dev, test, true, buf.get(), startSector, sectors, rngState, results[i][1]);
+		if(res == 0) res = runTest(dev, test, false, buf.get(), startSector, sectors, rngState, results[i][0]);
+		if(res != 0) break;
+
+		if(results[i][1].queueDepth == 0) printf("%-12s %12s\n", test.name, "skipped");
+		else printf("%-12s %12.2f %11.1f %11.2f %11.1f\n", test.name, toMBps(test, results[i][1]), toIops(results[i][1]),
+		            toMBps(test, results[i][0]), toIops(results[i][0]));
+	}
+
+	// Restore the previous I/O mode.
+	dev.setQueueDepth(oldDepth, oldBackend == BlockDev::ASYNC_THREAD);
+	dev.endDirectIo(wasDirect);
+
+	if(res == 0 && jsonPath != nullptr)
+		res = writeJson(jsonPath, startSector, sectors, alignment, results);
+
+	return res;
+}
@@ -2,61 +2,212 @@
 // Copyright (c) 2023 profi200
 
 #define _FILE_OFFSET_BITS 64
+#include <algorithm>
+#include <bit>
+#include <climits>     // PATH_MAX.
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <numeric>
+#include <system_error>
 #include <errno.h>
-#include <fcntl.h>     // open()...
+#include <fcntl.h>     // open(), fallocate()...
 #include <linux/fs.h>  // BLKGETSIZE64...
+#include <linux/io_uring.h> // IORING_OP_WRITEV...
+#include <linux/major.h> // LOOP_MAJOR.
 #include <sys/ioctl.h> // ioctl()...
 #include <sys/stat.h>  // S_IRUSR, S_IWUSR...
+#include <sys/sysmacros.h> // major(), minor().
 #include <unistd.h>    // write(), close()...
 #include "types.h"
 #include "blockdev.h"
+#include "util.h"
 
 
-//#define REDIRECT_FOR_DEBUG (1)
 
+static void addLatency(u64 (&histogram)[IO_LATENCY_BUCKETS], const u64 ns)
+{
+	const u64 us = ns / 1000;
+	const u32 bucket = (us < 2 ? 0 : std::bit_width(us) - 1);
+	histogram[bucket < IO_LATENCY_BUCKETS ? bucket : IO_LATENCY_BUCKETS - 1]++;
+}
 
+// Opens an attribute file of a block device in sysfs.
+static FILE* openBlockAttr(const dev_t dev, const char *const name)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), name);
+	return fopen(path, "r");
+}
 
-static int checkDevice(const char *const path)
+// Checks if an attribute file or directory of a block device exists in sysfs.
+static bool hasBlockAttr(const dev_t dev, const char *const name)
 {
-	int res = EINVAL; // By default assume the given path is not a suitable device.
-	char cmd[64] = "/usr/bin/lsblk -dnr -oTYPE,HOTPLUG,PHY-SEC ";
-	strncpy(&cmd[43], path, sizeof(cmd) - 43);
-	cmd[sizeof(cmd) - 1] = '\0';
-	FILE *const p = ::popen(cmd, "r");
-	if(p == nullptr)
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), name);
+	return access(path, F_OK) == 0;
+}
+
+// Reads a numeric attribute of a block device from sysfs. Returns 0 on success or errno.
+static int readBlockAttr(const dev_t dev, const char *const name, u64 &val)
+{
+	FILE *const f = openBlockAttr(dev, name);
+	if(f == nullptr) return errno;
+
+	int res = 0;
+	unsigned long long tmp;
+	if(fscanf(f, "%llu", &tmp) == 1) val = tmp;
+	else                             res = EINVAL;
+	fclose(f);
+
+	return res;
+}
+
+static int readBlockAttr(const int fd, const char *const name, u64 &val)
+{
+	struct stat st;
+	if(fstat(fd, &st) == -1) return errno;
+	if(!S_ISBLK(st.st_mode)) return ENOTBLK;
+
+	return readBlockAttr(st.st_rdev, name, val);
+}
+
+// Same logic as lsblk HOTPLUG. The device is hotpluggable if the removable flag
+// is set or if any parent device reports itself as removable.
+static bool isHotpluggable(const dev_t dev)
+{
+	u64 removable;
+	if(readBlockAttr(dev, "removable", removable) == 0 && removable == 1) return true;
+
+	char link[128];
+	snprintf(link, sizeof(link), "/sys/dev/block/%u:%u/device", major(dev), minor(dev));
+	char *const devPath = realpath(link, nullptr);
+	if(devPath == nullptr) return false;
+
+	bool hotplug = false;
+	char *sep;
+	while(!hotplug && strncmp(devPath, "/sys/devices/", 13) == 0 && (sep = strrchr(devPath, '/')) != nullptr)
 	{
-		res = errno;
-		perror("Failed to call lsblk");
-		return res;
+		char attrPath[PATH_MAX];
+		snprintf(attrPath, sizeof(attrPath), "%s/removable", devPath);
+		FILE *const f = fopen(attrPath, "r");
+		if(f != nullptr)
+		{
+			char val[16]{};
+			if(fgets(val, sizeof(val), f) != nullptr) hotplug = strcmp(val, "removable\n") == 0;
+			fclose(f);
+		}
+
+		*sep = '\0'; // Go to parent.
 	}
+	free(devPath);
+
+	return hotplug;
+}
 
-	char line[16];
-	line[sizeof(line) - 1] = '\0';
-	if(fgets(line, sizeof(line), p) == nullptr)
+// Accepts hotpluggable whole disks (card readers) and loop devices with 512 bytes sectors.
+// Before calling this the path should be checked with checkDevicePath().
+static int checkDeviceSectors(const int fd)
+{
+	int lbSize, pbSize;
+	if(ioctl(fd, BLKSSZGET, &lbSize) == -1 || ioctl(fd, BLKPBSZGET, &pbSize) == -1) return errno;
+	if(lbSize != 512 || pbSize != 512) return EINVAL;
+
+	return 0;
+}
+
+static int checkDevicePath(const char *const path)
+{
+	struct stat st;
+	if(stat(path, &st) == -1)
 	{
-		::pclose(p);
+		const int res = errno;
+		perror("Failed to get device info");
 		return res;
 	}
+	if(!S_ISBLK(st.st_mode)) return EINVAL;
 
-	if(strcmp(line, "disk 1 512\n") == 0 || strcmp(line, "loop 0 512\n") == 0)
-		res = 0;
+	// No partitions, device mapper or RAID devices.
+	const dev_t dev = st.st_rdev;
+	if(hasBlockAttr(dev, "partition") || hasBlockAttr(dev, "dm") || hasBlockAttr(dev, "md")) return EINVAL;
 
-	const int pres = ::pclose(p);
-	if(pres == -1)     res = errno;  // pclose() error.
-	else if(pres != 0) res = EINVAL; // lsblk error.
+	const bool hotplug = isHotpluggable(dev);
+	if(major(dev) == LOOP_MAJOR || hasBlockAttr(dev, "loop")) return (hotplug ? EINVAL : 0);
 
-	return res;
+	// SCSI devices must be of type disk (0). Other disks (MMC, NVMe...) don't have this attribute.
+	u64 scsiType;
+	if(readBlockAttr(dev, "device/type", scsiType) == 0 && scsiType != 0) return EINVAL;
+
+	return (hotplug ? 0 : EINVAL);
+}
+
+// Tries to switch fd to O_DIRECT and checks if the device accepts aligned reads.
+bool BlockDev::enableDirect(const int fd) noexcept
+{
+	int lbSize;
+	if(ioctl(fd, BLKSSZGET, &lbSize) == -1) return false;
+	if(lbSize < static_cast<int>(m_sectorSize) || lbSize > static_cast<int>(m_bufAlignment) || (lbSize & (lbSize - 1)) != 0)
+		return false;
+
+	const int fl = fcntl(fd, F_GETFL);
+	if(fl == -1 || fcntl(fd, F_SETFL, fl | O_DIRECT) == -1) return false;
+
+	// Some drivers accept the flag but fail the actual I/O.
+	void *const probeBuf = aligned_alloc(m_bufAlignment, m_bufAlignment);
+	const bool ok = probeBuf != nullptr && pread(fd, probeBuf, lbSize, 0) == lbSize;
+	free(probeBuf);
+	if(!ok)
+	{
+		fcntl(fd, F_SETFL, fl);
+		return false;
+	}
+
+	m_ioAlignment = lbSize;
+
+	return true;
 }
 
-int BlockDev::open(const char *const path, const bool rw) noexcept
+int BlockDev::setDirect(const bool direct) noexcept
 {
+	if(m_uring.getInFlight() > 0 || m_threadInFlight > 0) return EBUSY;
+	if(direct == m_direct) return 0;
+	if(direct)
+	{
+		if(m_image || !enableDirect(m_fd)) return EOPNOTSUPP;
+		m_direct = true;
+		return 0;
+	}
+
+	const int fl = fcntl(m_fd, F_GETFL);
+	if(fl == -1 || fcntl(m_fd, F_SETFL, fl & ~O_DIRECT) == -1) return errno;
+	m_direct = false;
+	m_ioAlignment = m_sectorSize;
+
+	return 0;
+}
+
+int BlockDev::beginDirectIo(bool &wasDirect) noexcept
+{
+	wasDirect = m_direct;
+	const int res = flush();
+	if(res != 0) return res;
+
+	return setDirect(true);
+}
+
+int BlockDev::open(const char *const path, const bool rw, const bool direct) noexcept
+{
+	m_stats = IoStats{};
+	m_threadStats = IoStats{};
+	m_progressBytes = 0;
+	m_progressDropped = 0;
+
 	int res = 0;
 	int fd = -1;
 	do
 	{
-		res = checkDevice(path);
+		res = checkDevicePath(path);
 		errno = res; // For perror() at the end.
 		if(res == EINVAL)
 		{
@@ -80,6 +231,16 @@ int BlockDev::open(const char *const path, const bool rw) noexcept
 			break;
 		}
 
+		res = checkDeviceSectors(fd);
+		errno = res;
+		if(res == EINVAL)
+		{
+			fputs("Error: Not a suitable block device.\n", stderr);
+			break;
+		}
+		else if(res != 0)
+			break;
+
 		u64 diskSize;
 		if(ioctl(fd, BLKGETSIZE64, &diskSize) == -1)
 		{
@@ -87,122 +248,741 @@ int BlockDev::open(const char *const path, const bool rw) noexcept
 			break;
 		}
 
-#ifdef REDIRECT_FOR_DEBUG
-		while(::close(fd) == -1 && errno == EINTR);
+		if(direct) m_direct = enableDirect(fd);
+
+		m_fd = fd;
+		m_sectors = diskSize / m_sectorSize;
+		probeQueueLimits();
+		if(rw) probeZeroOut();
+	} while(0);
+
+	if(res != 0)
+	{
+		perror("Failed to open block device");
+		if(fd != -1) ::close(fd);
+	}
+	return res;
+}
+
+void BlockDev::probeQueueLimits(void) noexcept
+{
+	// Anything above 1 GiB (the maximum request size) is treated as unknown.
+	const auto get = [this](const char *const name, const u64 scale) -> u32
+	{
+		u64 val;
+		if(readBlockAttr(m_fd, name, val) != 0 || val > (1u<<30) / scale) return 0;
+		return val * scale;
+	};
+
+	m_limits.maxIoSize          = get("queue/max_sectors_kb", 1024);
+	m_limits.optimalIoSize      = get("queue/optimal_io_size", 1);
+	m_limits.discardGranularity = get("queue/discard_granularity", 1);
+	m_limits.discardMaxBytes    = get("queue/discard_max_bytes", 1);
+	m_limits.preferredEraseSize = get("device/preferred_erase_size", 1);
+}
+
+void BlockDev::probeZeroOut(void) noexcept
+{
+	m_zeroMethod    = ZERO_NONE;
+	m_zeroVerified  = false;
+	m_zeroAlignment = m_sectorSize;
+
+	// Prefer WRITE ZEROES since the device guarantees zeros.
+	u64 val;
+	if(readBlockAttr(m_fd, "queue/write_zeroes_max_bytes", val) == 0 && val > 0)
+	{
+		m_zeroMethod   = ZERO_WRITE_ZEROES;
+		m_zeroVerified = true;
+		return;
+	}
+
+	// Discard may or may not read back as zeros. This is verified on first use.
+	if(readBlockAttr(m_fd, "queue/discard_max_bytes", val) == 0 && val > 0)
+	{
+		u64 granularity = 0;
+		readBlockAttr(m_fd, "queue/discard_granularity", granularity);
+
+		// Partially discarded granules may keep old data. Only use power of 2 granularity.
+		if(granularity <= m_sectorSize) granularity = m_sectorSize;
+		if((granularity & (granularity - 1)) == 0 && granularity <= 0x40000000)
+		{
+			m_zeroMethod    = ZERO_DISCARD;
+			m_zeroAlignment = granularity;
+		}
+	}
+}
+
+int BlockDev::zeroOut(const u64 sector, const u64 count) noexcept
+{
+	const u32 alignMask = m_zeroAlignment / m_sectorSize - 1;
+	if(m_zeroMethod == ZERO_NONE) return EOPNOTSUPP;
+	if((sector & alignMask) != 0 || (count & alignMask) != 0) return EINVAL;
+	if(count == 0) return 0;
+
+	// Mark as dirty since we are about to change data.
+	m_dirty = true;
+
+	const u64 startNs = util::getNs();
+	const u64 range[2] = {sector * m_sectorSize, count * m_sectorSize};
+	if(m_zeroMethod == ZERO_DISCARD && !m_zeroVerified)
+	{
+		// Discard the first granule only and check if it reads back as zeros.
+		// It is inside the range we are zeroing so it doesn't matter if it doesn't.
+		constexpr u32 probeSize = 1024 * 64;
+		const u64 probeRange[2] = {range[0], m_zeroAlignment};
+		const u32 readSize = (m_zeroAlignment < probeSize ? m_zeroAlignment : probeSize);
+		const std::unique_ptr<u8[], decltype(&free)> probeBuf(reinterpret_cast<u8*>(aligned_alloc(m_bufAlignment, probeSize)), free);
+		bool zeros = false;
+		m_stats.syscalls += 2;
+		if(probeBuf && ioctl(m_fd, BLKDISCARD, probeRange) == 0 &&
+		   pread(m_fd, probeBuf.get(), readSize, range[0]) == static_cast<ssize_t>(readSize))
+		{
+			zeros = probeBuf[0] == 0 && memcmp(probeBuf.get(), probeBuf.get() + 1, readSize - 1) == 0;
+		}
+
+		if(!zeros)
+		{
+			m_zeroMethod = ZERO_NONE;
+			m_zeroAlignment = m_sectorSize;
+			return EOPNOTSUPP;
+		}
+		m_zeroVerified = true;
+	}
 
-		// Create file with -rw-rw-rw- permissions.
-		fd = ::open("./sdFormatLinux_dump.bin", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	int zeroRes;
+	if(m_zeroMethod == ZERO_PUNCH_HOLE)
+		zeroRes = fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+	else
+		zeroRes = ioctl(m_fd, (m_zeroMethod == ZERO_WRITE_ZEROES ? BLKZEROOUT : BLKDISCARD), range);
+	const int zeroErr = (zeroRes == -1 ? errno : 0);
+	m_stats.syscalls++;
+	m_stats.zeroNs += util::getNs() - startNs;
+	if(zeroRes == -1)
+	{
+		const int res = zeroErr;
+
+		// Some devices advertise support but reject the command. Let the caller write zeros.
+		if(res == EOPNOTSUPP || res == EINVAL || res == EIO)
+		{
+			m_zeroMethod = ZERO_NONE;
+			m_zeroAlignment = m_sectorSize;
+			return EOPNOTSUPP;
+		}
+
+		errno = res;
+		perror("Failed to zero block device range");
+		return res;
+	}
+	m_stats.zeroOuts++;
+	m_stats.zeroBytes += range[1];
+	addProgress(range[1]);
+
+	return 0;
+}
+
+int BlockDev::openImage(const char *const path, const u64 size) noexcept
+{
+	if(size == 0 || size % m_sectorSize != 0) return EINVAL;
+	m_stats = IoStats{};
+	m_threadStats = IoStats{};
+	m_progressBytes = 0;
+	m_progressDropped = 0;
+
+	int res = 0;
+	int fd = -1;
+	do
+	{
+		// Create file with -rw-rw-rw- permissions (minus umask).
+		fd = ::open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		if(fd == -1)
 		{
 			res = errno;
 			break;
 		}
-#endif
 
+		struct stat st;
+		if(fstat(fd, &st) == -1)
+		{
+			res = errno;
+			break;
+		}
+		if(!S_ISREG(st.st_mode))
+		{
+			fputs("Error: Image is not a regular file.\n", stderr);
+			res = EINVAL;
+			errno = res;
+			break;
+		}
+
+		if(ftruncate(fd, size) == -1)
+		{
+			res = errno;
+			break;
+		}
+
+		m_image = true;
 		m_fd = fd;
-		m_sectors = diskSize / m_sectorSize;
+		m_sectors = size / m_sectorSize;
+
+		// Punching holes needs filesystem block alignment.
+		const u32 blkSize = st.st_blksize;
+		if(blkSize >= m_sectorSize && (blkSize & (blkSize - 1)) == 0)
+		{
+			m_zeroMethod    = ZERO_PUNCH_HOLE;
+			m_zeroVerified  = true;
+			m_zeroAlignment = blkSize;
+		}
 	} while(0);
 
 	if(res != 0)
 	{
-		perror("Failed to open block device");
+		perror("Failed to open image file");
 		if(fd != -1) ::close(fd);
 	}
 	return res;
 }
 
-int BlockDev::read(void *buf, const u64 sector, const u64 count) const noexcept
+// Reads all bytes in 1 GiB chunks. Returns 0 on success or errno.
+static int preadAll(const int fd, void *buf, u64 size, off_t offset, u64 &syscalls)
 {
-	int res = 0;
-	const int fd = m_fd;
-	off_t offset = sector * m_sectorSize;
-	u64 totSize = count * m_sectorSize;
 	u8 *_buf = reinterpret_cast<u8*>(buf);
-	while(totSize > 0)
+	while(size > 0)
 	{
 		// Limit of 1 GiB chunks.
-		const size_t blkSize = (totSize > 0x40000000 ? 0x40000000 : totSize);
+		const size_t blkSize = (size > 0x40000000 ? 0x40000000 : size);
 		const ssize_t _read = ::pread(fd, _buf, blkSize, offset);
+		syscalls++;
 		if(_read == -1)
 		{
-			res = errno;
-			break;
+			if(errno == EINTR) continue;
+			return errno;
 		}
+		if(_read == 0) return EIO; // Beyond end of device.
 
 		_buf += _read;
 		offset += _read;
-		totSize -= _read;
+		size -= _read;
 	}
 
-	if(res != 0) perror("Failed to read from block device");
-	return res;
+	return 0;
 }
 
-int BlockDev::write(const void *buf, const u64 sector, const u64 count) noexcept
+int BlockDev::read(void *buf, const u64 sector, const u64 count) const noexcept
 {
-#ifdef REDIRECT_FOR_DEBUG
-	// Limit to 1 GiB in case we screw up in debug mode.
-	if(sector > ~count || sector + count > 0x40000000) return EINVAL;
-#endif
-
-	// Mark as dirty since we are about to write data.
-	m_dirty = true;
+	const int res = preadAll(m_fd, buf, count * m_sectorSize, sector * m_sectorSize, m_stats.syscalls);
+	m_stats.reads++;
+	m_stats.readBytes += count * m_sectorSize;
+	if(res != 0)
+	{
+		errno = res;
+		perror("Failed to read from block device");
+	}
+	return res;
+}
 
-	int res = 0;
-	const int fd = m_fd;
-	off_t offset = sector * m_sectorSize;
-	u64 totSize = count * m_sectorSize;
+// Writes all bytes in 1 GiB chunks. Returns 0 on success or errno.
+static int pwriteAll(const int fd, const void *buf, u64 size, off_t offset, u64 &syscalls)
+{
 	const u8 *_buf = reinterpret_cast<const u8*>(buf);
-	while(totSize > 0)
+	while(size > 0)
 	{
 		// Limit of 1 GiB chunks.
-		const size_t blkSize = (totSize > 0x40000000 ? 0x40000000 : totSize);
+		const size_t blkSize = (size > 0x40000000 ? 0x40000000 : size);
 		const ssize_t written = ::pwrite(fd, _buf, blkSize, offset);
+		syscalls++;
 		if(written == -1)
 		{
-			res = errno;
-			break;
+			if(errno == EINTR) continue;
+			return errno;
 		}
 
 		_buf += written;
 		offset += written;
-		totSize -= written;
+		size -= written;
 	}
 
-	if(res != 0) perror("Failed to write to block device");
+	return 0;
+}
+
+int BlockDev::write(const void *buf, const u64 sector, const u64 count) noexcept
+{
+	// Mark as dirty since we are about to write data.
+	m_dirty = true;
+
+	const u64 startNs = util::getNs();
+	const int res = pwriteAll(m_fd, buf, count * m_sectorSize, sector * m_sectorSize, m_stats.syscalls);
+	m_stats.writes++;
+	m_stats.writeBytes += count * m_sectorSize;
+	addLatency(m_stats.writeLatency, util::getNs() - startNs);
+	addProgress(count * m_sectorSize);
+	if(res != 0)
+	{
+		errno = res;
+		perror("Failed to write to block device");
+	}
 	return res;
 }
 
-int BlockDev::eraseAll(const bool secure) const noexcept
+int BlockDev::setQueueDepth(u32 depth, const bool useThread) noexcept
 {
+	if(m_uring.getInFlight() > 0 || m_threadInFlight > 0) return EBUSY;
+
+	depth = (depth < 1 ? 1 : (depth > m_maxQueueDepth ? m_maxQueueDepth : depth));
+	m_stats.syscalls += m_uring.getEnters();
+	m_uring.destroy();
+	stopThread();
+	m_queueDepth = 1;
+	m_asyncErr = 0;
+	m_backend = ASYNC_SYNC;
+
 	int res = 0;
-	const u64 wholeRange[2] = {0, m_sectors * m_sectorSize};
-	if(ioctl(m_fd, (secure ? BLKSECDISCARD : BLKDISCARD), wholeRange) == -1)
+	if(depth > 1)
 	{
-		res = errno;
-		perror("Failed to discard all data on device");
+		if(!useThread)
+		{
+			res = m_uring.init(depth);
+			if(res == 0) m_backend = ASYNC_URING;
+		}
+
+		// Fall back to the writer thread if io_uring is not available.
+		if(m_backend == ASYNC_SYNC)
+		{
+			res = startThread();
+			if(res == 0) m_backend = ASYNC_THREAD;
+		}
+
+		if(res == 0) m_queueDepth = depth;
 	}
 
 	return res;
 }
 
+int BlockDev::startThread(void) noexcept
+{
+	m_jobHead = 0;
+	m_jobCount = 0;
+	m_threadStop = false;
+	try
+	{
+		m_thread = std::thread(&BlockDev::threadMain, this);
+	}
+	catch(const std::system_error &e)
+	{
+		return e.code().value();
+	}
+
+	return 0;
+}
+
+void BlockDev::stopThread(void) noexcept
+{
+	if(!m_thread.joinable()) return;
+
+	{
+		std::lock_guard lock(m_threadMutex);
+		m_threadStop = true;
+	}
+	m_jobCv.notify_one();
+	m_thread.join();
+}
+
+void BlockDev::threadMain(void) noexcept
+{
+	std::unique_lock lock(m_threadMutex);
+	while(1)
+	{
+		m_jobCv.wait(lock, [this]{return m_jobCount > 0 || m_threadStop;});
+		if(m_jobCount == 0) break; // Stop requested and all jobs done.
+
+		const u32 slotIdx = m_jobQueue[m_jobHead];
+		m_jobHead = (m_jobHead + 1 < m_maxQueueDepth ? m_jobHead + 1 : 0);
+		m_jobCount--;
+		const AsyncSlot &slot = m_asyncSlots[slotIdx];
+
+		// Do the actual I/O without holding the lock so the caller can queue more.
+		lock.unlock();
+		int res;
+		u64 syscalls = 0;
+		if(slot.write) res = pwriteAll(m_fd, slot.iov.iov_base, slot.iov.iov_len, slot.offset, syscalls);
+		else           res = preadAll(m_fd, slot.iov.iov_base, slot.iov.iov_len, slot.offset, syscalls);
+		const u64 doneNs = util::getNs();
+		lock.lock();
+
+		m_threadStats.syscalls += syscalls;
+		if(slot.write)
+		{
+			m_threadStats.writes++;
+			m_threadStats.writeBytes += slot.iov.iov_len;
+			addLatency(m_threadStats.writeLatency, doneNs - slot.startNs);
+			addProgress(slot.iov.iov_len);
+		}
+		else
+		{
+			m_threadStats.reads++;
+			m_threadStats.readBytes += slot.iov.iov_len;
+		}
+
+		if(res != 0 && m_asyncErr == 0)
+		{
+			errno = res;
+			perror(slot.write ? "Failed to write to block device" : "Failed to read from block device");
+			m_asyncErr = res;
+		}
+		m_asyncPending[slot.tag]--;
+		m_asyncSlots[slotIdx].used = false;
+		m_threadInFlight--;
+		m_doneCv.notify_all();
+	}
+}
+
+int BlockDev::submitAsyncThread(const bool write, void *buf, const u64 sector, const u64 count, const u32 tag) noexcept
+{
+	std::unique_lock lock(m_threadMutex);
+
+	// Make room for another write.
+	m_doneCv.wait(lock, [this]{return m_threadInFlight < m_queueDepth || m_asyncErr != 0;});
+	if(m_asyncErr != 0) return m_asyncErr;
+
+	u32 slotIdx = 0;
+	while(m_asyncSlots[slotIdx].used) slotIdx++;
+
+	AsyncSlot &slot = m_asyncSlots[slotIdx];
+	slot.iov.iov_base = buf;
+	slot.iov.iov_len  = count * m_sectorSize;
+	slot.offset       = sector * m_sectorSize;
+	slot.startNs      = util::getNs();
+	slot.tag          = tag;
+	slot.write        = write;
+	slot.used         = true;
+	m_asyncPending[tag]++;
+	m_threadInFlight++;
+
+	u32 tail = m_jobHead + m_jobCount;
+	if(tail >= m_maxQueueDepth) tail -= m_maxQueueDepth;
+	m_jobQueue[tail] = slotIdx;
+	m_jobCount++;
+	lock.unlock();
+	m_jobCv.notify_one();
+
+	return 0;
+}
+
+int BlockDev::reapAsync(void) noexcept
+{
+	u64 slotIdx;
+	s32 result;
+	int res = m_uring.wait(slotIdx, result);
+	if(res != 0)
+	{
+		errno = res;
+		perror("Failed to wait for block device I/O");
+		return res;
+	}
+
+	AsyncSlot &slot = m_asyncSlots[slotIdx];
+	if(slot.write)
+	{
+		m_stats.writes++;
+		m_stats.writeBytes += slot.iov.iov_len;
+		addLatency(m_stats.writeLatency, util::getNs() - slot.startNs);
+		if(result > 0) addProgress(result);
+	}
+	else
+	{
+		m_stats.reads++;
+		m_stats.readBytes += slot.iov.iov_len;
+	}
+
+	if(result < 0)
+	{
+		res = -result;
+		errno = res;
+		perror(slot.write ? "Failed to write to block device" : "Failed to read from block device");
+	}
+	else if(static_cast<u32>(result) < slot.iov.iov_len)
+	{
+		// Short transfer. Finish the remainder synchronously.
+		u8 *const rest = reinterpret_cast<u8*>(slot.iov.iov_base) + result;
+		const u64 restSector = (slot.offset + result) / m_sectorSize;
+		const u64 restCount = (slot.iov.iov_len - result) / m_sectorSize;
+		if(slot.write) res = write(rest, restSector, restCount);
+		else           res = read(rest, restSector, restCount);
+	}
+
+	if(res != 0 && m_asyncErr == 0) m_asyncErr = res;
+	m_asyncPending[slot.tag]--;
+	slot.used = false;
+
+	return 0;
+}
+
+int BlockDev::submitAsync(const bool write, void *buf, const u64 sector, const u64 count, const u32 tag) noexcept
+{
+	if(count > 0x40000000 / m_sectorSize || tag >= m_maxAsyncTags) return EINVAL;
+	if(count == 0) return 0;
+
+	// Mark as dirty since we are about to write data.
+	if(write) m_dirty = true;
+
+	if(m_backend == ASYNC_THREAD) return submitAsyncThread(write, buf, sector, count, tag);
+	if(m_asyncErr != 0) return m_asyncErr;
+
+	// Make room for another request.
+	while(m_uring.getInFlight() >= m_queueDepth)
+	{
+		const int res = reapAsync();
+		if(res != 0) return res;
+	}
+
+	u32 slotIdx = 0;
+	while(m_asyncSlots[slotIdx].used) slotIdx++;
+
+	AsyncSlot &slot = m_asyncSlots[slotIdx];
+	slot.iov.iov_base = buf;
+	slot.iov.iov_len  = count * m_sectorSize;
+	slot.offset       = sector * m_sectorSize;
+	slot.startNs      = util::getNs();
+	slot.tag          = tag;
+	slot.write        = write;
+	const int res = m_uring.submit((write ? IORING_OP_WRITEV : IORING_OP_READV), m_fd, &slot.iov, slot.offset, slotIdx);
+	if(res != 0)
+	{
+		errno = res;
+		perror(write ? "Failed to write to block device" : "Failed to read from block device");
+		return res;
+	}
+	slot.used = true;
+	m_asyncPending[tag]++;
+
+	return 0;
+}
+
+int BlockDev::writeAsync(const void *buf, const u64 sector, const u64 count, const u32 tag) noexcept
+{
+	if(m_backend == ASYNC_SYNC) return write(buf, sector, count);
+	return submitAsync(true, const_cast<void*>(buf), sector, count, tag);
+}
+
+int BlockDev::readAsync(void *buf, const u64 sector, const u64 count, const u32 tag) noexcept
+{
+	if(m_backend == ASYNC_SYNC) return read(buf, sector, count);
+	return submitAsync(false, buf, sector, count, tag);
+}
+
+int BlockDev::waitAsync(const u32 tag) noexcept
+{
+	if(tag >= m_maxAsyncTags) return EINVAL;
+
+	if(m_backend == ASYNC_THREAD)
+	{
+		std::unique_lock lock(m_threadMutex);
+		m_doneCv.wait(lock, [this, tag]{return m_asyncPending[tag] == 0;});
+		return m_asyncErr;
+	}
+
+	while(m_asyncPending[tag] > 0)
+	{
+		const int res = reapAsync();
+		if(res != 0) return res;
+	}
+
+	return m_asyncErr;
+}
+
+int BlockDev::waitAllAsync(void) noexcept
+{
+	if(m_backend == ASYNC_THREAD)
+	{
+		std::unique_lock lock(m_threadMutex);
+		m_doneCv.wait(lock, [this]{return m_threadInFlight == 0;});
+		return m_asyncErr;
+	}
+
+	while(m_uring.getInFlight() > 0)
+	{
+		const int res = reapAsync();
+		if(res != 0) return res;
+	}
+
+	return m_asyncErr;
+}
+
+// Erases [start, end) in bytes. Apart from the progress counters only stats is written
+// so this can run on the erase thread.
+int BlockDev::eraseRange(const u64 start, const u64 end, const bool secure, IoStats &stats) const noexcept
+{
+	// Chunks end on erase unit boundaries so no erase block is split between two requests.
+	u64 unit = m_sectorSize;
+	if(m_limits.discardGranularity > unit) unit = std::lcm<u64>(unit, m_limits.discardGranularity);
+	if(m_limits.preferredEraseSize > 0)    unit = std::lcm<u64>(unit, m_limits.preferredEraseSize);
+	u64 chunkSize = m_eraseChunk;
+	if(m_limits.discardMaxBytes >= unit && m_limits.discardMaxBytes < chunkSize) chunkSize = m_limits.discardMaxBytes;
+	chunkSize = (chunkSize > unit ? chunkSize - chunkSize % unit : unit);
+
+	int res = (m_image && secure ? EOPNOTSUPP : 0);
+	u64 offset = start;
+	while(offset < end && res == 0)
+	{
+		if(m_eraseCancel.load(std::memory_order_relaxed))
+		{
+			res = ECANCELED;
+			break;
+		}
+
+		const u64 next = std::min((offset / chunkSize + 1) * chunkSize, end);
+		const u64 range[2] = {offset, next - offset};
+		const u64 startNs = util::getNs();
+		int eraseRes;
+		if(m_image)
+			eraseRes = fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+		else
+			eraseRes = ioctl(m_fd, (secure ? BLKSECDISCARD : BLKDISCARD), range);
+		const int eraseErr = (eraseRes == -1 ? errno : 0);
+		const u64 ns = util::getNs() - startNs;
+		stats.syscalls++;
+		stats.eraseNs += ns;
+
+		if(eraseRes == -1)
+		{
+			errno = eraseErr;
+			perror("Failed to discard all data on device");
+			res = eraseErr;
+			break;
+		}
+		stats.erases++;
+		stats.eraseBytes += range[1];
+		addLatency(stats.eraseLatency, ns);
+		m_progressBytes.fetch_add(range[1], std::memory_order_relaxed);
+
+		offset = next;
+	}
+
+	// The rest will never be erased.
+	if(offset < end) m_progressDropped.fetch_add(end - offset, std::memory_order_relaxed);
+
+	return res;
+}
+
+int BlockDev::eraseAll(const bool secure) const noexcept
+{
+	return eraseRange(0, m_sectors * m_sectorSize, secure, m_stats);
+}
+
+int BlockDev::startErase(const u64 sector, const bool secure) noexcept
+{
+	if(m_eraseThread.joinable() || sector > m_sectors) return EINVAL;
+
+	m_eraseStats = IoStats{};
+	m_eraseRes = 0;
+	try
+	{
+		m_eraseThread = std::thread([this, sector, secure]
+		{
+			m_eraseRes = eraseRange(sector * m_sectorSize, m_sectors * m_sectorSize, secure, m_eraseStats);
+		});
+	}
+	catch(const std::system_error &e)
+	{
+		return e.code().value();
+	}
+
+	return 0;
+}
+
+int BlockDev::finishErase(void) noexcept
+{
+	if(!m_eraseThread.joinable()) return m_eraseRes;
+	m_eraseThread.join();
+
+	m_stats.syscalls   += m_eraseStats.syscalls;
+	m_stats.eraseNs    += m_eraseStats.eraseNs;
+	m_stats.erases     += m_eraseStats.erases;
+	m_stats.eraseBytes += m_eraseStats.eraseBytes;
+	for(u32 i = 0; i < IO_LATENCY_BUCKETS; i++) m_stats.eraseLatency[i] += m_eraseStats.eraseLatency[i];
+
+	return m_eraseRes;
+}
+
+IoStats BlockDev::getIoStats(void) noexcept
+{
+	IoStats stats = m_stats;
+	stats.syscalls += m_uring.getEnters();
+
+	std::lock_guard lock(m_threadMutex);
+	stats.readBytes  += m_threadStats.readBytes;
+	stats.writeBytes += m_threadStats.writeBytes;
+	stats.reads      += m_threadStats.reads;
+	stats.writes     += m_threadStats.writes;
+	stats.syscalls   += m_threadStats.syscalls;
+	for(u32 i = 0; i < IO_LATENCY_BUCKETS; i++) stats.writeLatency[i] += m_threadStats.writeLatency[i];
+
+	return stats;
+}
+
+int BlockDev::flush(void) noexcept
+{
+	const int res = waitAllAsync();
+	if(res != 0) return res;
+
+	const u64 startNs = util::getNs();
+	const int flushRes = fsync(m_fd);
+	const int flushErr = (flushRes == -1 ? errno : 0);
+	m_stats.flushNs += util::getNs() - startNs;
+	m_stats.syscalls++;
+	if(flushRes == -1)
+	{
+		errno = flushErr;
+		perror("Failed to flush block device");
+	}
+
+	return flushErr;
+}
+
 // TODO: Should we return any error that is not EINTR?
 void BlockDev::close(void) noexcept
 {
 	const int fd = m_fd;
+
+	// Make sure no writes or erases are in flight before flushing.
+	finishErase();
+	waitAllAsync();
+	m_stats.syscalls += m_uring.getEnters();
+	m_uring.destroy();
+	stopThread();
+
 	if(m_dirty)
 	{
 		// Flush all writes to the device.
+		u64 startNs = util::getNs();
 		fsync(fd);
+		m_stats.flushNs += util::getNs() - startNs;
+		m_stats.syscalls++;
 
 		// Force partition rescanning so the kernel can see the changes.
-		ioctl(fd, BLKRRPART);
+		if(!m_image)
+		{
+			startNs = util::getNs();
+			ioctl(fd, BLKRRPART);
+			m_stats.rescanNs = util::getNs() - startNs;
+			m_stats.syscalls++;
+		}
 	}
 
 	// Close the file descriptor.
 	while(::close(fd) == -1 && errno == EINTR);
 
 	m_dirty = false;
+	m_direct = false;
+	m_image = false;
 	m_fd = -1;
 	m_sectors = 0;
+	m_ioAlignment = m_sectorSize;
+	m_limits = QueueLimits{};
+	m_zeroMethod = ZERO_NONE;
+	m_zeroVerified = false;
+	m_zeroAlignment = m_sectorSize;
+	m_queueDepth = 1;
+	m_asyncErr = 0;
+	m_backend = ASYNC_SYNC;
+	m_eraseRes = 0;
 }
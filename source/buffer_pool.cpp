@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <cstdlib>
+#include "buffer_pool.h"
+#include "blockdev.h"
+
+
+
+BufferPool::~BufferPool(void) noexcept
+{
+	for(const auto &entry : m_free) free(entry.first);
+}
+
+u8* BufferPool::acquire(const size_t size) noexcept
+{
+	std::unique_lock lock(m_mutex);
+	m_releasedCv.wait(lock, [&]{return m_used == 0 || m_used + size <= m_budget;});
+
+	for(auto it = m_free.begin(); it != m_free.end(); ++it)
+	{
+		if(it->second != size) continue;
+
+		u8 *const buf = it->first;
+		m_free.erase(it);
+		m_cached -= size;
+		m_used += size;
+		return buf;
+	}
+
+	// Make room by freeing cached buffers of other sizes.
+	while(!m_free.empty() && m_used + m_cached + size > m_budget)
+	{
+		free(m_free.back().first);
+		m_cached -= m_free.back().second;
+		m_free.pop_back();
+	}
+
+	u8 *const buf = reinterpret_cast<u8*>(aligned_alloc(BlockDev::getBufAlignment(), size));
+	if(buf != nullptr) m_used += size;
+
+	return buf;
+}
+
+void BufferPool::release(u8 *const buf, const size_t size) noexcept
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_used -= size;
+		try
+		{
+			m_free.emplace_back(buf, size);
+			m_cached += size;
+		}
+		catch(...)
+		{
+			free(buf);
+		}
+	}
+
+	m_releasedCv.notify_all();
+}
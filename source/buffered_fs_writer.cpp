@@ -2,11 +2,112 @@
 // Copyright (c) 2023 profi200
 
 //#include <cstdio>
+#include <algorithm>
+#include <bit>
+#include <cerrno>
 #include <cstring>
+#include <exception>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
 #include "buffered_fs_writer.h"
 
 
 
+int BufferedFsWriter::open(const char *const path, const u32 queueDepth, const bool useThread, const bool direct,
+                           BufferPool *const pool) noexcept
+{
+	const int res = BlockDev::open(path, true, direct);
+	if(res != 0) return res;
+
+	return setupBuffers(queueDepth, useThread, pool);
+}
+
+int BufferedFsWriter::openImage(const char *const path, const u64 size, const u32 queueDepth, const bool useThread) noexcept
+{
+	const int res = BlockDev::openImage(path, size);
+	if(res != 0) return res;
+
+	return setupBuffers(queueDepth, useThread, nullptr);
+}
+
+int BufferedFsWriter::setupBuffers(const u32 queueDepth, const bool useThread, BufferPool *const pool) noexcept
+{
+	// Fall back to synchronous writes if neither io_uring nor the writer thread are available.
+	BlockDev::setQueueDepth(queueDepth, useThread);
+
+	// Don't make requests bigger than the kernel allows to avoid splitting.
+	// A bigger optimal I/O size wins since the device asks for it.
+	const QueueLimits &limits = BlockDev::getQueueLimits();
+	u32 blkSize = m_defBlkSize;
+	if(limits.maxIoSize > 0) blkSize = std::bit_floor(limits.maxIoSize);
+	if(limits.optimalIoSize > blkSize) blkSize = std::bit_floor(limits.optimalIoSize);
+	blkSize = std::clamp(blkSize, m_minBlkSize, m_maxBlkSize);
+	m_blkSize = blkSize;
+	m_blkMask = blkSize - 1;
+	m_bufCount = BlockDev::getQueueDepth();
+	m_bufIdx   = 0;
+
+	// Pooled buffers are taken later so idle writers don't hold memory.
+	m_pool = pool;
+	if(pool != nullptr) return 0;
+
+	const size_t size = (size_t)m_blkSize * m_bufCount;
+	m_bufs = std::unique_ptr<u8[], BufDeleter>(reinterpret_cast<u8*>(aligned_alloc(BlockDev::getBufAlignment(), size)),
+	                                           BufDeleter{nullptr, size});
+	if(!m_bufs)
+	{
+		BlockDev::close();
+		return ENOMEM;
+	}
+	m_buf = m_bufs.get();
+
+	return 0;
+}
+
+int BufferedFsWriter::acquireBuffers(void) noexcept
+{
+	if(m_bufs) return 0;
+	if(m_pool == nullptr) return EINVAL;
+
+	const size_t size = (size_t)m_blkSize * m_bufCount;
+	m_bufs = std::unique_ptr<u8[], BufDeleter>(m_pool->acquire(size), BufDeleter{m_pool, size});
+	if(!m_bufs) return ENOMEM;
+	m_buf    = m_bufs.get();
+	m_bufIdx = 0;
+
+	return 0;
+}
+
+// Switches to the next buffer and waits until it is no longer in use.
+int BufferedFsWriter::nextBuffer(void) noexcept
+{
+	const u32 bufIdx = (m_bufIdx + 1 < m_bufCount ? m_bufIdx + 1 : 0);
+	m_bufIdx = bufIdx;
+	m_buf = &m_bufs[m_blkSize * bufIdx];
+
+	return BlockDev::waitAsync(bufIdx);
+}
+
+// Writes zeros from buffer aligned start to buffer aligned end.
+int BufferedFsWriter::writeZeroBlocks(u64 start, const u64 end) noexcept
+{
+	if(start == end) return 0;
+
+	// The same zero buffer can be in flight multiple times.
+	memset(m_buf, 0, m_blkSize);
+	do
+	{
+		const int res = BlockDev::writeAsync(m_buf, start / 512, m_blkSize / 512, m_bufIdx);
+		if(res != 0) return res;
+
+		start += m_blkSize;
+	} while(start < end);
+
+	return nextBuffer();
+}
+
 // TODO: Edge case testing.
 int BufferedFsWriter::fill(const u64 offset) noexcept
 {
@@ -14,6 +115,12 @@ int BufferedFsWriter::fill(const u64 offset) noexcept
 	u64 pos = m_pos;
 	if(pos == offset) return 0;
 	if(offset < pos)  return EINVAL;
+	if(m_planning)
+	{
+		const int res = planAdd(nullptr, offset - pos);
+		if(res == 0) m_pos = offset;
+		return res;
+	}
 
 	// Align to buffer size.
 	const u64 distance = offset - pos;
@@ -24,31 +131,40 @@ int BufferedFsWriter::fill(const u64 offset) noexcept
 		memset(&m_buf[pos & m_blkMask], 0, fillSize);
 		if(fillSize == misalignment)
 		{
-			const int res = BlockDev::write(m_buf.get(), (pos & ~((u64)m_blkMask)) / 512, m_blkSize / 512);
+			int res = BlockDev::writeAsync(m_buf, (pos & ~((u64)m_blkMask)) / 512, m_blkSize / 512, m_bufIdx);
+			if(res == 0) res = nextBuffer();
 			if(res != 0) return res;
 		}
 		pos += fillSize;
 	}
 
 	// Write full blocks.
-	u64 blocksToWrite = (offset - pos) / m_blkSize;
-	if(blocksToWrite > 0)
+	const u64 blocksEnd = pos + (offset - pos) / m_blkSize * m_blkSize;
+	if(pos < blocksEnd)
 	{
-		memset(m_buf.get(), 0, m_blkSize);
-		do
+		// Let the device zero the aligned part of the range if it can.
+		const u64 zeroMask = BlockDev::getZeroAlignment() - 1;
+		const u64 zeroStart = (pos + zeroMask) & ~zeroMask;
+		const u64 zeroEnd = blocksEnd & ~zeroMask;
+		int res = EOPNOTSUPP;
+		if(BlockDev::getZeroMethod() != BlockDev::ZERO_NONE && zeroStart < zeroEnd)
 		{
-			const int res = BlockDev::write(m_buf.get(), pos / 512, m_blkSize / 512);
-			if(res != 0) return res;
+			res = BlockDev::zeroOut(zeroStart / 512, (zeroEnd - zeroStart) / 512);
+			if(res == 0)
+			{
+				res = writeZeroBlocks(pos, zeroStart);
+				if(res == 0) res = writeZeroBlocks(zeroEnd, blocksEnd);
+			}
+		}
+		if(res == EOPNOTSUPP) res = writeZeroBlocks(pos, blocksEnd);
+		if(res != 0) return res;
 
-			pos += m_blkSize;
-		} while(--blocksToWrite);
-	}
-	else
-	{
-		// Remaining bytes.
-		memset(m_buf.get(), 0, offset - pos);
+		pos = blocksEnd;
 	}
 
+	// Remaining bytes.
+	memset(m_buf, 0, offset - pos);
+
 	m_pos = offset;
 
 	return 0;
@@ -62,6 +178,12 @@ int BufferedFsWriter::write(const void *buf, const u64 size) noexcept
 	const u64 end = pos + size;
 	if(size == 0) return 0;
 	if(end < size) return EINVAL;
+	if(m_planning)
+	{
+		const int res = planAdd(buf, size);
+		if(res == 0) m_pos = end;
+		return res;
+	}
 
 	// Align to buffer size.
 	const u8 *_buf = reinterpret_cast<const u8*>(buf);
@@ -72,7 +194,8 @@ int BufferedFsWriter::write(const void *buf, const u64 size) noexcept
 		memcpy(&m_buf[pos & m_blkMask], _buf, copySize);
 		if(copySize == misalignment)
 		{
-			const int res = BlockDev::write(m_buf.get(), (pos & ~((u64)m_blkMask)) / 512, m_blkSize / 512);
+			int res = BlockDev::writeAsync(m_buf, (pos & ~((u64)m_blkMask)) / 512, m_blkSize / 512, m_bufIdx);
+			if(res == 0) res = nextBuffer();
 			if(res != 0) return res;
 		}
 		_buf += copySize;
@@ -80,41 +203,806 @@ int BufferedFsWriter::write(const void *buf, const u64 size) noexcept
 	}
 
 	// Write full blocks.
-	while(pos < (end & ~((u64)m_blkMask))) // TODO: Use this same calculation in seekAndFill()?
+	// O_DIRECT needs aligned memory. Copy through our buffers if the caller buffer isn't.
+	if(BlockDev::isDirect() && (reinterpret_cast<uintptr_t>(_buf) & (BlockDev::getBufAlignment() - 1)) != 0)
 	{
-		const int res = BlockDev::write(_buf, pos / 512, m_blkSize / 512);
-		if(res != 0) return res;
+		while(pos < (end & ~((u64)m_blkMask)))
+		{
+			memcpy(m_buf, _buf, m_blkSize);
+			int res = BlockDev::writeAsync(m_buf, pos / 512, m_blkSize / 512, m_bufIdx);
+			if(res == 0) res = nextBuffer();
+			if(res != 0) return res;
+
+			_buf += m_blkSize;
+			pos += m_blkSize;
+		}
+	}
+	else if(pos < (end & ~((u64)m_blkMask)))
+	{
+		do // TODO: Use this same calculation in seekAndFill()?
+		{
+			const int res = BlockDev::writeAsync(_buf, pos / 512, m_blkSize / 512, m_callerTag);
+			if(res != 0) return res;
 
-		_buf += m_blkSize;
-		pos += m_blkSize;
+			_buf += m_blkSize;
+			pos += m_blkSize;
+		} while(pos < (end & ~((u64)m_blkMask)));
+
+		// The caller buffer may be gone after returning.
+		const int res = BlockDev::waitAsync(m_callerTag);
+		if(res != 0) return res;
 	}
 
 	// Remaining bytes.
-	memcpy(m_buf.get(), _buf, end - pos);
+	memcpy(m_buf, _buf, end - pos);
 
 	m_pos = end;
 
 	return 0;
 }
 
+// Reads exactly size bytes. Files shorter than recorded are an error.
+static int preadFull(const int fd, u8 *buf, u64 offset, u64 size) noexcept
+{
+	while(size > 0)
+	{
+		const ssize_t res = pread(fd, buf, size, offset);
+		if(res < 0)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+		if(res == 0) return EIO;
+
+		buf += res;
+		offset += res;
+		size -= res;
+	}
+
+	return 0;
+}
+
+int BufferedFsWriter::writeFile(const char *const path, const u64 size) noexcept
+{
+	if(size == 0) return 0;
+	if(m_planning)
+	{
+		try
+		{
+			m_planFiles.emplace_back(path);
+			m_planExtents.push_back(PlanExtent{m_pos, size, m_planFile | (m_planFiles.size() - 1)});
+		}
+		catch(const std::bad_alloc&)
+		{
+			return ENOMEM;
+		}
+
+		m_pos += size;
+		return 0;
+	}
+
+	const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) return errno;
+
+	int res = 0;
+	for(u64 offset = 0; offset < size && res == 0;)
+	{
+		const u32 bufPos = m_pos & m_blkMask;
+		const u32 len = (size - offset > m_blkSize - bufPos ? m_blkSize - bufPos : size - offset);
+		res = preadFull(fd, &m_buf[bufPos], offset, len);
+		if(res != 0) break;
+		offset += len;
+		m_pos += len;
+
+		if((m_pos & m_blkMask) == 0) res = submitBuffer();
+	}
+	::close(fd);
+
+	return res;
+}
+
+int BufferedFsWriter::startPlan(void) noexcept
+{
+	if(m_planning || (m_pos & m_blkMask) != 0) return EINVAL;
+
+	m_planning  = true;
+	m_planStart = m_pos;
+	m_planExtents.clear();
+	m_planData.clear();
+	m_planFiles.clear();
+
+	return 0;
+}
+
+// Appends data or zeros (buf = nullptr) to the plan. Merges with the last extent if possible.
+int BufferedFsWriter::planAdd(const void *buf, const u64 size) noexcept
+{
+	if(buf == nullptr)
+	{
+		try
+		{
+			if(!m_planExtents.empty() && m_planExtents.back().dataOffset == m_planZero)
+				m_planExtents.back().length += size;
+			else
+				m_planExtents.push_back(PlanExtent{m_pos, size, m_planZero});
+		}
+		catch(const std::bad_alloc&)
+		{
+			return ENOMEM;
+		}
+
+		return 0;
+	}
+
+	u8 *dst;
+	const int res = planReserve(size, dst);
+	if(res == 0) memcpy(dst, buf, size);
+
+	return res;
+}
+
+// Appends size bytes of uninitialized data at the current position to the plan.
+int BufferedFsWriter::planReserve(const u64 size, u8 *&dst) noexcept
+{
+	try
+	{
+		const u64 dataOffset = m_planData.size();
+		m_planData.resize(dataOffset + size);
+		dst = &m_planData[dataOffset];
+
+		// Zero and file extents have the top bit set.
+		if(!m_planExtents.empty() && (m_planExtents.back().dataOffset & m_planFile) == 0)
+			m_planExtents.back().length += size;
+		else
+			m_planExtents.push_back(PlanExtent{m_pos, size, dataOffset});
+	}
+	catch(const std::bad_alloc&)
+	{
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+// Writes the current buffer which is full and ends at m_pos. Then switches to the next one.
+int BufferedFsWriter::submitBuffer(void) noexcept
+{
+	int res = BlockDev::writeAsync(m_buf, (m_pos - m_blkSize) / 512, m_blkSize / 512, m_bufIdx);
+	if(res == 0) res = nextBuffer();
+
+	return res;
+}
+
+// Reads from a file of the plan. The file stays open for the next chunk.
+int BufferedFsWriter::readPlanFile(const size_t fileIdx, u8 *dst, u64 offset, u64 size) noexcept
+{
+	if(m_planFd == -1 || m_planFdIdx != fileIdx)
+	{
+		closePlanFile();
+		m_planFd = ::open(m_planFiles[fileIdx].c_str(), O_RDONLY | O_CLOEXEC);
+		if(m_planFd == -1) return errno;
+		m_planFdIdx = fileIdx;
+	}
+
+	return preadFull(m_planFd, dst, offset, size);
+}
+
+void BufferedFsWriter::closePlanFile(void) noexcept
+{
+	if(m_planFd != -1) ::close(m_planFd);
+	m_planFd = -1;
+}
+
+// Copies all data in [start, end) into dst. Zero extents are skipped. dst must be zeroed.
+int BufferedFsWriter::copyPlanData(u8 *const dst, const u64 start, const u64 end, size_t &extIdx) noexcept
+{
+	const size_t numExtents = m_planExtents.size();
+	while(extIdx < numExtents && m_planExtents[extIdx].offset + m_planExtents[extIdx].length <= start) extIdx++;
+
+	for(size_t i = extIdx; i < numExtents && m_planExtents[i].offset < end; i++)
+	{
+		const PlanExtent &ext = m_planExtents[i];
+		if(ext.dataOffset == m_planZero) continue;
+
+		const u64 copyStart = (ext.offset > start ? ext.offset : start);
+		const u64 extEnd    = ext.offset + ext.length;
+		const u64 copyEnd   = (extEnd < end ? extEnd : end);
+		if(ext.dataOffset & m_planFile)
+		{
+			const int res = readPlanFile(ext.dataOffset & ~m_planFile, &dst[copyStart - start],
+			                             copyStart - ext.offset, copyEnd - copyStart);
+			if(res != 0) return res;
+		}
+		else memcpy(&dst[copyStart - start], &m_planData[ext.dataOffset + (copyStart - ext.offset)], copyEnd - copyStart);
+	}
+
+	return 0;
+}
+
+// Writes [start, end) in chunks of up to the buffer size.
+int BufferedFsWriter::planRun(u64 start, const u64 end, size_t extIdx, PlanStats &stats, const bool execute) noexcept
+{
+	if(start >= end) return 0;
+
+	stats.writeBytes += end - start;
+	stats.writes += (end - start + m_blkMask) / m_blkSize;
+	if(!execute) return 0;
+	if(m_differential) return planRunDiff(start, end, extIdx, stats);
+
+	do
+	{
+		const u32 chunkSize = (end - start > m_blkSize ? m_blkSize : end - start);
+		memset(m_buf, 0, chunkSize);
+		int res = copyPlanData(m_buf, start, start + chunkSize, extIdx);
+		if(res == 0) res = writeChunk(start, chunkSize);
+		if(res != 0) return res;
+
+		start += chunkSize;
+	} while(start < end);
+
+	return 0;
+}
+
+// Joins the background erase and notifies the caller the first time.
+int BufferedFsWriter::joinErase(void) noexcept
+{
+	const bool started = (m_eraseStart != m_noErase);
+	m_eraseStart = m_noErase;
+	const int res = BlockDev::finishErase();
+	if(started && m_onEraseJoined != nullptr) m_onEraseJoined();
+	m_onEraseJoined = nullptr;
+
+	return res;
+}
+
+// Waits for the background erase before I/O up to end can touch the erased range.
+// The result is kept for finishErase(). Only cancelling stops the plan.
+int BufferedFsWriter::waitErase(const u64 end) noexcept
+{
+	if(end <= m_eraseStart) return 0;
+
+	const int res = joinErase();
+
+	return (res == ECANCELED ? res : 0);
+}
+
+// Writes size bytes of the current buffer at start and switches to the next buffer.
+int BufferedFsWriter::writeChunk(const u64 start, const u32 size) noexcept
+{
+	if(m_broadcast != nullptr) return broadcastChunk(start, size);
+
+	int res = waitErase(start + size);
+	if(res == 0) res = BlockDev::writeAsync(m_buf, start / 512, size / 512, m_bufIdx);
+	if(res == 0) res = nextBuffer();
+
+	return res;
+}
+
+// Failed devices are marked in the results and skipped. Only fails if no device is left.
+int BufferedFsWriter::broadcastChunk(const u64 start, const u32 size) noexcept
+{
+	const std::vector<BufferedFsWriter*> &targets = *m_broadcast->targets;
+	std::vector<int> &results = *m_broadcast->results;
+	u8 *const scratch = m_broadcast->scratch;
+	const u64 end = start + size;
+	for(size_t t = 0; t < targets.size(); t++)
+	{
+		if(results[t] != 0) continue;
+
+		// Patched chunks are rare (boot sectors). Write them synchronously from a copy.
+		BlockDev &dev = *targets[t];
+		bool patched = false;
+		for(const PlanPatch &patch : (*m_broadcast->patches)[t])
+		{
+			const u64 patchEnd = patch.offset + patch.data.size();
+			if(patch.offset >= end || patchEnd <= start) continue;
+
+			if(!patched) memcpy(scratch, m_buf, size);
+			patched = true;
+			const u64 copyStart = (patch.offset > start ? patch.offset : start);
+			const u64 copyEnd   = (patchEnd < end ? patchEnd : end);
+			memcpy(&scratch[copyStart - start], &patch.data[copyStart - patch.offset], copyEnd - copyStart);
+		}
+
+		if(patched) results[t] = dev.write(scratch, start / 512, size / 512);
+		else        results[t] = dev.writeAsync(m_buf, start / 512, size / 512, m_bufIdx);
+	}
+
+	// The next buffer can only be reused once all devices are done with it.
+	m_bufIdx = (m_bufIdx + 1 < m_bufCount ? m_bufIdx + 1 : 0);
+	m_buf = &m_bufs[m_blkSize * m_bufIdx];
+	int res = ENODEV;
+	for(size_t t = 0; t < targets.size(); t++)
+	{
+		if(results[t] == 0) results[t] = targets[t]->BlockDev::waitAsync(m_bufIdx);
+		if(results[t] == 0) res = 0;
+	}
+
+	return res;
+}
+
+// Zeros [start, end) on one device of a broadcast. Devices which can't offload
+// or need a different alignment get zeros written.
+int BufferedFsWriter::broadcastZerosTo(BufferedFsWriter &dev, const u64 start, const u64 end) noexcept
+{
+	const u64 alignMask = dev.BlockDev::getZeroAlignment() - 1;
+	int res = EOPNOTSUPP;
+	if(dev.BlockDev::getZeroMethod() != BlockDev::ZERO_NONE && ((start | end) & alignMask) == 0)
+		res = dev.BlockDev::zeroOut(start / 512, (end - start) / 512);
+	if(res != EOPNOTSUPP) return res;
+
+	const u8 *const zeros = m_broadcast->scratch;
+	res = 0;
+	for(u64 pos = start; pos < end && res == 0; pos += m_blkSize)
+	{
+		const u64 size = (end - pos > m_blkSize ? m_blkSize : end - pos);
+		res = dev.BlockDev::writeAsync(zeros, pos / 512, size / 512, m_callerTag);
+	}
+	if(res == 0) res = dev.BlockDev::waitAsync(m_callerTag);
+
+	return res;
+}
+
+// Zeros [start, end) on all devices at the same time. Offloading and writing zeros
+// both block so every device gets its own thread. Otherwise one device without
+// offload would hold up all others for the whole range.
+int BufferedFsWriter::broadcastZeros(const u64 start, const u64 end) noexcept
+{
+	const std::vector<BufferedFsWriter*> &targets = *m_broadcast->targets;
+	std::vector<int> &results = *m_broadcast->results;
+	memset(m_broadcast->scratch, 0, m_blkSize);
+
+	// If a thread can't be created the device is zeroed on this thread instead.
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < targets.size(); t++)
+	{
+		if(results[t] != 0) continue;
+
+		try
+		{
+			threads.emplace_back([this, &targets, &results, t, start, end]
+			{
+				results[t] = broadcastZerosTo(*targets[t], start, end);
+			});
+		}
+		catch(const std::exception&)
+		{
+			results[t] = broadcastZerosTo(*targets[t], start, end);
+		}
+	}
+	for(std::thread &thread : threads) thread.join();
+
+	int res = ENODEV;
+	for(size_t t = 0; t < targets.size(); t++)
+		if(results[t] == 0) res = 0;
+
+	return res;
+}
+
+// Reads run ahead in all buffers. A buffer is reused for the next read after
+// its chunk was compared. Chunks which differ are written from the same buffer
+// which then has to finish before the next read into it.
+int BufferedFsWriter::planRunDiff(u64 start, const u64 end, size_t extIdx, PlanStats &stats) noexcept
+{
+	const u32 bufCount = m_bufCount;
+	u64 readPos = start;
+	int res = waitErase(end);
+	for(u32 i = 0; i < bufCount && readPos < end && res == 0; i++)
+	{
+		const u32 chunkSize = (end - readPos > m_blkSize ? m_blkSize : end - readPos);
+		res = BlockDev::readAsync(&m_bufs[m_blkSize * i], readPos / 512, chunkSize / 512, i);
+		readPos += chunkSize;
+	}
+
+	u8 *const expected = m_cmpBuf.get();
+	for(u32 i = 0; start < end && res == 0; i = (i + 1 < bufCount ? i + 1 : 0))
+	{
+		u8 *const buf = &m_bufs[m_blkSize * i];
+		const u32 chunkSize = (end - start > m_blkSize ? m_blkSize : end - start);
+		res = BlockDev::waitAsync(i);
+		if(res != 0) break;
+
+		memset(expected, 0, chunkSize);
+		res = copyPlanData(expected, start, start + chunkSize, extIdx);
+		if(res != 0) break;
+
+		// memcmp() is vectorized and mostly compares zeros with zeros.
+		if(memcmp(buf, expected, chunkSize) != 0)
+		{
+			memcpy(buf, expected, chunkSize);
+			res = BlockDev::writeAsync(buf, start / 512, chunkSize / 512, i);
+			if(res == 0 && readPos < end) res = BlockDev::waitAsync(i);
+		}
+		else
+		{
+			stats.skippedBytes += chunkSize;
+			BlockDev::addProgress(chunkSize);
+		}
+
+		if(res == 0 && readPos < end)
+		{
+			const u32 readSize = (end - readPos > m_blkSize ? m_blkSize : end - readPos);
+			res = BlockDev::readAsync(buf, readPos / 512, readSize / 512, i);
+			readPos += readSize;
+		}
+		start += chunkSize;
+	}
+
+	// Leave all buffers free for the next run.
+	const int waitRes = BlockDev::waitAllAsync();
+
+	return (res != 0 ? res : waitRes);
+}
+
+// Splits the plan into data runs and big zero ranges. Only counts if execute is false.
+int BufferedFsWriter::walkPlan(PlanStats &stats, const bool execute) noexcept
+{
+	stats = PlanStats{};
+	stats.extents = m_planExtents.size();
+	for(const PlanExtent &ext : m_planExtents)
+	{
+		if(ext.dataOffset == m_planZero) stats.zeroBytes += ext.length;
+		else                             stats.dataBytes += ext.length;
+		if(ext.dataOffset != m_planZero && (ext.dataOffset & m_planFile)) stats.fileBytes += ext.length;
+	}
+
+	// Zero ranges must be aligned for the device and for O_DIRECT runs in between.
+	u64 align = BlockDev::getZeroAlignment();
+	if(align < BlockDev::getIoAlignment()) align = BlockDev::getIoAlignment();
+	if(align < BlockDev::getBufAlignment()) align = BlockDev::getBufAlignment();
+	const u64 alignMask = align - 1;
+
+	u64 runStart = m_planStart;
+	size_t runExt = 0;
+	for(size_t i = 0; i < m_planExtents.size(); i++)
+	{
+		const PlanExtent &ext = m_planExtents[i];
+		if(m_differential || BlockDev::getZeroMethod() == BlockDev::ZERO_NONE || ext.dataOffset != m_planZero) continue;
+
+		const u64 zeroStart = (ext.offset + alignMask) & ~alignMask;
+		const u64 zeroEnd   = (ext.offset + ext.length) & ~alignMask;
+		if(zeroEnd <= zeroStart || zeroEnd - zeroStart < m_minZeroOffload) continue;
+
+		int res = planRun(runStart, zeroStart, runExt, stats, execute);
+		if(res != 0) return res;
+
+		stats.offloadBytes += zeroEnd - zeroStart;
+		stats.offloads++;
+		if(execute)
+		{
+			if(m_broadcast != nullptr) res = broadcastZeros(zeroStart, zeroEnd);
+			else
+			{
+				res = waitErase(zeroEnd);
+				if(res == 0) res = BlockDev::zeroOut(zeroStart / 512, (zeroEnd - zeroStart) / 512);
+				if(res == EOPNOTSUPP) res = planRun(zeroStart, zeroEnd, i, stats, execute);
+			}
+			if(res != 0) return res;
+		}
+
+		runStart = zeroEnd;
+		runExt = i;
+	}
+
+	// The last run is padded to the I/O alignment like in close().
+	const u64 ioMask = BlockDev::getIoAlignment() - 1;
+	return planRun(runStart, (m_pos + ioMask) & ~ioMask, runExt, stats, execute);
+}
+
+int BufferedFsWriter::setDifferential(const bool enable) noexcept
+{
+	m_differential = false;
+	m_cmpBuf.reset();
+	if(!enable) return 0;
+
+	m_cmpBuf.reset(new(std::nothrow) u8[m_blkSize]);
+	if(!m_cmpBuf) return ENOMEM;
+	m_differential = true;
+
+	return 0;
+}
+
+int BufferedFsWriter::executePlan(PlanStats *const stats, const bool keepPlan) noexcept
+{
+	if(!m_planning) return EINVAL;
+
+	PlanStats tmpStats;
+	int res = walkPlan(stats != nullptr ? *stats : tmpStats, true);
+
+	// Wait for the last writes and the erase so the result and progress are complete.
+	const int waitRes = BlockDev::waitAllAsync();
+	if(res == 0) res = waitRes;
+	const int eraseRes = waitErase(m_noErase);
+	if(res == 0) res = eraseRes;
+
+	// A kept plan stays in planning mode so close() writes nothing.
+	if(keepPlan) return res;
+
+	// Everything is written. Leave nothing for close() to flush.
+	m_planning = false;
+	m_planExtents = std::vector<PlanExtent>();
+	m_planData = std::vector<u8>();
+	m_planFiles = std::vector<std::string>();
+	closePlanFile();
+	m_pos = 0;
+
+	return res;
+}
+
+int BufferedFsWriter::executePlanBroadcast(const std::vector<BufferedFsWriter*> &targets, const std::vector<std::vector<PlanPatch>> &patches,
+                                           std::vector<int> &results, PlanStats *const stats) noexcept
+{
+	if(!m_planning || m_differential || patches.size() != targets.size()) return EINVAL;
+
+	try
+	{
+		results.assign(targets.size(), 0);
+	}
+	catch(const std::bad_alloc&)
+	{
+		return ENOMEM;
+	}
+
+	const std::unique_ptr<u8[], decltype(&free)> scratch(reinterpret_cast<u8*>(aligned_alloc(BlockDev::getBufAlignment(), m_blkSize)), free);
+	if(!scratch) return ENOMEM;
+
+	// Every device must be idle since the buffer tags are shared.
+	for(size_t t = 0; t < targets.size(); t++)
+		results[t] = targets[t]->BlockDev::waitAllAsync();
+
+	Broadcast broadcast{&targets, &patches, &results, scratch.get()};
+	m_broadcast = &broadcast;
+	PlanStats tmpStats;
+	const int walkRes = walkPlan(stats != nullptr ? *stats : tmpStats, true);
+	m_broadcast = nullptr;
+
+	// ENODEV means all devices failed already. Anything else like
+	// a file read error fails all devices. Then report errors of writes in flight.
+	int res = ENODEV;
+	for(size_t t = 0; t < targets.size(); t++)
+	{
+		const int waitRes = targets[t]->BlockDev::waitAllAsync();
+		if(results[t] == 0) results[t] = (walkRes != 0 && walkRes != ENODEV ? walkRes : waitRes);
+		if(results[t] == 0) res = 0;
+	}
+
+	m_planning = false;
+	m_planExtents = std::vector<PlanExtent>();
+	m_planData = std::vector<u8>();
+	m_planFiles = std::vector<std::string>();
+	closePlanFile();
+	m_pos = 0;
+
+	return res;
+}
+
+int BufferedFsWriter::readPlan(void *const dst, const u64 offset, const u64 size) noexcept
+{
+	size_t extIdx = 0;
+	memset(dst, 0, size);
+
+	return copyPlanData(reinterpret_cast<u8*>(dst), offset, offset + size, extIdx);
+}
+
+int BufferedFsWriter::comparePlan(const u64 zeroHead, bool &matches) noexcept
+{
+	matches = false;
+	if(!m_planning) return EINVAL;
+
+	int res = BlockDev::waitAllAsync();
+	if(res != 0) return res;
+
+	std::unique_ptr<u8[]> expected(new(std::nothrow) u8[m_blkSize]);
+	if(!expected) return ENOMEM;
+
+	// Everything from the plan start to the padded end is planned
+	// so whole I/O aligned chunks can be compared.
+	const u64 ioMask = BlockDev::getIoAlignment() - 1;
+	const u64 planEnd = (m_pos + ioMask) & ~ioMask;
+	u64 checked = m_planStart;
+	size_t extIdx = 0;
+	for(const PlanExtent &ext : m_planExtents)
+	{
+		const u64 length = (ext.dataOffset == m_planZero && ext.length > zeroHead ? zeroHead : ext.length);
+		u64 start = ext.offset & ~ioMask;
+		if(start < checked) start = checked;
+		u64 end = (ext.offset + length + ioMask) & ~ioMask;
+		if(end > planEnd) end = planEnd;
+
+		while(start < end)
+		{
+			const u32 chunkSize = (end - start > m_blkSize ? m_blkSize : end - start);
+			res = BlockDev::read(m_buf, start / 512, chunkSize / 512);
+			if(res != 0) return res;
+
+			memset(expected.get(), 0, chunkSize);
+			res = copyPlanData(expected.get(), start, start + chunkSize, extIdx);
+			if(res != 0) return res;
+			if(memcmp(m_buf, expected.get(), chunkSize) != 0) return 0;
+
+			start += chunkSize;
+		}
+		if(end > checked) checked = end;
+	}
+	matches = true;
+
+	return 0;
+}
+
+// Chunks of up to the buffer size to read back. Ordered and aligned to the buffer
+// alignment which is a multiple of the I/O alignment with and without O_DIRECT.
+int BufferedFsWriter::planVerify(const u64 sampleSize, std::vector<std::pair<u64, u32>> &chunks, u64 &writtenEnd) noexcept
+{
+	// Bytes behind the end padded to the I/O alignment of the writes were never written.
+	const u64 writeMask = BlockDev::getIoAlignment() - 1;
+	writtenEnd = (m_pos + writeMask) & ~writeMask;
+
+	const u64 mask = BlockDev::getBufAlignment() - 1;
+	const u64 planEnd = std::min((writtenEnd + mask) & ~mask, BlockDev::getSectors() * 512);
+	chunks.clear();
+	try
+	{
+		u64 checked = m_planStart & ~mask;
+		const auto add = [&](const u64 start, const u64 end)
+		{
+			u64 pos = std::max(start & ~mask, checked);
+			const u64 alignedEnd = std::min((end + mask) & ~mask, planEnd);
+			for(; pos < alignedEnd; pos += chunks.back().second)
+				chunks.emplace_back(pos, (u32)(alignedEnd - pos > m_blkSize ? m_blkSize : alignedEnd - pos));
+			if(alignedEnd > checked) checked = alignedEnd;
+		};
+
+		for(const PlanExtent &ext : m_planExtents)
+		{
+			const u64 end = ext.offset + ext.length;
+			if((ext.dataOffset != m_planZero && !(ext.dataOffset & m_planFile)) || ext.length <= sampleSize * 3)
+			{
+				add(ext.offset, end);
+				continue;
+			}
+
+			const u64 mid = ext.offset + (ext.length - sampleSize) / 2;
+			add(ext.offset, ext.offset + sampleSize);
+			add(mid, mid + sampleSize);
+			add(end - sampleSize, end);
+		}
+	}
+	catch(const std::bad_alloc&)
+	{
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+u64 BufferedFsWriter::getVerifyBytes(const u64 sampleSize) noexcept
+{
+	if(!m_planning || sampleSize == 0) return 0;
+
+	std::vector<std::pair<u64, u32>> chunks;
+	u64 writtenEnd;
+	if(planVerify(sampleSize, chunks, writtenEnd) != 0) return 0;
+
+	u64 bytes = 0;
+	for(const auto &chunk : chunks) bytes += chunk.second;
+
+	return bytes;
+}
+
+int BufferedFsWriter::verifyPlan(const u64 sampleSize, bool &matches, u64 &badOffset) noexcept
+{
+	matches = false;
+	badOffset = 0;
+	if(!m_planning || sampleSize == 0) return EINVAL;
+
+	std::vector<std::pair<u64, u32>> chunks;
+	u64 writtenEnd;
+	int res = planVerify(sampleSize, chunks, writtenEnd);
+	if(res != 0) return res;
+
+	// Images are read through the page cache. It holds what the file contains.
+	bool wasDirect = BlockDev::isDirect();
+	res = (BlockDev::isImage() ? BlockDev::flush() : BlockDev::beginDirectIo(wasDirect));
+	if(res != 0) return res;
+
+	const std::unique_ptr<u8[]> expected(new(std::nothrow) u8[m_blkSize]);
+	if(!expected) res = ENOMEM;
+
+	// Reads run ahead in all buffers like in planRunDiff(). Chunk c is read into buffer c % bufCount.
+	const u32 bufCount = m_bufCount;
+	const size_t numChunks = chunks.size();
+	for(size_t c = 0; c < bufCount && c < numChunks && res == 0; c++)
+		res = BlockDev::readAsync(&m_bufs[m_blkSize * c], chunks[c].first / 512, chunks[c].second / 512, c);
+
+	size_t extIdx = 0;
+	matches = (res == 0);
+	for(size_t c = 0; c < numChunks && res == 0; c++)
+	{
+		const u32 i = c % bufCount;
+		const u8 *const buf = &m_bufs[m_blkSize * i];
+		const u64 start = chunks[c].first;
+		const u32 chunkSize = chunks[c].second;
+		res = BlockDev::waitAsync(i);
+		if(res != 0) break;
+
+		memset(expected.get(), 0, chunkSize);
+		res = copyPlanData(expected.get(), start, start + chunkSize, extIdx);
+		if(res != 0) break;
+
+		const u32 cmpSize = (writtenEnd - start < chunkSize ? writtenEnd - start : chunkSize);
+		if(memcmp(buf, expected.get(), cmpSize) != 0)
+		{
+			u32 pos = 0;
+			while(buf[pos] == expected[pos]) pos++;
+			badOffset = start + pos;
+			matches = false;
+			break;
+		}
+		BlockDev::addProgress(chunkSize);
+
+		if(c + bufCount < numChunks)
+			res = BlockDev::readAsync(&m_bufs[m_blkSize * i], chunks[c + bufCount].first / 512, chunks[c + bufCount].second / 512, i);
+	}
+
+	// Leave all buffers free for close().
+	const int waitRes = BlockDev::waitAllAsync();
+	if(res == 0 && matches) res = waitRes;
+	if(res != 0) matches = false;
+
+	BlockDev::endDirectIo(wasDirect);
+	discardPlan();
+	m_pos = 0;
+
+	return res;
+}
+
+void BufferedFsWriter::discardPlan(void) noexcept
+{
+	m_planning = false;
+	m_planExtents = std::vector<PlanExtent>();
+	m_planData = std::vector<u8>();
+	m_planFiles = std::vector<std::string>();
+	closePlanFile();
+	m_pos = m_planStart;
+}
+
 // TODO: Edge case testing.
 int BufferedFsWriter::close(void) noexcept
 {
 //printf("BufferedFsWriter::close() m_pos %lu\n", m_pos);
-	// Align to sector size.
-	constexpr u32 secMask = BlockDev::getSectorSize() - 1;
-	const u64 pos = m_pos;
-	const u32 misalignment = ((pos + secMask) & ~((u64)secMask)) - pos;
-	memset(&m_buf[pos & m_blkMask], 0, misalignment);
-
-	const u64 wrCount = ((pos + misalignment) & m_blkMask) / 512;
-	const u64 wrSector = (pos & ~((u64)m_blkMask)) / 512;
 	int res = 0;
-	if(wrCount > 0)
-		res = BlockDev::write(m_buf.get(), wrSector, wrCount);
+	if(!m_planning && m_buf != nullptr) // An unfinished plan is discarded without writing anything.
+	{
+		// Align to sector size (logical block size with O_DIRECT).
+		const u32 secMask = BlockDev::getIoAlignment() - 1;
+		const u64 pos = m_pos;
+		const u32 misalignment = ((pos + secMask) & ~((u64)secMask)) - pos;
+		memset(&m_buf[pos & m_blkMask], 0, misalignment);
+
+		const u64 wrCount = ((pos + misalignment) & m_blkMask) / 512;
+		const u64 wrSector = (pos & ~((u64)m_blkMask)) / 512;
+		if(wrCount > 0)
+			res = BlockDev::writeAsync(m_buf, wrSector, wrCount, m_bufIdx);
+	}
+
+	// Wait for all writes in flight and report the first error.
+	const int waitRes = BlockDev::waitAllAsync();
+	if(res == 0) res = waitRes;
 
 	BlockDev::close();
 	m_pos = 0;
+	m_planning = false;
+	m_planExtents = std::vector<PlanExtent>();
+	m_planData = std::vector<u8>();
+	m_planFiles = std::vector<std::string>();
+	closePlanFile();
+
+	// Let other writers use the pooled buffers.
+	if(m_pool != nullptr)
+	{
+		m_bufs.reset();
+		m_buf = nullptr;
+	}
 
 	return res;
 }
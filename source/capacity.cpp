@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "types.h"
+#include "capacity.h"
+#include "util.h"
+#include "verbose_printf.h"
+
+
+static constexpr u32 g_sampleSectors = 1024 * 64 / 512;       // Size of each sample.
+static constexpr u32 g_chunkSectors  = 1024 * 1024 * 4 / 512; // Size of each request in the full pass.
+static constexpr u32 g_secWords      = 512 / 8;
+
+
+
+// Every sector starts with its own address and the seed of this run followed by
+// xorshift64 output seeded from both. Stale data from earlier runs never matches.
+static void fillPattern(u64 *buf, u64 sector, const u64 count, const u64 seed)
+{
+	for(const u64 end = sector + count; sector < end; sector++)
+	{
+		u64 x = ((sector + 1) * 0x9E3779B97F4A7C15u) ^ seed;
+		if(x == 0) x = 1;
+
+		buf[0] = sector;
+		buf[1] = seed;
+		for(u32 i = 2; i < g_secWords; i++)
+		{
+			x ^= x<<13;
+			x ^= x>>7;
+			x ^= x<<17;
+			buf[i] = x;
+		}
+		buf += g_secWords;
+	}
+}
+
+// Compares read data against the expected pattern and lowers limit to the first bad sector.
+// Cards wrapping around return intact data of a higher address instead. The real size
+// divides the distance so all distances are accumulated in wrapGcd.
+static void checkPattern(const u64 *buf, const u64 sector, const u64 count, const u64 seed,
+                         u64 *expected, u64 &limit, u64 &wrapGcd)
+{
+	// Fast path. memcmp() is vectorized.
+	fillPattern(expected, sector, count, seed);
+	if(memcmp(buf, expected, count * 512) == 0) return;
+
+	u64 wrapExpected[g_secWords];
+	for(u64 i = 0; i < count; i++, buf += g_secWords, expected += g_secWords)
+	{
+		if(memcmp(buf, expected, 512) == 0) continue;
+
+		const u64 cur = sector + i;
+		const u64 tagged = buf[0];
+		if(buf[1] == seed && tagged > cur)
+		{
+			fillPattern(wrapExpected, tagged, 1, seed);
+			if(memcmp(buf, wrapExpected, 512) == 0)
+			{
+				wrapGcd = std::gcd(wrapGcd, tagged - cur);
+				continue;
+			}
+		}
+
+		if(cur < limit) limit = cur;
+		return;
+	}
+}
+
+// Finds the real size of a wrapping card. It's the smallest divisor of wrapGcd
+// where a write at that distance overwrites sector 0.
+static u64 findWrapSize(BlockDev &dev, u64 *buf, const u64 seed, const u64 wrapGcd)
+{
+	std::vector<u64> divisors;
+	std::vector<u64> upper;
+	for(u64 d = 1; d * d <= wrapGcd; d++)
+	{
+		if(wrapGcd % d != 0) continue;
+		divisors.push_back(d);
+		if(d * d != wrapGcd) upper.push_back(wrapGcd / d);
+	}
+	divisors.insert(divisors.end(), upper.rbegin(), upper.rend());
+
+	// Test with the smallest unit we can do I/O with.
+	const u32 unit = dev.getIoAlignment() / 512;
+	u64 first[g_secWords];
+	for(const u64 d : divisors)
+	{
+		if(d % unit != 0 || d + unit > dev.getSectors()) continue;
+
+		fillPattern(buf, 0, unit, seed);
+		if(dev.write(buf, 0, unit) != 0) continue;
+		fillPattern(buf, d, unit, seed);
+		memcpy(first, buf, 512);
+		if(dev.write(buf, d, unit) != 0) continue;
+		if(dev.read(buf, 0, unit) != 0) continue;
+		if(memcmp(buf, first, 512) == 0) return d;
+	}
+
+	return wrapGcd;
+}
+
+// Sample offsets in units of g_sampleSectors. 8 samples per power of 2.
+static std::vector<u64> getSamples(const u64 units)
+{
+	std::vector<u64> samples{0};
+	for(u64 base = 1; base < units; base <<= 1)
+	{
+		for(u32 i = 0; i < 8; i++)
+		{
+			const u64 unit = base + base * i / 8;
+			if(unit < units) samples.push_back(unit);
+		}
+	}
+	samples.push_back(units - 1);
+	std::sort(samples.begin(), samples.end());
+	samples.erase(std::unique(samples.begin(), samples.end()), samples.end());
+
+	return samples;
+}
+
+// Returns the number of good sectors found by sampling.
+// badEnd receives the end of the range the full pass needs to check.
+static u64 checkSamples(BlockDev &dev, u64 *buf, u64 *expected, const u64 seed, u64 &badEnd)
+{
+	const u64 units = dev.getSectors() / g_sampleSectors;
+	const std::vector<u64> samples = getSamples(units);
+
+	// Write everything first. Cards wrapping around overwrite lower samples with higher ones.
+	std::vector<bool> bad(samples.size());
+	for(size_t i = 0; i < samples.size(); i++)
+	{
+		const u64 sector = samples[i] * g_sampleSectors;
+		fillPattern(buf, sector, g_sampleSectors, seed);
+		bad[i] = dev.write(buf, sector, g_sampleSectors) != 0;
+	}
+
+	u64 wrapGcd = 0;
+	for(size_t i = 0; i < samples.size(); i++)
+	{
+		const u64 sector = samples[i] * g_sampleSectors;
+		if(bad[i] || dev.read(buf, sector, g_sampleSectors) != 0)
+		{
+			bad[i] = true;
+			continue;
+		}
+
+		u64 sampleLimit = ~0ull;
+		checkPattern(buf, sector, g_sampleSectors, seed, expected, sampleLimit, wrapGcd);
+		bad[i] = sampleLimit != ~0ull;
+	}
+
+	u64 limit = dev.getSectors();
+	if(wrapGcd != 0) limit = std::min(limit, findWrapSize(dev, buf, seed, wrapGcd));
+
+	// Only trust sectors up to the end of the last good sample below the first bad one.
+	for(size_t i = 0; i < samples.size(); i++)
+	{
+		const u64 sector = samples[i] * g_sampleSectors;
+		if(!bad[i] || sector >= limit) continue;
+
+		badEnd = sector;
+		return (i > 0 ? samples[i - 1] * g_sampleSectors + g_sampleSectors : 0);
+	}
+
+	badEnd = limit;
+	return limit;
+}
+
+// Waits for everything in flight and clears a latched I/O error.
+static int resetAsync(BlockDev &dev)
+{
+	dev.waitAllAsync();
+	return dev.setQueueDepth(dev.getQueueDepth(), dev.getAsyncBackend() == BlockDev::ASYNC_THREAD);
+}
+
+// Writes and reads back every sector below end keeping all buffers in flight.
+// Generating and comparing patterns overlaps with the I/O of the other buffers.
+// I/O errors are treated as the end of the card.
+static int checkFull(BlockDev &dev, u64 *bufs, u64 *expected, const u32 bufCount, const u64 seed, u64 end, u64 &limit)
+{
+	constexpr size_t bufWords = (size_t)g_chunkSectors * g_secWords;
+	u64 inFlight[BlockDev::getMaxQueueDepth()]; // Start sector of the request per buffer.
+	const auto earliest = [&]{return *std::min_element(inFlight, inFlight + bufCount);};
+
+	std::fill(inFlight, inFlight + bufCount, ~0ull);
+	u64 startNs = util::getNs();
+	bool failed = false;
+	u32 i = 0;
+	for(u64 sector = 0; sector < end; sector += g_chunkSectors, i = (i + 1) % bufCount)
+	{
+		u64 *const buf = bufs + i * bufWords;
+		if(inFlight[i] != ~0ull)
+		{
+			if(dev.waitAsync(i) != 0)
+			{
+				failed = true;
+				break;
+			}
+			inFlight[i] = ~0ull;
+		}
+
+		const u64 count = std::min<u64>(g_chunkSectors, end - sector);
+		fillPattern(buf, sector, count, seed);
+		inFlight[i] = sector;
+		if(dev.writeAsync(buf, sector, count, i) != 0)
+		{
+			failed = true;
+			break;
+		}
+	}
+	if(dev.waitAllAsync() != 0) failed = true;
+	if(failed)
+	{
+		// We don't know which write failed. Assume the earliest unconfirmed one.
+		end = std::min(end, earliest());
+		const int res = resetAsync(dev);
+		if(res != 0) return res;
+	}
+	u64 ns = util::getNs() - startNs;
+	verbosePrintf("Wrote %" PRIu64 " MiB at %.2f MB/s.\n", end * 512 / 1024 / 1024, (ns > 0 ? end * 512 * 1000.0 / ns : 0.0));
+
+	// Start reading into all buffers. Requests are submitted round robin so
+	// waiting for the buffers in the same order processes the data in order.
+	// Reading beyond the wrap distance tells us nothing new.
+	std::fill(inFlight, inFlight + bufCount, ~0ull);
+	startNs = util::getNs();
+	failed = false;
+	u64 wrapGcd = 0;
+	u64 next = 0;
+	for(i = 0; i < bufCount && next < end && !failed; i++, next += g_chunkSectors)
+	{
+		inFlight[i] = next;
+		failed = dev.readAsync(bufs + i * bufWords, next, std::min<u64>(g_chunkSectors, end - next), i) != 0;
+	}
+
+	i = 0;
+	while(!failed && inFlight[i] != ~0ull)
+	{
+		u64 *const buf = bufs + i * bufWords;
+		const u64 cur = inFlight[i];
+		if(dev.waitAsync(i) != 0)
+		{
+			failed = true;
+			break;
+		}
+		inFlight[i] = ~0ull;
+
+		checkPattern(buf, cur, std::min<u64>(g_chunkSectors, end - cur), seed, expected, limit, wrapGcd);
+
+		if(next < std::min<u64>({end, limit, (wrapGcd != 0 ? wrapGcd : ~0ull)}))
+		{
+			inFlight[i] = next;
+			failed = dev.readAsync(buf, next, std::min<u64>(g_chunkSectors, end - next), i) != 0;
+			next += g_chunkSectors;
+		}
+		i = (i + 1) % bufCount;
+	}
+	if(dev.waitAllAsync() != 0) failed = true;
+	if(failed)
+	{
+		limit = std::min(limit, earliest());
+		const int res = resetAsync(dev);
+		if(res != 0) return res;
+	}
+	next = std::min(next, end);
+	ns = util::getNs() - startNs;
+	verbosePrintf("Read %" PRIu64 " MiB at %.2f MB/s.\n", next * 512 / 1024 / 1024, (ns > 0 ? next * 512 * 1000.0 / ns : 0.0));
+
+	limit = std::min(limit, end);
+	if(wrapGcd != 0) limit = std::min(limit, findWrapSize(dev, bufs, seed, wrapGcd));
+
+	return 0;
+}
+
+int verifyCapacity(BlockDev &dev, const bool full, u64 &goodSectors)
+{
+	bool wasDirect;
+	int res = dev.beginDirectIo(wasDirect);
+	if(res == EOPNOTSUPP) fputs("Error: Capacity verification needs O_DIRECT which is not supported by the device.\n", stderr);
+	if(res != 0) return res;
+
+	// One buffer per request in flight plus one for the expected data.
+	const u32 bufCount = dev.getQueueDepth();
+	const std::unique_ptr<u64[], decltype(&free)> bufs(reinterpret_cast<u64*>(aligned_alloc(BlockDev::getBufAlignment(),
+	                                                   (size_t)(bufCount + 1) * g_chunkSectors * 512)), free);
+	if(!bufs)
+	{
+		dev.endDirectIo(wasDirect);
+		return ENOMEM;
+	}
+	u64 *const expected = bufs.get() + (size_t)bufCount * g_chunkSectors * g_secWords;
+
+	const u64 seed = util::getNs() | 1;
+	puts("Verifying capacity...");
+	u64 badEnd;
+	u64 good = checkSamples(dev, bufs.get(), expected, seed, badEnd);
+	if(full)
+	{
+		printf("Checking all %" PRIu64 " MiB...\n", badEnd * 512 / 1024 / 1024);
+		good = badEnd;
+		res = checkFull(dev, bufs.get(), expected, bufCount, seed, badEnd, good);
+	}
+
+	dev.endDirectIo(wasDirect);
+	goodSectors = good;
+
+	return res;
+}
@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "types.h"
+#include "daemon.h"
+#include "errors.h"
+#include "output_capture.h"
+#include "util_endian.h"
+#include "verbose_printf.h"
+
+
+#define UDEV_MONITOR_GROUP  (2u)          // Netlink group of events processed by udev.
+#define UDEV_MONITOR_MAGIC  (0xFEEDCAFEu)
+
+
+// Header of the events udev sends to its netlink group. Same as in libudev.
+typedef struct
+{
+	char prefix[8];     // "libudev".
+	u32 magic;          // UDEV_MONITOR_MAGIC big endian.
+	u32 headerSize;
+	u32 propertiesOff;
+	u32 propertiesLen;
+	u32 filterSubsystemHash;
+	u32 filterDevtypeHash;
+	u32 filterTagBloomHi;
+	u32 filterTagBloomLo;
+} UdevHeader;
+
+// A disk which matched the rules.
+typedef struct
+{
+	std::string name;   // Kernel name like "sdb".
+	std::string serial; // Reader serial or empty.
+	u64 size;           // In bytes.
+} Card;
+
+// Cards waiting for a worker. Names in busy are queued or being formatted.
+typedef struct
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Card> queue;
+	std::set<std::string> busy;
+	bool stop;
+} CardQueue;
+
+
+static volatile sig_atomic_t g_stop = 0;
+
+
+
+static void onSignal(int)
+{
+	g_stop = 1;
+}
+
+// Reads the first line of a sysfs attribute. Returns an empty string on error.
+static std::string readSysfsAttr(const std::string &path)
+{
+	FILE *const f = fopen(path.c_str(), "re");
+	if(f == nullptr) return std::string();
+
+	char line[256];
+	std::string val;
+	if(fgets(line, sizeof(line), f) != nullptr)
+	{
+		val = line;
+		while(!val.empty() && (val.back() == '\n' || val.back() == ' ')) val.pop_back();
+	}
+	fclose(f);
+
+	return val;
+}
+
+// Same idea as HOTPLUG in lsblk. Removable media or a disk behind USB or an MMC host.
+static bool isHotplug(const std::string &sysPath)
+{
+	if(readSysfsAttr(sysPath + "/removable") == "1") return true;
+
+	return sysPath.find("/usb") != std::string::npos || sysPath.find("/mmc_host/") != std::string::npos;
+}
+
+// The first serial number found walking up from the disk. For USB card readers this is the reader.
+static std::string findSerial(std::string sysPath)
+{
+	while(sysPath.length() > sizeof("/sys/devices") - 1)
+	{
+		const std::string serial = readSysfsAttr(sysPath + "/serial");
+		if(!serial.empty()) return serial;
+		sysPath.resize(sysPath.rfind('/'));
+	}
+
+	return std::string();
+}
+
+// Returns true for a whole disk which appeared or got new media.
+// buf must be NUL terminated at buf[len].
+static bool parseUevent(const char *const buf, const size_t len, std::string &name)
+{
+	// Only events udev is done with. It has probed the disk and applied its rules by then.
+	UdevHeader hdr;
+	if(len < sizeof(hdr)) return false;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if(memcmp(hdr.prefix, "libudev", 8) != 0 || util::endian::beToCpu(hdr.magic) != UDEV_MONITOR_MAGIC) return false;
+	if(hdr.propertiesOff < sizeof(hdr) || hdr.propertiesOff > len || hdr.propertiesLen > len - hdr.propertiesOff) return false;
+
+	const char *action = nullptr, *subsystem = nullptr, *devType = nullptr, *devName = nullptr;
+	bool mediaChange = false;
+	const size_t end = hdr.propertiesOff + hdr.propertiesLen;
+	for(size_t pos = hdr.propertiesOff; pos < end; pos += strlen(&buf[pos]) + 1)
+	{
+		const char *const var = &buf[pos];
+		if(strncmp(var, "ACTION=", 7) == 0)                     action = var + 7;
+		else if(strncmp(var, "SUBSYSTEM=", 10) == 0)            subsystem = var + 10;
+		else if(strncmp(var, "DEVTYPE=", 8) == 0)               devType = var + 8;
+		else if(strncmp(var, "DEVNAME=", 8) == 0)               devName = var + 8;
+		else if(strcmp(var, "DISK_MEDIA_CHANGE=1") == 0)        mediaChange = true;
+	}
+	if(action == nullptr || subsystem == nullptr || devType == nullptr || devName == nullptr) return false;
+	if(strcmp(subsystem, "block") != 0 || strcmp(devType, "disk") != 0) return false;
+	if(strcmp(action, "add") != 0 && (strcmp(action, "change") != 0 || !mediaChange)) return false;
+
+	// udev sets DEVNAME to the full path. Subdirectories are not expected for disks.
+	if(strncmp(devName, "/dev/", 5) != 0) return false;
+	devName += 5;
+	if(*devName == '\0' || strchr(devName, '/') != nullptr) return false;
+	name = devName;
+
+	return true;
+}
+
+static bool matchRules(const DaemonRules &rules, Card &card)
+{
+	const std::string path = "/dev/" + card.name;
+	char sysPath[PATH_MAX];
+	if(realpath(("/sys/class/block/" + card.name).c_str(), sysPath) == nullptr) return false;
+
+	if(!isHotplug(sysPath))
+	{
+		verbosePrintf("Ignoring %s: Not hotpluggable.\n", path.c_str());
+		return false;
+	}
+
+	card.size = strtoull(readSysfsAttr(std::string(sysPath) + "/size").c_str(), nullptr, 10) * 512;
+	if(card.size == 0)
+	{
+		verbosePrintf("Ignoring %s: No media.\n", path.c_str());
+		return false;
+	}
+	if(card.size < rules.minSize || (rules.maxSize != 0 && card.size > rules.maxSize))
+	{
+		verbosePrintf("Ignoring %s: Size %" PRIu64 " bytes out of range.\n", path.c_str(), card.size);
+		return false;
+	}
+
+	card.serial = findSerial(sysPath);
+	const std::vector<std::string> &serials = rules.serials;
+	if(!serials.empty() && std::find(serials.begin(), serials.end(), card.serial) == serials.end())
+	{
+		verbosePrintf("Ignoring %s: Reader serial '%s' not allowed.\n", path.c_str(), card.serial.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Formats a card and logs its output and result as one block.
+static void formatCard(const Card &card, const std::string &label, const ArgFlags flags, const FormatArgs &args)
+{
+	const std::string path = "/dev/" + card.name;
+	std::string out = "=== " + path + " (" + std::to_string(card.size / 1000 / 1000) + " MB, reader serial '" + card.serial + "') ===\n";
+	std::string err;
+
+	startOutputCapture(out, err);
+	u32 res;
+	try
+	{
+		res = formatSd(path.c_str(), label, flags, args);
+	}
+	catch(const std::exception &e)
+	{
+		fprintf(stderr, "An exception occurred: what(): '%s'\n", e.what());
+		res = ERR_EXCEPTION;
+	}
+	catch(...)
+	{
+		fputs("Unknown exception.\n", stderr);
+		res = ERR_UNK_EXCEPTION;
+	}
+	stopOutputCapture();
+
+	char timeStr[32];
+	const time_t now = time(nullptr);
+	struct tm tm;
+	strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+	out += std::string("[") + timeStr + "] " + path + ": " + (res == 0 ? "OK" : "Failed (error " + std::to_string(res) + ')') + '\n';
+	printCapturedOutput(out, err);
+}
+
+static void worker(CardQueue &cards, const std::string &label, const ArgFlags flags, const FormatArgs &args)
+{
+	std::unique_lock lock(cards.mutex);
+	while(1)
+	{
+		cards.cv.wait(lock, [&]{return cards.stop || !cards.queue.empty();});
+		if(cards.stop) break;
+
+		const Card card = std::move(cards.queue.front());
+		cards.queue.pop_front();
+		lock.unlock();
+		formatCard(card, label, flags, args);
+		lock.lock();
+		cards.busy.erase(card.name);
+	}
+}
+
+u32 runDaemon(const DaemonRules &rules, const std::string &label, const ArgFlags flags, const FormatArgs &args)
+{
+	// Every card needs the privileges to open it again.
+	if(geteuid() != getuid())
+	{
+		fputs("Error: The daemon can't run as set-user-ID program.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+
+	if(initOutputCapture() != 0)
+	{
+		fputs("Error: Can't set up output capturing.\n", stderr);
+		return ERR_DAEMON;
+	}
+
+	// Raw kernel uevents arrive while udev is still probing the disk. Formatting
+	// then races udev and automounters so listen for the events udev sends when done.
+	// The credentials tell us the sender.
+	const int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	struct sockaddr_nl addr{};
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UDEV_MONITOR_GROUP;
+	const int passCred = 1;
+	if(fd == -1 || setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &passCred, sizeof(passCred)) != 0 ||
+	   bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		perror("Failed to listen for udev events");
+		if(fd != -1) close(fd);
+		return ERR_DAEMON;
+	}
+
+	// The signals are blocked everywhere except while waiting for events.
+	// This way they never interrupt a format.
+	sigset_t blocked, waitMask;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &blocked, &waitMask);
+	struct sigaction sa{};
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	CardQueue cards;
+	cards.stop = false;
+	std::vector<std::thread> threads;
+	for(u32 i = 0; i < args.jobs; i++)
+		threads.emplace_back(worker, std::ref(cards), std::cref(label), flags, std::cref(args));
+
+	puts("Waiting for cards...");
+	static char buf[1024 * 8];
+	while(!g_stop)
+	{
+		struct pollfd pfd{fd, POLLIN, 0};
+		if(ppoll(&pfd, 1, nullptr, &waitMask) < 0)
+		{
+			if(errno == EINTR) continue;
+			perror("Failed to wait for udev events");
+			break;
+		}
+
+		// Only trust messages from udev running as root like libudev does.
+		struct sockaddr_nl src{};
+		struct iovec iov{buf, sizeof(buf) - 1};
+		alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct ucred))];
+		struct msghdr msg{};
+		msg.msg_name       = &src;
+		msg.msg_namelen    = sizeof(src);
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		const ssize_t len = recvmsg(fd, &msg, 0);
+		if(len <= 0 || src.nl_groups != UDEV_MONITOR_GROUP || src.nl_pid == 0) continue;
+		const struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS) continue;
+		struct ucred cred;
+		memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+		if(cred.uid != 0) continue;
+		buf[len] = '\0';
+
+		Card card{};
+		if(!parseUevent(buf, len, card.name) || !matchRules(rules, card)) continue;
+
+		std::lock_guard lock(cards.mutex);
+		if(!cards.busy.insert(card.name).second)
+		{
+			verbosePrintf("Ignoring /dev/%s: Already formatting.\n", card.name.c_str());
+			continue;
+		}
+		printf("Card detected: /dev/%s\n", card.name.c_str());
+		cards.queue.push_back(std::move(card));
+		cards.cv.notify_one();
+	}
+
+	// Running formats are finished. Queued cards are dropped.
+	puts("Stopping. Waiting for running formats...");
+	{
+		std::lock_guard lock(cards.mutex);
+		cards.stop = true;
+	}
+	cards.cv.notify_all();
+	for(std::thread &thread : threads) thread.join();
+	close(fd);
+	pthread_sigmask(SIG_SETMASK, &waitMask, nullptr);
+
+	return 0;
+}
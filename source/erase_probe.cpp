@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include "types.h"
+#include "erase_probe.h"
+#include "util.h"
+#include "verbose_printf.h"
+
+
+static constexpr u32 g_minBlock    = 1024 * 16 / 512;        // Smallest candidate in sectors.
+static constexpr u32 g_maxBlock    = 1024 * 1024 * 64 / 512; // Biggest candidate in sectors.
+static constexpr u32 g_halfSectors = 4096 / 512;             // Each write is 2 of these.
+static constexpr u32 g_reps        = 16;                     // Timed writes per position and candidate.
+static constexpr u32 g_maxCands    = 13;                     // 16 KiB to 64 MiB.
+
+
+
+static int timeWrite(BlockDev &dev, const void *buf, const u64 sector, u64 &ns)
+{
+	const u64 start = util::getNs();
+	const int res = dev.write(buf, sector, g_halfSectors * 2);
+	ns = util::getNs() - start;
+
+	return res;
+}
+
+static u64 median(u64 *const vals, const u32 count)
+{
+	std::nth_element(vals, vals + count / 2, vals + count);
+	return vals[count / 2];
+}
+
+// Times writes ending at, crossing and starting at odd multiples of each candidate size.
+// Odd multiples are never boundaries of bigger candidates so only candidates
+// at least as big as the erase block get slower crossing writes.
+static int measure(BlockDev &dev, const void *buf, const u64 start, const u64 size, double *diffs, u32 &cands, double &base)
+{
+	u64 all[g_maxCands * 2];
+	cands = 0;
+	for(u32 blk = g_minBlock; blk <= g_maxBlock && blk * 2 <= size; blk <<= 1, cands++)
+	{
+		// The first round is not timed. The first write to a spot is often slower.
+		const u64 positions = std::min<u64>(size / (blk * 2), g_reps);
+		u64 pre[g_reps], on[g_reps], post[g_reps];
+		for(u32 r = 0; r < g_reps + positions; r++)
+		{
+			const u64 boundary = start + (r % positions * 2 + 1) * blk;
+			const u32 idx = (r < positions ? 0 : r - positions);
+			int res = timeWrite(dev, buf, boundary - g_halfSectors * 2, pre[idx]);
+			if(res == 0) res = timeWrite(dev, buf, boundary - g_halfSectors, on[idx]);
+			if(res == 0) res = timeWrite(dev, buf, boundary, post[idx]);
+			if(res != 0) return res;
+		}
+
+		const u64 preNs  = median(pre, g_reps);
+		const u64 onNs   = median(on, g_reps);
+		const u64 postNs = median(post, g_reps);
+		diffs[cands] = (double)onNs - (preNs + postNs) / 2.0;
+		all[cands * 2] = preNs;
+		all[cands * 2 + 1] = postNs;
+		verbosePrintf("%8" PRIu32 " KiB %9.1f %9.1f %9.1f %9.1f\n", blk / 2, preNs / 1000.0, onNs / 1000.0,
+		              postNs / 1000.0, diffs[cands] / 1000.0);
+	}
+	base = (cands > 0 ? median(all, cands * 2) : 0.0);
+
+	return 0;
+}
+
+int probeEraseBlock(BlockDev &dev, u32 &eraseSectors)
+{
+	eraseSectors = 0;
+	// Timing writes through the page cache is meaningless.
+	bool wasDirect;
+	int res = dev.beginDirectIo(wasDirect);
+	if(res == EOPNOTSUPP) fputs("Error: Erase block probing needs O_DIRECT which is not supported by the device.\n", stderr);
+	if(res != 0) return res;
+
+	// Up to 512 MiB in the middle of the card aligned to its own size.
+	u64 size = 1024 * 1024 * 512 / 512;
+	while(size > g_minBlock * 2 && size * 4 > dev.getSectors()) size >>= 1;
+	const u64 start = dev.getSectors() / 2 / size * size;
+
+	const std::unique_ptr<u64[], decltype(&free)> buf(reinterpret_cast<u64*>(aligned_alloc(BlockDev::getBufAlignment(),
+	                                                  g_halfSectors * 2 * 512)), free);
+	if(!buf)
+	{
+		dev.endDirectIo(wasDirect);
+		return ENOMEM;
+	}
+	u64 x = util::getNs() | 1;
+	for(u32 i = 0; i < g_halfSectors * 2 * 512 / 8; i++)
+	{
+		x ^= x<<13;
+		x ^= x>>7;
+		x ^= x<<17;
+		buf[i] = x;
+	}
+
+	puts("Probing erase block size...");
+	verbosePuts("   Boundary  pre (us)   on (us) post (us) diff (us)");
+	double diffs[g_maxCands];
+	u32 cands;
+	double base;
+	res = measure(dev, buf.get(), start, size, diffs, cands, base);
+	dev.endDirectIo(wasDirect);
+	if(res != 0) return res;
+
+	// The erase block size is where crossing writes get and stay significantly slower.
+	// Smaller steps (pages) may come before it but there must be a clear step up.
+	const double maxDiff = (cands > 0 ? *std::max_element(diffs, diffs + cands) : 0.0);
+	if(maxDiff < base / 4) return 0;
+
+	u32 first = cands;
+	while(first > 0 && diffs[first - 1] >= maxDiff / 2) first--;
+	if(first == cands || (first > 0 && diffs[first - 1] >= maxDiff / 4)) return 0;
+	eraseSectors = g_minBlock<<first;
+
+	return 0;
+}
@@ -1,9 +1,12 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2023 profi200
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
 #include <memory>
+#include <vector>
 #include "types.h"
 #include "exfat.h"
 #include "exfat_up_case_table.h"
@@ -38,39 +41,194 @@ static u32 calcExFatBootChecksum(const u8 *data, const u16 bytesPerSector)
 	return checksum;
 }
 
+// Fills the boot checksum sector (the 12th sector) of a boot region.
+static void setBootChecksum(u8 *const bootRegion, const u16 bytesPerSec)
+{
+	const u32 bootChecksum = calcExFatBootChecksum(bootRegion, bytesPerSec);
+	for(unsigned i = 0; i < bytesPerSec / 4u; i++)
+		*reinterpret_cast<u32*>(&bootRegion[bytesPerSec * 11 + i * 4]) = bootChecksum;
+}
+
+void setExfatVolId(u8 *const bootRegion, const u16 bytesPerSec, const u32 volId)
+{
+	reinterpret_cast<ExfatBootSec*>(bootRegion)->volumeSerialNumber = volId;
+	setBootChecksum(bootRegion, bytesPerSec);
+}
+
 // Warning, this function relies on the current buffer position in dev!
 // Length must be >=1.
 static int writeContinuousExfatChain(BufferedFsWriter &dev, const u32 start, const u32 length)
 {
-	for(u32 i = start + 1; i < start + length; i++)
+	// Each entry points to the next cluster. The last one is EOF.
+	const u32 first = EXFAT_FIRST_ENT + start;
+	const u64 size  = (u64)length * 4;
+	return dev.writeGenerated(size, [first, size](u8 *const dst, const u64 offset, const u32 len)
 	{
-		const int res = dev.write(&i, 4);
-		if(res != 0) return res;
+		u32 *const entries = reinterpret_cast<u32*>(dst);
+		const u32 next = first + offset / 4 + 1;
+		for(u32 i = 0; i < len / 4; i++) entries[i] = next + i;
+
+		if(offset + len == size) entries[len / 4 - 1] = EXFAT_EOF;
+	});
+}
+
+// Sets bits first to end - 1 in a bitmap chunk starting at bit 0.
+static void setBitRange(u8 *const dst, u64 first, const u64 end)
+{
+	for(; first < end && first % 8 != 0; first++) dst[first / 8] |= 1u<<(first % 8);
+	if(first >= end) return;
+
+	const u64 bytes = (end - first) / 8;
+	memset(&dst[first / 8], 0xFF, bytes);
+	for(first += bytes * 8; first < end; first++) dst[first / 8] |= 1u<<(first % 8);
+}
+
+// Writes bitmap words with the bits of all runs set. Runs must be sorted and not empty.
+static int writeBitmapEntries(BufferedFsWriter &dev, const std::vector<ClusterRun> &runs)
+{
+	const u64 size = util::udivCeil((u64)runs.back().start + runs.back().count, 32u) * 4;
+	return dev.writeGenerated(size, [&runs](u8 *const dst, const u64 offset, const u32 len)
+	{
+		memset(dst, 0, len);
+
+		const u64 chunkFirst = offset * 8;
+		const u64 chunkEnd   = chunkFirst + (u64)len * 8;
+		for(const ClusterRun &run : runs)
+		{
+			const u64 first = std::max<u64>(run.start, chunkFirst);
+			const u64 end   = std::min<u64>((u64)run.start + run.count, chunkEnd);
+			if(first < end) setBitRange(dst, first - chunkFirst, end - chunkFirst);
+		}
+	});
+}
+
+// Expands the compressed up-case table. 0xFFFF followed by a length is a range of unchanged characters.
+static void expandUpCaseTable(char16_t *const upCase)
+{
+	u32 c = 0;
+	for(u32 i = 0; i < ARRAY_ENTRIES(g_upCaseTable) && c < 0x10000; i++)
+	{
+		if(g_upCaseTable[i] == 0xFFFFu && i + 1 < ARRAY_ENTRIES(g_upCaseTable))
+		{
+			for(const u32 end = c + g_upCaseTable[++i]; c < end && c < 0x10000; c++) upCase[c] = c;
+		}
+		else upCase[c++] = g_upCaseTable[i];
 	}
 
-	const u32 eof = EXFAT_EOF;
-	return dev.write(&eof, 4);
+	for(; c < 0x10000; c++) upCase[c] = c;
 }
 
-// Warning, this function relies on the current buffer position in dev!
-// Warning, this breaks horribly on multiple calls with counts not a multiple of 32!
-// Count must be >=1.
-static int writeInitialBitmapEntries(BufferedFsWriter &dev, u32 count)
+static u16 calcNameHash(const std::u16string &name, const char16_t *const upCase)
 {
-	do
+	u16 hash = 0;
+	for(const char16_t c : name)
 	{
-		const u32 bits = (count > 32 ? 32 : count);
-		const u32 bitmap = 0xFFFFFFFFu>>(32u - bits);
-		const int res = dev.write(&bitmap, 4);
-		if(res != 0) return res;
+		const char16_t upper = upCase[c];
+		hash = (hash & 1u ? 0x8000u : 0u) + (hash>>1) + (upper & 0xFFu);
+		hash = (hash & 1u ? 0x8000u : 0u) + (hash>>1) + (upper>>8);
+	}
+
+	return hash;
+}
+
+static u16 calcEntrySetChecksum(const ExfatDirEnt *const entries, const u32 count)
+{
+	const u8 *const data = reinterpret_cast<const u8*>(entries);
+	u16 checksum = 0;
+	for(u32 i = 0; i < count * sizeof(ExfatDirEnt); i++)
+	{
+		// Don't checksum the setChecksum field.
+		if(i == 2 || i == 3) continue;
+
+		checksum = (checksum & 1u ? 0x8000u : 0u) + (checksum>>1) + data[i];
+	}
+
+	return checksum;
+}
+
+static u32 getEntrySetSize(const FsFile &file)
+{
+	// File, stream extension and 15 characters per name entry.
+	return 2 + util::udivCeil(file.name.length(), 15u);
+}
+
+static u64 getExfatDirSize(const FsFile &dir)
+{
+	u64 entries = 0;
+	for(const FsFile &child : dir.children) entries += getEntrySetSize(child);
+
+	return entries * sizeof(ExfatDirEnt);
+}
+
+// Appends the entry set of a contiguous file or directory to dir.
+static void addFileEntrySet(std::vector<ExfatDirEnt> &dir, const FsFile &file, const u32 bytesPerClus,
+                            const char16_t *const upCase)
+{
+	const size_t setStart = dir.size();
+	const u32 setSize = getEntrySetSize(file);
+	dir.resize(setStart + setSize);
+	ExfatDirEnt *const set = &dir[setStart];
+
+	set[0].entryType                  = TYPE_FILE;
+	set[0].file.secondaryCount        = setSize - 1;
+	set[0].file.fileAttributes        = (file.isDir ? DIR_ATTR_DIRECTORY : DIR_ATTR_ARCHIVE);
+	set[0].file.createTimestamp       = file.timestamp;
+	set[0].file.lastModifiedTimestamp = file.timestamp;
+	set[0].file.lastAccessedTimestamp = file.timestamp;
+	// 10 ms increments and UTC offsets cleared to zero.
+
+	// No FAT chain. The clusters are contiguous. Directories are always whole clusters.
+	const ClusterRun &run = file.run;
+	const u64 length = (file.isDir ? (u64)run.count * bytesPerClus : file.size);
+	set[1].entryType                    = TYPE_STREAM;
+	set[1].stream.generalSecondaryFlags = STREAM_FLAG_ALLOC_POSSIBLE | (run.count > 0 ? STREAM_FLAG_NO_FAT_CHAIN : 0u);
+	set[1].stream.nameLength            = file.name.length();
+	set[1].stream.nameHash              = calcNameHash(file.name, upCase);
+	set[1].stream.validDataLength       = length;
+	set[1].stream.firstCluster          = (run.count > 0 ? EXFAT_FIRST_ENT + run.start : 0);
+	set[1].stream.dataLength            = length;
+
+	for(u32 i = 2; i < setSize; i++)
+	{
+		const size_t pos = (i - 2) * 15;
+		set[i].entryType = TYPE_NAME;
+		memcpy(set[i].name.fileName, &file.name[pos], sizeof(char16_t) * std::min<size_t>(file.name.length() - pos, 15));
+	}
 
-		count -= bits;
-	} while(count);
+	set[0].file.setChecksum = calcEntrySetChecksum(set, setSize);
+}
+
+// Writes copied directories and file contents in cluster order.
+static int writeExfatData(BufferedFsWriter &dev, const std::vector<FsFile> &files, const u64 heapOffset,
+                          const u32 bytesPerClus, const char16_t *const upCase)
+{
+	for(const FsFile &file : files)
+	{
+		if(file.srcPath.empty() || file.run.count == 0) continue;
+
+		const u64 offset = heapOffset + (u64)file.run.start * bytesPerClus;
+		int res;
+		if(file.isDir)
+		{
+			std::vector<ExfatDirEnt> entries;
+			entries.reserve(getExfatDirSize(file) / sizeof(ExfatDirEnt));
+			for(const FsFile &child : file.children) addFileEntrySet(entries, child, bytesPerClus, upCase);
+
+			res = dev.fillAndWrite(entries.data(), offset, entries.size() * sizeof(ExfatDirEnt));
+			if(res == 0) res = writeExfatData(dev, file.children, heapOffset, bytesPerClus, upCase);
+		}
+		else
+		{
+			res = dev.fill(offset);
+			if(res == 0) res = dev.writeFile(file.srcPath.c_str(), file.size);
+		}
+		if(res != 0) return res;
+	}
 
 	return 0;
 }
 
-int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u16string &label)
+int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u16string &label, std::vector<FsFile> &files)
 {
 	// Seek ahead to partition start and fill everything inbetween with zeros.
 	const u64 partitionOffset = params.partitionOffset;
@@ -93,6 +251,21 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	const u32 upCaseClus        = util::udivCeil(sizeof(g_upCaseTable), bytesPerClus);
 	const u32 fatOffset         = params.fatOffset;
 	const u32 clusterHeapOffset = params.clusterHeapOffset;
+
+	// Root directory with label, bitmap and up-case table entries plus the file entry sets.
+	u32 rootEntries = 3;
+	for(const FsFile &file : files) rootEntries += getEntrySetSize(file);
+	const u32 rootClus = util::udivCeil(rootEntries * (u32)sizeof(ExfatDirEnt), bytesPerClus);
+
+	// Files start at the next alignment unit after the root directory.
+	std::vector<FsFile*> order;
+	std::vector<ClusterRun> runs{{0, bitmapClus + upCaseClus + rootClus}};
+	if(!allocFileClusters(files, runs[0].count, params.alignment / secPerClus, bytesPerClus, clusterCount,
+	                      getExfatDirSize, order))
+		return ENOSPC;
+	for(const FsFile *const file : order) runs.push_back(file->run);
+	u64 usedClus = 0;
+	for(const ClusterRun &run : runs) usedClus += run.count;
 	ExfatBootSec *const bs = reinterpret_cast<ExfatBootSec*>(bootRegion.get());
 	memcpy(bs->jumpBoot, BS_JUMP_BOOT, 3);
 	memcpy(bs->fileSystemName, BS_FILE_SYS_NAME, 8);
@@ -103,14 +276,14 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	bs->clusterHeapOffset           = clusterHeapOffset;
 	bs->clusterCount                = clusterCount;
 	bs->firstClusterOfRootDirectory = EXFAT_FIRST_ENT + bitmapClus + upCaseClus;
-	bs->volumeSerialNumber          = makeVolId();
+	bs->volumeSerialNumber          = (params.volId != 0 ? params.volId : makeVolId());
 	bs->fileSystemRevision          = BS_FILE_SYS_REV_1_00;
 	// volumeFlags cleared to zero.
 	bs->bytesPerSectorShift         = util::countTrailingZeros(bytesPerSec);
 	bs->sectorsPerClusterShift      = util::countTrailingZeros(secPerClus);
 	bs->numberOfFats                = 1;
 	bs->driveSelect                 = BS_DRIVE_SELECT;
-	// percentInUse cleared to zero.
+	bs->percentInUse                = usedClus * 100 / clusterCount;
 	memset(bs->bootCode, 0xF4, sizeof(bs->bootCode)); // Fill with x86 hlt instructions.
 	bs->bootSignature               = BS_BOOT_SIG;
 
@@ -125,14 +298,12 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	// TODO: If available get this from existing exFAT volume as per spec.
 	FlashParameters *const flashParams = reinterpret_cast<FlashParameters*>(&bootRegion[bytesPerSec * 9]);
 	memcpy(flashParams->guid, OEM_FLASH_PARAMS_GUID, 16);
-	flashParams->eraseBlockSize = params.alignment * bytesPerSec / 2;
+	flashParams->eraseBlockSize = params.eraseBlockSize;
 	// All other fields are zero for SD cards.
 
 	// ----------------------------------------------------------------
 	// Boot Checksum.
-	const u32 bootChecksum = calcExFatBootChecksum(bootRegion.get(), bytesPerSec);
-	for(unsigned i = 0; i < bytesPerSec / 4; i++)
-		*reinterpret_cast<u32*>(&bootRegion[bytesPerSec * 11 + i * 4]) = bootChecksum;
+	setBootChecksum(bootRegion.get(), bytesPerSec);
 
 	// Write main boot region.
 	res = dev.write(bootRegion.get(), bytesPerSec * 12);
@@ -162,8 +333,8 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	if(res != 0) return res;
 
 	// Root directory cluster chain.
-	// TODO: Is 1 cluster always safe for root dir? Minimum size is 512 bytes.
-	res = writeContinuousExfatChain(dev, bitmapClus + upCaseClus, 1);
+	// Preallocated files have no FAT chain.
+	res = writeContinuousExfatChain(dev, bitmapClus + upCaseClus, rootClus);
 	if(res != 0) return res;
 
 	// ----------------------------------------------------------------
@@ -172,8 +343,7 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	res = dev.fill(curOffset);
 	if(res != 0) return res;
 
-	// TODO: Is 1 cluster always safe for root dir? Minimum size is 512 bytes.
-	res = writeInitialBitmapEntries(dev, bitmapClus + upCaseClus + 1);
+	res = writeBitmapEntries(dev, runs);
 	if(res != 0) return res;
 
 	// ----------------------------------------------------------------
@@ -185,7 +355,8 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	// ----------------------------------------------------------------
 	// Root Directory.
 	// We always include a label entry even if label size is 0. This is allowed by the exFAT spec.
-	ExfatDirEnt entries[3]{};
+	std::vector<ExfatDirEnt> entries(3);
+	entries.reserve(rootEntries);
 	entries[0].entryType            = TYPE_VOL_LABEL;
 	entries[0].label.characterCount = label.length();
 	memcpy(entries[0].label.volumeLabel, label.c_str(), sizeof(char16_t) * label.length());
@@ -200,11 +371,26 @@ int makeFsExFat(const FormatParams &params, BufferedFsWriter &dev, const std::u1
 	entries[2].upCase.firstCluster  = EXFAT_FIRST_ENT + bitmapClus;
 	entries[2].upCase.dataLength    = sizeof(g_upCaseTable);
 
+	// Name hashes are calculated over the up-cased name.
+	std::unique_ptr<char16_t[]> upCase;
+	if(!files.empty())
+	{
+		upCase.reset(new(std::nothrow) char16_t[0x10000]);
+		if(!upCase) return ENOMEM;
+		expandUpCaseTable(upCase.get());
+
+		for(const FsFile &file : files) addFileEntrySet(entries, file, bytesPerClus, upCase.get());
+	}
+
 	curOffset += secPerClus * bytesPerSec * upCaseClus;
-	res = dev.fillAndWrite(entries, curOffset, sizeof(entries));
+	res = dev.fillAndWrite(entries.data(), curOffset, entries.size() * sizeof(ExfatDirEnt));
 	if(res != 0) return res;
 
 	// Fill remaining directory entries.
-	curOffset += secPerClus * bytesPerSec;
-	return dev.fill(curOffset);
+	curOffset += secPerClus * bytesPerSec * rootClus;
+	res = dev.fill(curOffset);
+	if(res != 0) return res;
+
+	// Copied directories and files.
+	return writeExfatData(dev, files, (partitionOffset + clusterHeapOffset) * bytesPerSec, bytesPerClus, upCase.get());
 }
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2023 profi200
 
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
@@ -103,7 +105,8 @@ u32 makeVolId(void)
 	// tm_sec is 0-60 WHY?
 	// I think we can get away pretending there are no milliseconds.
 	const time_t _time = time(NULL);
-	const struct tm *const now = localtime(&_time);
+	struct tm nowBuf;
+	const struct tm *const now = localtime_r(&_time, &nowBuf);
 	const u16 lo = (u16)((now->tm_mon + 1)<<8 | now->tm_mday) + ((now->tm_sec % 60)<<8 /*| (ms / 10)*/);
 	const u16 hi = (u16)(now->tm_hour<<8 | now->tm_min) + (now->tm_year + 1900);
 	const u32 volId = (u32)hi<<16 | lo;
@@ -114,7 +117,211 @@ u32 makeVolId(void)
 	return volId;
 }
 
-int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::string &label)
+// Date in the high 16 bits and time in the low 16 bits. Also used by exFAT.
+u32 makeFatTimestamp(const time_t t)
+{
+	struct tm tmBuf;
+	const struct tm *const tm = localtime_r(&t, &tmBuf);
+	const u32 date = (u32)std::clamp(tm->tm_year - 80, 0, 127)<<9 | (u32)(tm->tm_mon + 1)<<5 | tm->tm_mday;
+	const u32 time = (u32)tm->tm_hour<<11 | (u32)tm->tm_min<<5 | (tm->tm_sec % 60) / 2;
+
+	return date<<16 | time;
+}
+
+static bool allocNode(FsFile &file, u64 &cur, const u32 bytesPerClus, const u32 clusCount,
+                      const DirSizeFunc dirSize, std::vector<FsFile*> &order)
+{
+	u64 count = 0;
+	if(file.isDir)
+	{
+		const u64 bytes = dirSize(file);
+		count = (bytes > 0 ? util::udivCeil(bytes, bytesPerClus) : 1);
+	}
+	else if(file.size > 0) count = util::udivCeil(file.size, bytesPerClus);
+
+	if(cur + count > clusCount)
+	{
+		fputs("Error: Files don't fit on the card.\n", stderr);
+		return false;
+	}
+
+	file.run = {static_cast<u32>(count > 0 ? cur : 0), static_cast<u32>(count)};
+	if(count > 0) order.push_back(&file);
+	cur += count;
+
+	for(FsFile &child : file.children)
+		if(!allocNode(child, cur, bytesPerClus, clusCount, dirSize, order)) return false;
+
+	return true;
+}
+
+// Assigns each file and directory a contiguous run of clusters. Copied trees are packed
+// in pre-order starting at the next alignment unit boundary. Preallocated files each start
+// on their own boundary. next is the index of the first free cluster in the data area.
+// order receives all files and directories with clusters in ascending cluster order.
+bool allocFileClusters(std::vector<FsFile> &files, const u32 next, const u32 auClus, const u32 bytesPerClus,
+                       const u32 clusCount, const DirSizeFunc dirSize, std::vector<FsFile*> &order)
+{
+	order.clear();
+	u64 cur = next;
+	bool first = true;
+	for(FsFile &file : files)
+	{
+		if(first || file.srcPath.empty()) cur = util::roundUp(cur, auClus);
+		first = false;
+
+		if(!allocNode(file, cur, bytesPerClus, clusCount, dirSize, order)) return false;
+	}
+
+	return true;
+}
+
+// Writes entries for a chain of length clusters at the current position.
+template<typename T>
+static int writeContinuousFatChain(BufferedFsWriter &dev, const u32 start, const u32 length, const T eof)
+{
+	const u32 first = FAT_FIRST_ENT + start;
+	const u64 size  = (u64)length * sizeof(T);
+	return dev.writeGenerated(size, [first, size, eof](u8 *const dst, const u64 offset, const u32 len)
+	{
+		T *const entries = reinterpret_cast<T*>(dst);
+		const u32 next = first + offset / sizeof(T) + 1;
+		for(u32 i = 0; i < len / sizeof(T); i++) entries[i] = next + i;
+
+		if(offset + len == size) entries[len / sizeof(T) - 1] = eof;
+	});
+}
+
+// Writes the reserved entries and the chains of the FAT32 root directory, files and directories.
+static int writeFat(BufferedFsWriter &dev, const u64 offset, const u32 *const rsvdEnt, const u32 rsvdEntrySize,
+                    const u8 fatBits, const u32 rootClus, const std::vector<FsFile*> &order)
+{
+	int res = dev.fillAndWrite(rsvdEnt, offset, rsvdEntrySize);
+	if(res == 0 && fatBits == 32) res = writeContinuousFatChain<u32>(dev, 0, rootClus, FAT32_EOF);
+
+	for(const FsFile *const file : order)
+	{
+		if(res != 0) break;
+
+		const ClusterRun &run = file->run;
+		res = dev.fill(offset + (u64)(FAT_FIRST_ENT + run.start) * (fatBits / 8));
+		if(res != 0) break;
+		if(fatBits == 32) res = writeContinuousFatChain<u32>(dev, run.start, run.count, FAT32_EOF);
+		else              res = writeContinuousFatChain<u16>(dev, run.start, run.count, FAT16_EOF);
+	}
+
+	return res;
+}
+
+static u32 getFatEntryCount(const FsFile &file)
+{
+	// 13 characters per long name entry.
+	return 1 + (file.needsLfn ? util::udivCeil(file.name.length(), 13u) : 0);
+}
+
+// Subdirectories start with the dot and dotdot entries.
+static u64 getFatDirSize(const FsFile &dir)
+{
+	u64 entries = 2;
+	for(const FsFile &child : dir.children) entries += getFatEntryCount(child);
+
+	return entries * sizeof(FatDirEnt);
+}
+
+static FatDirEnt makeFatDirEnt(const char *const name, const u8 attr, const u32 timestamp, const u32 firstClus, const u32 size)
+{
+	FatDirEnt ent{};
+	memcpy(ent.name, name, 11);
+	ent.attr       = attr;
+	ent.crtTime    = timestamp & 0xFFFFu;
+	ent.crtDate    = timestamp>>16;
+	ent.lstAccDate = timestamp>>16;
+	ent.fstClusHi  = firstClus>>16;
+	ent.wrtTime    = timestamp & 0xFFFFu;
+	ent.wrtDate    = timestamp>>16;
+	ent.fstClusLo  = firstClus & 0xFFFFu;
+	ent.fileSize   = size;
+
+	return ent;
+}
+
+// Appends the long name entries (last part first) and the short entry of file to dir.
+static void addFatDirEntries(std::vector<FatDirEnt> &dir, const FsFile &file)
+{
+	if(file.needsLfn)
+	{
+		const u8 chksum = calcLdirChksum(file.shortName);
+		const std::u16string &name = file.name;
+		const u32 lfnCount = util::udivCeil(name.length(), 13u);
+		for(u32 ord = lfnCount; ord > 0; ord--)
+		{
+			// The name is terminated with 0 and padded with 0xFFFF if it doesn't fill the last entry.
+			char16_t part[13];
+			for(u32 i = 0; i < 13; i++)
+			{
+				const size_t pos = (ord - 1) * 13 + i;
+				part[i] = (pos < name.length() ? name[pos] : (pos == name.length() ? u'\0' : u'\uFFFF'));
+			}
+
+			FatLdirEnt ldir{};
+			ldir.ord    = ord | (ord == lfnCount ? LDIR_LAST_LONG_ENTRY : 0u);
+			ldir.attr   = LDIR_ATTR_LONG_NAME;
+			ldir.chksum = chksum;
+			memcpy(ldir.name1, &part[0], sizeof(ldir.name1));
+			memcpy(ldir.name2, &part[5], sizeof(ldir.name2));
+			memcpy(ldir.name3, &part[11], sizeof(ldir.name3));
+
+			FatDirEnt ent;
+			memcpy(&ent, &ldir, sizeof(FatDirEnt));
+			dir.push_back(ent);
+		}
+	}
+
+	const u32 firstClus = (file.run.count > 0 ? FAT_FIRST_ENT + file.run.start : 0);
+	dir.push_back(makeFatDirEnt(file.shortName, (file.isDir ? DIR_ATTR_DIRECTORY : DIR_ATTR_ARCHIVE),
+	                            file.timestamp, firstClus, (file.isDir ? 0 : file.size)));
+}
+
+// Writes the entries of a copied subdirectory. parentClus is 0 for the root directory.
+static int writeFatDir(BufferedFsWriter &dev, const FsFile &dir, const u32 parentClus, const u64 offset)
+{
+	const u32 firstClus = FAT_FIRST_ENT + dir.run.start;
+	std::vector<FatDirEnt> entries;
+	entries.reserve(getFatDirSize(dir) / sizeof(FatDirEnt));
+	entries.push_back(makeFatDirEnt(".          ", DIR_ATTR_DIRECTORY, dir.timestamp, firstClus, 0));
+	entries.push_back(makeFatDirEnt("..         ", DIR_ATTR_DIRECTORY, dir.timestamp, parentClus, 0));
+	for(const FsFile &child : dir.children) addFatDirEntries(entries, child);
+
+	return dev.fillAndWrite(entries.data(), offset, entries.size() * sizeof(FatDirEnt));
+}
+
+// Writes copied directories and file contents in cluster order.
+static int writeFatData(BufferedFsWriter &dev, const std::vector<FsFile> &files, const u32 parentClus,
+                        const u64 dataOffset, const u32 bytesPerClus)
+{
+	for(const FsFile &file : files)
+	{
+		if(file.srcPath.empty() || file.run.count == 0) continue;
+
+		const u64 offset = dataOffset + (u64)file.run.start * bytesPerClus;
+		int res;
+		if(file.isDir)
+		{
+			res = writeFatDir(dev, file, parentClus, offset);
+			if(res == 0) res = writeFatData(dev, file.children, FAT_FIRST_ENT + file.run.start, dataOffset, bytesPerClus);
+		}
+		else
+		{
+			res = dev.fill(offset);
+			if(res == 0) res = dev.writeFile(file.srcPath.c_str(), file.size);
+		}
+		if(res != 0) return res;
+	}
+
+	return 0;
+}
+
+int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::string &label, std::vector<FsFile> &files)
 {
 	// Seek ahead to partition start and fill everything inbetween with zeros.
 	const u32 partStart = params.partStart;
@@ -133,15 +340,33 @@ int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::stri
 		memcpy(labelBuf, label.c_str(), labelLen);
 	}
 
+	// The FAT12/16 root directory has a fixed size. FAT32 grows it in clusters.
+	const u8  fatBits      = params.fatBits;
+	const u32 secPerClus   = params.secPerClus;
+	const u32 bytesPerClus = secPerClus * bytesPerSec;
+	u32 dirEntries = (label.empty() ? 0 : 1);
+	for(const FsFile &file : files) dirEntries += getFatEntryCount(file);
+	u32 rootClus = 1;
+	if(fatBits < 32 && dirEntries > 512)
+	{
+		fputs("Error: Too many files for the root directory.\n", stderr);
+		return ENOSPC;
+	}
+	if(fatBits == 32 && dirEntries > 0) rootClus = util::udivCeil(dirEntries * sizeof(FatDirEnt), bytesPerClus);
+
+	// Files start at the next alignment unit after the root directory.
+	std::vector<FsFile*> order;
+	if(!allocFileClusters(files, (fatBits < 32 ? 0 : rootClus), params.alignment / secPerClus,
+	                      bytesPerClus, params.maxClus, getFatDirSize, order))
+		return ENOSPC;
+
 	// Boot sector.
 	BootSec bs{};
-	const u8 fatBits = params.fatBits;
 	const u8 jmpBoot[3] = {0xEB, (u8)(fatBits < 32 ? 0x3C : 0x58), 0x90}; // Note: SDFormatter hardcodes 0xEB 0x00 0x90.
 	memcpy(bs.jmpBoot, jmpBoot, 3);
 	memcpy(bs.oemName, BS_DEFAULT_OEM_NAME, 8);
 
 	// BIOS Parameter Block (BPB).
-	const u32 secPerClus  = params.secPerClus;
 	const u32 rsvdSecCnt  = params.rsvdSecCnt;
 	const u32 partSectors = static_cast<u32>(params.totSec - partStart);
 	const u32 secPerFat   = params.secPerFat;
@@ -164,7 +389,7 @@ int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::stri
 		// Extended BIOS Parameter Block FAT12/FAT16.
 		bs.ebpb.drvNum  = EBPB_DEFAULT_DRV_NUM;
 		bs.ebpb.bootSig = EBPB_BOOT_SIG;
-		bs.ebpb.volId   = makeVolId();
+		bs.ebpb.volId   = (params.volId != 0 ? params.volId : makeVolId());
 		memcpy(bs.ebpb.volLab, labelBuf, 11);
 		memcpy(bs.ebpb.filSysType, (fatBits == 12 ? EBPB_FIL_SYS_TYPE_FAT12 : EBPB_FIL_SYS_TYPE_FAT16), 8);
 		memset(bs.ebpb.bootCode, 0xF4, sizeof(bs.ebpb.bootCode)); // Fill with x86 hlt instructions.
@@ -184,7 +409,7 @@ int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::stri
 		bs.ebpb32.bkBootSec    = 6;
 		bs.ebpb32.drvNum       = EBPB_DEFAULT_DRV_NUM;
 		bs.ebpb32.bootSig      = EBPB_BOOT_SIG;
-		bs.ebpb32.volId        = makeVolId();
+		bs.ebpb32.volId        = (params.volId != 0 ? params.volId : makeVolId());
 		memcpy(bs.ebpb32.volLab, labelBuf, 11);
 		memcpy(bs.ebpb32.filSysType, EBPB_FIL_SYS_TYPE_FAT32, 8);
 		memset(bs.ebpb32.bootCode, 0xF4, sizeof(bs.ebpb32.bootCode)); // Fill with x86 hlt instructions.
@@ -208,8 +433,15 @@ int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::stri
 		FsInfo fsInfo{};
 		fsInfo.leadSig   = FS_INFO_LEAD_SIG;
 		fsInfo.strucSig  = FS_INFO_STRUC_SIG;
-		fsInfo.freeCount = params.maxClus - 1; // One cluster is reserved for root directory.
-		fsInfo.nxtFree   = 3;
+		u32 usedClus = rootClus;
+		u32 nxtFree  = rootClus;
+		for(const FsFile *const file : order)
+		{
+			usedClus += file->run.count;
+			if(file->run.start == nxtFree) nxtFree += file->run.count;
+		}
+		fsInfo.freeCount = params.maxClus - usedClus;
+		fsInfo.nxtFree   = FAT_FIRST_ENT + nxtFree;
 		fsInfo.trailSig  = FS_INFO_TRAIL_SIG;
 		res = dev.write(&fsInfo, sizeof(FsInfo));
 		if(res != 0) return res;
@@ -245,7 +477,7 @@ int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::stri
 
 	// Prepare reserved FAT entries.
 	u32 rsvdEntrySize = 4;
-	u32 fat[3];
+	u32 fat[2];
 	if(fatBits < 32)
 	{
 		// Reserve first 2 FAT entries.
@@ -254,36 +486,47 @@ int makeFsFat(const FormatParams &params, BufferedFsWriter &dev, const std::stri
 	}
 	else
 	{
-		// Reserve first 2 FAT entries. A third entry for the root directory cluster.
+		// Reserve first 2 FAT entries. The root directory chain follows.
 		fat[0] = (FAT32_EOF & ~0xFFu) | BPB_DEFAULT_MEDIA;
 		fat[1] = FAT32_EOF;
-		fat[2] = FAT32_EOF;
-		rsvdEntrySize = 3 * 4;
+		rsvdEntrySize = 2 * 4;
 	}
 
 	// Write first FAT.
 	curOffset += rsvdSecCnt * bytesPerSec;
-	res = dev.fillAndWrite(fat, curOffset, rsvdEntrySize);
+	res = writeFat(dev, curOffset, fat, rsvdEntrySize, fatBits, rootClus, order);
 	if(res != 0) return res;
 
 	// Write second FAT.
 	curOffset += secPerFat * bytesPerSec;
-	res = dev.fillAndWrite(fat, curOffset, rsvdEntrySize);
+	res = writeFat(dev, curOffset, fat, rsvdEntrySize, fatBits, rootClus, order);
 	if(res != 0) return res;
 
-	// Create volume label entry in root directory if needed.
-	if(!label.empty())
+	// Create volume label and file entries in root directory if needed.
+	if(dirEntries > 0)
 	{
-		FatDirEnt dir{};                // Make sure all other fields are zero.
-		memcpy(dir.name, labelBuf, 11);
-		dir.attr = DIR_ATTR_VOLUME_ID;
+		std::vector<FatDirEnt> dir;
+		dir.reserve(dirEntries);
+		if(!label.empty())
+		{
+			FatDirEnt ent{}; // Make sure all other fields are zero.
+			memcpy(ent.name, labelBuf, 11);
+			ent.attr = DIR_ATTR_VOLUME_ID;
+			dir.push_back(ent);
+		}
+		for(const FsFile &file : files) addFatDirEntries(dir, file);
 
 		curOffset += secPerFat * bytesPerSec;
-		res = dev.fillAndWrite(&dir, curOffset, sizeof(FatDirEnt));
+		res = dev.fillAndWrite(dir.data(), curOffset, dirEntries * sizeof(FatDirEnt));
 		if(res != 0) return res;
 	}
 
-	// Fill rest of FS area and root directory cluster for FAT32.
-	curOffset = (partStart + params.fsAreaSize + (fatBits < 32 ? 0 : secPerClus)) * bytesPerSec;
-	return dev.fill(curOffset);
+	// Fill rest of FS area and root directory clusters for FAT32.
+	const u64 dataOffset = (u64)(partStart + params.fsAreaSize) * bytesPerSec;
+	curOffset = dataOffset + (fatBits < 32 ? 0 : (u64)bytesPerClus * rootClus);
+	res = dev.fill(curOffset);
+	if(res != 0) return res;
+
+	// Copied directories and files.
+	return writeFatData(dev, files, 0, dataOffset, bytesPerClus);
 }
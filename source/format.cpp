@@ -1,9 +1,21 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2023 profi200
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <exception>
 #include <memory>
+#include <climits>
+#include <csignal>
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <sys/random.h>
 #include "types.h"
 #include "format.h"
 #include "mbr.h"
@@ -11,9 +23,30 @@
 #include "fat.h"
 #include "errors.h"
 #include "buffered_fs_writer.h"
+#include "buffer_pool.h"
+#include "output_capture.h"
+#include "util.h"
 #include "vol_label.h"
 #include "verbose_printf.h"
 #include "privileges.h"
+#include "bench.h"
+#include "capacity.h"
+#include "erase_probe.h"
+#include "overwrite.h"
+#include "populate.h"
+#include "progress.h"
+
+
+// Memory for write buffers shared by all devices of a batch.
+// Devices wait for buffers of others to be returned when it is used up.
+static constexpr u64 g_batchPoolBudget = 1024 * 1024 * 256;
+
+// Bytes compared at the start of each zero extent for --if-needed.
+// Covers the FAT/bitmap heads and the end of the root directory.
+static constexpr u64 g_compareZeroHead = 1024 * 64;
+
+// Bytes read back per sample of zero and file extents for --verify.
+static constexpr u64 g_verifySample = 1024 * 64;
 
 
 typedef struct
@@ -31,9 +64,32 @@ typedef struct
 	u32 alignment;
 } AlignData;
 
+// Wall clock time of each phase in nanoseconds. Phases which didn't run are 0.
+typedef struct
+{
+	u64 open;
+	u64 params;  // Capacity verification, probing and layout calculation.
+	u64 erase;
+	u64 mbr;     // Recording the partition table in the write plan.
+	u64 fsMeta;  // Recording the filesystem in the write plan.
+	u64 compare; // --if-needed.
+	u64 write;   // Executing the write plan including zero-fill.
+	u64 verify;  // --verify.
+	u64 close;   // Including the flush and partition rescan.
+} PhaseTimes;
+
+
+// SIGINT and SIGTERM cancel erases while any device is erasing.
+// Only installed if the signals have their default action (the daemon has its own handlers).
+static std::mutex g_eraseSigMutex;
+static u32 g_eraseSigUsers = 0;
+static bool g_eraseSigInstalled = false;
+static struct sigaction g_oldSigInt, g_oldSigTerm;
 
 
-static bool getFormatParams(const u64 totSec, const ArgFlags flags, FormatParams &params)
+
+// eraseSectors is a measured erase block size in physical sectors or 0.
+static bool getFormatParams(const u64 totSec, const ArgFlags flags, const u32 eraseSectors, FormatParams &params)
 {
 	if(totSec == 0) return false;
 	if(flags.forceFat32 && totSec > MAX_CAPACITY_FAT32) return false;
@@ -102,8 +158,11 @@ static bool getFormatParams(const u64 totSec, const ArgFlags flags, FormatParams
 			fputs("Warning: FAT32 doesn't support clusters bigger than 64 KiB. Overriding.\n", stderr);
 		}
 	}
-	params.totSec      = PHY2LOG(totSec, bytesPerSec);
-	params.alignment   = PHY2LOG(alignParams->alignment, bytesPerSec);
+	// Both are powers of 2 so the bigger one is a multiple of the other.
+	const u32 alignment = std::max(alignParams->alignment, eraseSectors);
+	params.totSec         = PHY2LOG(totSec, bytesPerSec);
+	params.alignment      = PHY2LOG(alignment, bytesPerSec);
+	params.eraseBlockSize = (eraseSectors != 0 ? eraseSectors : alignment / 2) * 512;
 	params.secPerClus  = secPerClus;
 	params.bytesPerSec = bytesPerSec;
 	params.fatBits     = fatBits;
@@ -185,6 +244,117 @@ static bool getFormatParams(const u64 totSec, const ArgFlags flags, FormatParams
 	return true;
 }
 
+// Builds the root directory contents from the copied tree and the files to preallocate.
+static bool getRootFiles(const FormatArgs &args, const u8 fatBits, std::vector<FsFile> &files)
+{
+	const std::vector<PreallocFile> &prealloc = args.prealloc;
+	if((!prealloc.empty() || args.populateDir != nullptr) && fatBits == 12)
+	{
+		fputs("Error: Preallocating and copying files is not supported for FAT12.\n", stderr);
+		return false;
+	}
+
+	if(args.populateDir != nullptr && !scanHostDir(args.populateDir, fatBits, files)) return false;
+
+	const u32 timestamp = makeFatTimestamp(time(NULL));
+	for(const PreallocFile &pre : prealloc)
+	{
+		FsFile file{};
+		const char *const name = pre.name.c_str();
+		if(fatBits <= 32)
+		{
+			if(!convertCheckFatShortName(name, file.shortName)) return false;
+			if(pre.size > 0xFFFFFFFFu)
+			{
+				fprintf(stderr, "Error: File '%s' is bigger than the FAT limit of 4 GiB - 1.\n", name);
+				return false;
+			}
+		}
+		if(convertCheckExfatName(name, file.name) == 0) return false;
+		file.timestamp = timestamp;
+		file.size      = pre.size;
+		files.push_back(std::move(file));
+	}
+
+	return checkFileNames(files, fatBits);
+}
+
+// Reads the disk signature and volume ID of the current format so they are kept
+// and an unchanged card compares equal. Missing IDs are garbage or 0 which
+// just makes the comparison fail or generates new ones.
+static int readCurrentIds(BlockDev &dev, FormatParams &params)
+{
+	const u32 ioAlign = dev.getIoAlignment();
+	const std::unique_ptr<u8[], decltype(&free)> buf(reinterpret_cast<u8*>(aligned_alloc(BlockDev::getBufAlignment(), ioAlign)), free);
+	if(!buf) return ENOMEM;
+
+	int res = dev.read(buf.get(), 0, ioAlign / 512);
+	if(res != 0) return res;
+	memcpy(&params.diskSig, &buf[offsetof(Mbr, diskSig)], 4);
+
+	const u8 fatBits = params.fatBits;
+	const u64 partStart = LOG2PHY(fatBits < 64 ? params.partStart : params.partitionOffset, params.bytesPerSec);
+	res = dev.read(buf.get(), partStart, ioAlign / 512);
+	if(res != 0) return res;
+
+	size_t volIdOffset;
+	if(fatBits < 32)       volIdOffset = offsetof(BootSec, ebpb.volId);
+	else if(fatBits == 32) volIdOffset = offsetof(BootSec, ebpb32.volId);
+	else                   volIdOffset = offsetof(ExfatBootSec, volumeSerialNumber);
+	memcpy(&params.volId, &buf[volIdOffset], 4);
+
+	return 0;
+}
+
+// Records the partition table and filesystem in the write plan.
+static u32 planFormat(const FormatParams &params, BufferedFsWriter &dev, char16_t *const label, std::vector<FsFile> &files,
+                      PhaseTimes *const times = nullptr)
+{
+	// Record everything first so writes can be merged and zeros offloaded.
+	if(dev.startPlan() != 0) return ERR_PARTITION;
+
+	// Create a new Master Boot Record and partition.
+	verbosePuts("Creating new partition table and partition...");
+	u64 startNs = util::getNs();
+	if(createMbrAndPartition(params, dev) != 0) return ERR_PARTITION;
+	if(times != nullptr) times->mbr += util::getNs() - startNs;
+
+	// Clear filesystem areas and write a new Volume Boot Record.
+	verbosePuts("Formatting the partition...");
+	startNs = util::getNs();
+	if(params.fatBits <= 32)
+	{
+		if(makeFsFat(params, dev, reinterpret_cast<char*>(label), files) != 0)
+			return ERR_FORMAT;
+	}
+	else
+	{
+		if(makeFsExFat(params, dev, label, files) != 0)
+			return ERR_FORMAT;
+	}
+	if(times != nullptr) times->fsMeta += util::getNs() - startNs;
+
+	return 0;
+}
+
+// Picks an alignment unit sized scratch region in the middle of the card.
+// After formatting this is free space in the data area.
+static int runBench(BlockDev &dev, const u64 totSec, const FormatParams &params, const char *const jsonPath)
+{
+	const u32 alignment = LOG2PHY(params.alignment, params.bytesPerSec);
+	u64 sectors = std::max<u64>(alignment, 64 * 1024 * 1024 / 512);
+	if(sectors > totSec / 4) sectors = totSec / 4 / alignment * alignment;
+	const u64 start = totSec / 2 / alignment * alignment;
+
+	if(benchmarkDev(dev, start, sectors, alignment, jsonPath) != 0)
+	{
+		fputs("Benchmark failed.\n", stderr);
+		return ERR_BENCH;
+	}
+
+	return 0;
+}
+
 static void printFormatParams(const FormatParams &params)
 {
 	const char *fsName;
@@ -237,33 +407,75 @@ static void printFormatParams(const FormatParams &params)
 	}
 }
 
-u32 formatSd(const char *const path, const std::string &label, const ArgFlags flags, const u64 overrTotSec)
+// Prints what the device supports.
+static void printDevInfo(BufferedFsWriter &dev, const ArgFlags flags, const FormatArgs &args)
 {
-	BufferedFsWriter dev;
-	if(dev.open(path) != 0) return ERR_DEV_OPEN;
-	dropPrivileges();
+	const u32 queueDepth = args.queueDepth;
+	if(flags.direct && !dev.isDirect())
+		verbosePuts("O_DIRECT not supported by device. Falling back to buffered I/O.");
 
-	u64 totSec = dev.getSectors();
-	if(totSec < MIN_CAPACITY)
+	const BlockDev::AsyncBackend backend = dev.getAsyncBackend();
+	if(queueDepth > 1 && backend == BlockDev::ASYNC_SYNC)
+		verbosePuts("Asynchronous writes not available. Falling back to synchronous writes.");
+	else
 	{
-		fputs("SD card capacity too small.\n", stderr);
-		return ERR_DEV_TOO_SMALL;
+		if(queueDepth > 1 && !flags.writerThread && backend == BlockDev::ASYNC_THREAD)
+			verbosePuts("io_uring not available. Falling back to writer thread.");
+		verbosePrintf("Write queue depth: %" PRIu32 "\n", dev.getQueueDepth());
 	}
 
+	const BlockDev::ZeroMethod zeroMethod = dev.getZeroMethod();
+	if(zeroMethod == BlockDev::ZERO_WRITE_ZEROES)
+		verbosePuts("Zero-fill offload: WRITE ZEROES");
+	else if(zeroMethod == BlockDev::ZERO_DISCARD)
+		verbosePuts("Zero-fill offload: discard (verified on first use)");
+	else if(zeroMethod == BlockDev::ZERO_PUNCH_HOLE)
+		verbosePuts("Zero-fill offload: punch hole");
+
+	if(args.imageSize == 0)
+	{
+		const QueueLimits &limits = dev.getQueueLimits();
+		verbosePrintf("Queue limits (0 = unknown): Max request %" PRIu32 " KiB, optimal I/O %" PRIu32 " KiB,\n"
+		              "  discard granularity %" PRIu32 " KiB, preferred erase size %" PRIu32 " KiB.\n",
+		              limits.maxIoSize / 1024, limits.optimalIoSize / 1024,
+		              limits.discardGranularity / 1024, limits.preferredEraseSize / 1024);
+	}
+	verbosePrintf("Write buffer size: %" PRIu32 " KiB\n", dev.getBufferSize() / 1024);
+}
+
+// Applies the capacity override. Returns 0 if the card is too small.
+static u64 getFormatSectors(u64 totSec, const FormatArgs &args)
+{
+	if(totSec < MIN_CAPACITY) return 0;
+
 	// Allow overriding the capacity only if the new capacity is lower.
+	const u64 overrTotSec = args.overrTotSec;
 	if(overrTotSec >= MIN_CAPACITY && overrTotSec < totSec)
 		totSec = overrTotSec;
-	printf("SD card contains %" PRIu64 " sectors.\n", totSec);
 
-	// Collect and calculate all the infos needed for formatting.
-	FormatParams params{};
-	if(!getFormatParams(totSec, flags, params))
+	return totSec;
+}
+
+// For SD cards in native readers the preferred erase size is the allocation unit.
+static u32 getPrefEraseSectors(const BufferedFsWriter &dev)
+{
+	const u32 prefErase = dev.getQueueLimits().preferredEraseSize;
+	if(prefErase >= 1024 * 16 && prefErase <= 1024 * 1024 * 64 && std::has_single_bit(prefErase))
+		return prefErase / 512;
+
+	return 0;
+}
+
+// Collects and calculates all the infos needed for formatting and converts the label and files.
+static u32 prepareFormat(const u64 totSec, const u32 eraseSectors, const std::string &label, const ArgFlags flags,
+                         const FormatArgs &args, FormatParams &params, char16_t *const convertedLabel, std::vector<FsFile> &files)
+{
+	if(!getFormatParams(totSec, flags, eraseSectors, params))
 	{
 		fputs("The SD card can not be formatted with the given parameters.\n", stderr);
 		return ERR_FORMAT_PARAMS;
 	}
 
-	char16_t convertedLabel[12]{};
 	if(label.length() > 0)
 	{
 		if(params.fatBits < 64)
@@ -278,42 +490,711 @@ u32 formatSd(const char *const path, const std::string &label, const ArgFlags fl
 		}
 	}
 
-	if(flags.erase || flags.secErase)
+	if(!getRootFiles(args, params.fatBits, files)) return ERR_INVALID_ARG;
+
+	return 0;
+}
+
+// The handler is reset after the first signal so a second one terminates as usual.
+static void onEraseSignal(int)
+{
+	BlockDev::cancelErase();
+}
+
+static void beginEraseSignals(void)
+{
+	std::lock_guard lock(g_eraseSigMutex);
+	if(g_eraseSigUsers++ > 0) return;
+
+	BlockDev::cancelErase(false);
+	sigaction(SIGINT, nullptr, &g_oldSigInt);
+	sigaction(SIGTERM, nullptr, &g_oldSigTerm);
+	if(g_oldSigInt.sa_handler != SIG_DFL || g_oldSigTerm.sa_handler != SIG_DFL) return;
+
+	struct sigaction sa{};
+	sa.sa_handler = onEraseSignal;
+	sa.sa_flags   = SA_RESETHAND;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	g_eraseSigInstalled = true;
+}
+
+static void endEraseSignals(void)
+{
+	std::lock_guard lock(g_eraseSigMutex);
+	if(--g_eraseSigUsers > 0 || !g_eraseSigInstalled) return;
+
+	sigaction(SIGINT, &g_oldSigInt, nullptr);
+	sigaction(SIGTERM, &g_oldSigTerm, nullptr);
+	g_eraseSigInstalled = false;
+}
+
+static u32 checkEraseResult(const int eraseRes)
+{
+	if(eraseRes == EOPNOTSUPP)
+	{
+		fputs("SD card erase not supported. Ignoring.\n", stderr);
+	}
+	else if(eraseRes == ECANCELED)
+	{
+		fputs("Erase cancelled.\n", stderr);
+		return ERR_ERASE;
+	}
+	else if(eraseRes != 0) return ERR_ERASE;
+
+	return 0;
+}
+
+static u32 eraseDev(BufferedFsWriter &dev, const ArgFlags flags)
+{
+	if(flags.overwrite != OVERWRITE_NONE)
+	{
+		verbosePuts("Overwriting SD card...");
+
+		beginEraseSignals();
+		const int overwriteRes = overwriteDev(dev.getBlockDev(), static_cast<OverwriteMode>(flags.overwrite), dev.getPool());
+		endEraseSignals();
+		if(overwriteRes == ECANCELED) fputs("Erase cancelled.\n", stderr);
+
+		return (overwriteRes != 0 ? ERR_ERASE : 0);
+	}
+	else if(flags.erase || flags.secErase)
 	{
 		verbosePuts("Erasing SD card...");
 
 		// Note: Linux doesn't support secure erase even if it's technically
 		//       possible by password locking the card and then forcing erase.
+		beginEraseSignals();
 		const int eraseRes = dev.eraseAll(flags.secErase);
-		if(eraseRes == EOPNOTSUPP)
+		endEraseSignals();
+		return checkEraseResult(eraseRes);
+	}
+
+	return 0;
+}
+
+// Start of the data area (cluster heap) in bytes. Everything before it is written by the plan.
+static u64 getDataStart(const FormatParams &params)
+{
+	const u64 sector = (params.fatBits < 64 ? (u64)params.partStart + params.fsAreaSize
+	                                        : params.partitionOffset + params.clusterHeapOffset);
+	return sector * params.bytesPerSec;
+}
+
+static void printPlanStats(const PlanStats &planStats)
+{
+	verbosePrintf("Write plan: %" PRIu32 " extents, %" PRIu64 " data bytes (%" PRIu64 " from files), %" PRIu64 " zero bytes.\n"
+	              "Writing %" PRIu64 " bytes in %" PRIu32 " requests, offloading %" PRIu64 " zero bytes in %" PRIu32 " requests.\n",
+	              planStats.extents, planStats.dataBytes, planStats.fileBytes, planStats.zeroBytes,
+	              planStats.writeBytes, planStats.writes, planStats.offloadBytes, planStats.offloads);
+}
+
+// Bucket i is below 2^(i+1) us. The last one has no upper bound.
+static void printLatencyJson(const u64 (&histogram)[IO_LATENCY_BUCKETS])
+{
+	for(u32 i = 0; i < IO_LATENCY_BUCKETS; i++)
+	{
+		if(i < IO_LATENCY_BUCKETS - 1) printf("%s{\"lt\":%" PRIu64 ",\"count\":%" PRIu64 "}", (i > 0 ? "," : "["), (u64)2<<i, histogram[i]);
+		else                           printf(",{\"lt\":null,\"count\":%" PRIu64 "}]", histogram[i]);
+	}
+}
+
+static void printLatency(const char *const title, const u64 (&histogram)[IO_LATENCY_BUCKETS])
+{
+	puts(title);
+	for(u32 i = 0; i < IO_LATENCY_BUCKETS; i++)
+	{
+		if(histogram[i] == 0) continue;
+		if(i < IO_LATENCY_BUCKETS - 1) printf("  < %8" PRIu64 " us: %" PRIu64 "\n", (u64)2<<i, histogram[i]);
+		else                           printf("  >=%8" PRIu64 " us: %" PRIu64 "\n", (u64)1<<i, histogram[i]);
+	}
+}
+
+// Backend and queue depth are reset by closing so they are passed separately.
+static void printStats(const char *const path, const BlockDev::AsyncBackend backend, const u32 queueDepth, const IoStats &ioStats,
+                       const PhaseTimes &times, const PlanStats &planStats, const bool json)
+{
+	const char *const backendName = (backend == BlockDev::ASYNC_URING ? "io_uring" : (backend == BlockDev::ASYNC_THREAD ? "thread" : "sync"));
+	if(json)
+	{
+		char name[PATH_MAX];
+		util::jsonEscape(name, sizeof(name), path);
+		printf("{\"device\":\"%s\",\"backend\":\"%s\",\"queue_depth\":%" PRIu32 ","
+		       "\"phases_ns\":{\"open\":%" PRIu64 ",\"params\":%" PRIu64 ",\"erase\":%" PRIu64 ",\"mbr\":%" PRIu64 ","
+		       "\"fs_metadata\":%" PRIu64 ",\"compare\":%" PRIu64 ",\"write\":%" PRIu64 ",\"zero_fill\":%" PRIu64 ",\"verify\":%" PRIu64 ","
+		       "\"close\":%" PRIu64 ",\"flush\":%" PRIu64 ",\"rescan\":%" PRIu64 "},"
+		       "\"plan\":{\"extents\":%" PRIu32 ",\"data_bytes\":%" PRIu64 ",\"file_bytes\":%" PRIu64 ",\"zero_bytes\":%" PRIu64 ","
+		       "\"write_bytes\":%" PRIu64 ",\"offload_bytes\":%" PRIu64 ",\"skipped_bytes\":%" PRIu64 "},"
+		       "\"io\":{\"write_bytes\":%" PRIu64 ",\"writes\":%" PRIu64 ",\"zero_bytes\":%" PRIu64 ",\"zero_requests\":%" PRIu64 ","
+		       "\"read_bytes\":%" PRIu64 ",\"reads\":%" PRIu64 ",\"erase_bytes\":%" PRIu64 ",\"erase_requests\":%" PRIu64 ","
+		       "\"syscalls\":%" PRIu64 ",\"write_latency_us\":",
+		       name, backendName, queueDepth,
+		       times.open, times.params, times.erase, times.mbr, times.fsMeta, times.compare, times.write, ioStats.zeroNs,
+		       times.verify, times.close, ioStats.flushNs, ioStats.rescanNs,
+		       planStats.extents, planStats.dataBytes, planStats.fileBytes, planStats.zeroBytes,
+		       planStats.writeBytes, planStats.offloadBytes, planStats.skippedBytes,
+		       ioStats.writeBytes, ioStats.writes, ioStats.zeroBytes, ioStats.zeroOuts,
+		       ioStats.readBytes, ioStats.reads, ioStats.eraseBytes, ioStats.erases, ioStats.syscalls);
+		printLatencyJson(ioStats.writeLatency);
+		fputs(",\"erase_latency_us\":", stdout);
+		printLatencyJson(ioStats.eraseLatency);
+		puts("}}");
+		return;
+	}
+
+	printf("Phase times (ms): open %.1f, params %.1f, erase %.1f, MBR %.1f, FS metadata %.1f, compare %.1f,\n"
+	       "  write %.1f (zero-fill %.1f), verify %.1f, close %.1f (flush %.1f, rescan %.1f).\n",
+	       times.open / 1e6, times.params / 1e6, times.erase / 1e6, times.mbr / 1e6, times.fsMeta / 1e6, times.compare / 1e6,
+	       times.write / 1e6, ioStats.zeroNs / 1e6, times.verify / 1e6, times.close / 1e6, ioStats.flushNs / 1e6, ioStats.rescanNs / 1e6);
+	printf("I/O (%s, queue depth %" PRIu32 "): Wrote %" PRIu64 " bytes in %" PRIu64 " requests, zeroed %" PRIu64 " bytes in %" PRIu64 " requests,\n"
+	       "  read %" PRIu64 " bytes in %" PRIu64 " requests, erased %" PRIu64 " bytes in %" PRIu64 " requests using %" PRIu64 " syscalls.\n",
+	       backendName, queueDepth, ioStats.writeBytes, ioStats.writes, ioStats.zeroBytes, ioStats.zeroOuts,
+	       ioStats.readBytes, ioStats.reads, ioStats.eraseBytes, ioStats.erases, ioStats.syscalls);
+	printLatency("Write latency:", ioStats.writeLatency);
+	if(ioStats.erases > 0) printLatency("Erase latency:", ioStats.eraseLatency);
+}
+
+// Formats an opened device. Privileges must already be dropped.
+// openNs is the time it took to open the device for the stats.
+static u32 formatDev(BufferedFsWriter &dev, const char *const path, const u64 openNs, Progress &progress,
+                     const std::string &label, const ArgFlags flags, const FormatArgs &args)
+{
+	PhaseTimes times{};
+	times.open = openNs;
+	printDevInfo(dev, flags, args);
+
+	u64 startNs = util::getNs();
+	u64 totSec = dev.getSectors();
+	if(flags.verifyCap)
+	{
+		u64 goodSec;
+		if(verifyCapacity(dev.getBlockDev(), flags.verifyFull, goodSec) != 0)
+		{
+			fputs("Capacity verification failed.\n", stderr);
+			return ERR_CAPACITY;
+		}
+
+		if(goodSec < totSec)
 		{
-			fputs("SD card erase not supported. Ignoring.\n", stderr);
+			printf("Fake capacity detected. Only %" PRIu64 " of %" PRIu64 " sectors store data.\n", goodSec, totSec);
+			totSec = goodSec;
 		}
-		else if(eraseRes != 0) return ERR_ERASE;
+		else verbosePuts("Capacity verified.");
 	}
 
-	// Create a new Master Boot Record and partition.
-	verbosePuts("Creating new partition table and partition...");
-	if(createMbrAndPartition(params, dev) != 0) return ERR_PARTITION;
+	totSec = getFormatSectors(totSec, args);
+	if(totSec == 0)
+	{
+		fputs("SD card capacity too small.\n", stderr);
+		return ERR_DEV_TOO_SMALL;
+	}
+	printf("SD card contains %" PRIu64 " sectors.\n", totSec);
 
-	// Clear filesystem areas and write a new Volume Boot Record.
-	verbosePuts("Formatting the partition...");
-	if(params.fatBits <= 32)
+	u32 eraseSectors = getPrefEraseSectors(dev);
+	if(flags.probeAu)
 	{
-		if(makeFsFat(params, dev, reinterpret_cast<char*>(convertedLabel)) != 0)
-			return ERR_FORMAT;
+		u32 probedSectors;
+		if(probeEraseBlock(dev.getBlockDev(), probedSectors) != 0)
+		{
+			fputs("Erase block probing failed.\n", stderr);
+			return ERR_PROBE;
+		}
+
+		if(probedSectors == 0)
+			puts("No erase block boundary found. Using default alignment.");
+		else
+			printf("Detected erase block size: %" PRIu32 " KiB.\n", probedSectors / 2);
+		if(flags.probeAuApply && probedSectors != 0) eraseSectors = probedSectors;
 	}
-	else
+
+	FormatParams params{};
+	char16_t convertedLabel[12]{};
+	std::vector<FsFile> files;
+	u32 res = prepareFormat(totSec, eraseSectors, label, flags, args, params, convertedLabel, files);
+	if(res != 0) return res;
+	times.params = util::getNs() - startNs;
+
+	// The data area is erased in the background while the plan writes the metadata before it.
+	// Differential mode reads the whole plan first so it erases everything up front.
+	// Overwriting competes with the plan for bandwidth so it is done up front too.
+	const bool trim = flags.erase || flags.secErase;
+	const bool pipelineErase = trim && !flags.differential;
+	if((trim || flags.overwrite != OVERWRITE_NONE) && !pipelineErase)
 	{
-		if(makeFsExFat(params, dev, convertedLabel) != 0)
-			return ERR_FORMAT;
+		startNs = util::getNs();
+		progress.start("erase", dev.getBlockDev(), dev.getSectors() * 512);
+		res = eraseDev(dev, flags);
+		progress.stop();
+		if(res != 0) return res;
+		times.erase = util::getNs() - startNs;
+	}
+
+	// Pooled buffers are only taken now since everything before can take long.
+	if(dev.acquireBuffers() != 0) return ERR_FORMAT;
+
+	// Keep the IDs of the current format so they don't count as a difference.
+	if(flags.ifNeeded && readCurrentIds(dev.getBlockDev(), params) != 0)
+		verbosePuts("Reading the current IDs failed. Generating new ones.");
+
+	res = planFormat(params, dev, convertedLabel, files, &times);
+	if(res != 0) return res;
+
+	bool unchanged = false;
+	if(flags.ifNeeded)
+	{
+		verbosePuts("Comparing the card with the new layout...");
+		startNs = util::getNs();
+		if(dev.comparePlan(g_compareZeroHead, unchanged) != 0)
+			verbosePuts("Reading the card failed. Formatting it.");
+		times.compare = util::getNs() - startNs;
+
+		if(unchanged) dev.discardPlan();
+		else
+		{
+			// A real format gets new IDs.
+			verbosePuts("The card differs. Formatting it.");
+			dev.discardPlan();
+			params.diskSig = 0;
+			params.volId   = 0;
+			res = planFormat(params, dev, convertedLabel, files, &times);
+			if(res != 0) return res;
+		}
+	}
+
+	PlanStats planStats{};
+	if(!unchanged)
+	{
+		if(flags.differential && dev.setDifferential(true) != 0) return ERR_FORMAT;
+
+		dev.getPlanStats(planStats);
+		printPlanStats(planStats);
+		startNs = util::getNs();
+
+		// The progress starts first so an erase which ends early is taken out of its total.
+		const u64 dataStart = (pipelineErase ? getDataStart(params) : 0);
+		const u64 eraseBytes = (pipelineErase ? dev.getSectors() * 512 - dataStart : 0);
+		progress.start((pipelineErase ? "erase+write" : "write"), dev.getBlockDev(), planStats.writeBytes + planStats.offloadBytes + eraseBytes);
+		if(pipelineErase)
+		{
+			verbosePuts("Erasing the data area while writing...");
+
+			// The signal handlers are removed as soon as the erase is over. Otherwise
+			// the first signal during the remaining writes would only cancel nothing.
+			beginEraseSignals();
+			if(dev.startErase(dataStart, flags.secErase, endEraseSignals) != 0)
+			{
+				endEraseSignals();
+				progress.stop();
+				fputs("Failed to start erasing.\n", stderr);
+				return ERR_ERASE;
+			}
+		}
+
+		res = dev.executePlan(&planStats, flags.verify);
+		progress.stop();
+		if(pipelineErase)
+		{
+			const u32 eraseRes = checkEraseResult(dev.finishErase());
+			if(eraseRes != 0) return eraseRes;
+		}
+		if(res != 0) return ERR_FORMAT;
+		times.write = util::getNs() - startNs;
+
+		if(flags.verify)
+		{
+			verbosePuts("Verifying the written data...");
+			startNs = util::getNs();
+			bool matches;
+			u64 badOffset;
+			progress.start("verify", dev.getBlockDev(), dev.getVerifyBytes(g_verifySample));
+			const int verifyRes = dev.verifyPlan(g_verifySample, matches, badOffset);
+			progress.stop();
+			if(verifyRes == EOPNOTSUPP)
+			{
+				fputs("Error: Verification needs O_DIRECT which is not supported by the device.\n", stderr);
+				return ERR_VERIFY;
+			}
+			if(verifyRes != 0)
+			{
+				fputs("Verification failed.\n", stderr);
+				return ERR_VERIFY;
+			}
+			if(!matches)
+			{
+				fprintf(stderr, "Verification failed. The card returned different data at byte %" PRIu64 ".\n", badOffset);
+				return ERR_VERIFY;
+			}
+			times.verify = util::getNs() - startNs;
+			verbosePuts("Verification passed.");
+		}
+		if(flags.differential)
+			printf("Skipped %" PRIu64 " of %" PRIu64 " bytes which were already up to date.\n",
+			       planStats.skippedBytes, planStats.writeBytes);
+	}
+
+	if(flags.bench)
+	{
+		const int benchRes = runBench(dev.getBlockDev(), totSec, params, args.benchJson);
+		if(benchRes != 0) return benchRes;
 	}
 
 	// Explicitly close dev to get the result.
-	if(dev.close() != 0) return ERR_CLOSE_DEV;
+	const BlockDev::AsyncBackend backend = dev.getAsyncBackend();
+	const u32 queueDepth = dev.getQueueDepth();
+	startNs = util::getNs();
+	progress.start("close", dev.getBlockDev(), 0);
+	res = dev.close();
+	progress.stop();
+	if(res != 0) return ERR_CLOSE_DEV;
+	times.close = util::getNs() - startNs;
 
-	puts("Successfully formatted the card.");
+	puts(unchanged ? "The card is already formatted with this layout. Nothing was written."
+	               : "Successfully formatted the card.");
 	printFormatParams(params);
+	if(flags.stats) printStats(path, backend, queueDepth, dev.getBlockDev().getIoStats(), times, planStats, flags.statsJson);
 
 	return 0;
 }
+
+// Builds the patches which give one device of a broadcast its own disk signature and volume ID.
+static int makeIdPatches(const FormatParams &params, BufferedFsWriter &master, const u32 diskSig, const u32 volId,
+                         std::vector<PlanPatch> &patches)
+{
+	PlanPatch mbrPatch{offsetof(Mbr, diskSig), std::vector<u8>(4)};
+	memcpy(mbrPatch.data.data(), &diskSig, 4);
+	patches.push_back(std::move(mbrPatch));
+
+	const u16 bytesPerSec = params.bytesPerSec;
+	const u8 fatBits = params.fatBits;
+	const u64 partOffset = (u64)(fatBits < 64 ? params.partStart : params.partitionOffset) * bytesPerSec;
+	if(fatBits <= 32)
+	{
+		// FAT32 has a backup boot sector at sector 6.
+		const size_t volIdOffset = (fatBits < 32 ? offsetof(BootSec, ebpb.volId) : offsetof(BootSec, ebpb32.volId));
+		for(u32 sec = 0; sec <= (fatBits < 32 ? 0u : 6u); sec += 6)
+		{
+			PlanPatch patch{partOffset + sec * bytesPerSec + volIdOffset, std::vector<u8>(4)};
+			memcpy(patch.data.data(), &volId, 4);
+			patches.push_back(std::move(patch));
+		}
+	}
+	else
+	{
+		// The boot checksum covers the serial number so the main and backup boot regions are replaced completely.
+		for(u32 sec = 0; sec <= 12; sec += 12)
+		{
+			PlanPatch patch{partOffset + sec * bytesPerSec, std::vector<u8>(bytesPerSec * 12)};
+			const int res = master.readPlan(patch.data.data(), patch.offset, patch.data.size());
+			if(res != 0) return res;
+
+			setExfatVolId(patch.data.data(), bytesPerSec, volId);
+			patches.push_back(std::move(patch));
+		}
+	}
+
+	return 0;
+}
+
+// Formats devices of the same size with a single write plan generated on the first one.
+// Only the disk signature and volume ID differ per device. Results are in the order of devs.
+// The devices are closed afterwards.
+static void formatBroadcast(const std::vector<BufferedFsWriter*> &devs, const std::vector<size_t> &idxs, const std::string &label,
+                            const ArgFlags flags, const FormatArgs &args, std::vector<u32> &results)
+{
+	const size_t count = devs.size();
+	BufferedFsWriter &master = *devs[0];
+	printDevInfo(master, flags, args);
+	results.assign(count, 0);
+
+	const u64 totSec = getFormatSectors(master.getSectors(), args);
+	u32 res = 0;
+	if(totSec == 0)
+	{
+		fputs("SD card capacity too small.\n", stderr);
+		res = ERR_DEV_TOO_SMALL;
+	}
+	else printf("%zu SD cards contain %" PRIu64 " sectors each.\n", count, totSec);
+
+	FormatParams params{};
+	char16_t convertedLabel[12]{};
+	std::vector<FsFile> files;
+	if(res == 0) res = prepareFormat(totSec, getPrefEraseSectors(master), label, flags, args, params, convertedLabel, files);
+	if(res != 0)
+	{
+		results.assign(count, res);
+		for(BufferedFsWriter *dev : devs) dev->close();
+		return;
+	}
+
+	// All devices are erased at the same time since overwriting takes as long as writing
+	// the whole card. Each thread captures its output which is printed in device order.
+	if(flags.erase || flags.secErase || flags.overwrite != OVERWRITE_NONE)
+	{
+		std::vector<std::string> outs(count), errs(count);
+		std::vector<std::thread> threads;
+		for(size_t i = 0; i < count; i++)
+		{
+			try
+			{
+				threads.emplace_back([&, i]
+				{
+					startOutputCapture(outs[i], errs[i]);
+					results[i] = eraseDev(*devs[i], flags);
+					stopOutputCapture();
+				});
+			}
+			catch(const std::exception&)
+			{
+				// This thread already captures its output.
+				results[i] = eraseDev(*devs[i], flags);
+			}
+		}
+		for(std::thread &thread : threads) thread.join();
+		for(size_t i = 0; i < count; i++)
+		{
+			fputs(outs[i].c_str(), stdout);
+			fputs(errs[i].c_str(), stderr);
+		}
+	}
+
+	// Devices which failed erasing are left out.
+	std::vector<BufferedFsWriter*> targets;
+	std::vector<size_t> targetIdxs;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(results[i] != 0) continue;
+		targets.push_back(devs[i]);
+		targetIdxs.push_back(i);
+	}
+
+	// The first device which is left records the plan and owns the shared buffers.
+	if(!targets.empty())
+	{
+		BufferedFsWriter &writer = *targets[0];
+		params.volId = makeVolId();
+		while(params.diskSig == 0 && getrandom(&params.diskSig, 4, 0) != 4);
+
+		if(writer.acquireBuffers() != 0) res = ERR_FORMAT;
+		else                             res = planFormat(params, writer, convertedLabel, files);
+
+		// Volume IDs are made unique by the position on the command line.
+		std::vector<std::vector<PlanPatch>> patches(targets.size());
+		for(size_t t = 1; t < targets.size() && res == 0; t++)
+		{
+			u32 diskSig = 0;
+			while(diskSig == 0 && getrandom(&diskSig, 4, 0) != 4);
+			const u32 volId = params.volId + (u32)(idxs[targetIdxs[t]] - idxs[targetIdxs[0]]);
+			verbosePrintf("Card %zu: Disk ID 0x%08" PRIX32 ", volume ID 0x%08" PRIX32 "\n", t + 1, diskSig, volId);
+			if(makeIdPatches(params, writer, diskSig, volId, patches[t]) != 0) res = ERR_FORMAT;
+		}
+
+		std::vector<int> writeResults;
+		if(res == 0)
+		{
+			PlanStats planStats;
+			writer.getPlanStats(planStats);
+			printPlanStats(planStats);
+			writer.executePlanBroadcast(targets, patches, writeResults, &planStats);
+		}
+		for(size_t t = 0; t < targets.size(); t++)
+			results[targetIdxs[t]] = (res != 0 ? res : (writeResults[t] != 0 ? ERR_FORMAT : 0));
+	}
+
+	// Explicitly close all devices to get the results.
+	size_t succeeded = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(devs[i]->close() != 0 && results[i] == 0) results[i] = ERR_CLOSE_DEV;
+		succeeded += results[i] == 0;
+	}
+
+	if(succeeded > 0)
+	{
+		printf("Successfully formatted %zu of %zu cards.\n", succeeded, count);
+		printFormatParams(params);
+	}
+}
+
+u32 formatSd(const char *const path, const std::string &label, const ArgFlags flags, const FormatArgs &args)
+{
+	BufferedFsWriter dev;
+	const u64 startNs = util::getNs();
+	if(args.imageSize > 0)
+	{
+		// Never create files with elevated privileges.
+		dropPrivileges();
+		if(dev.openImage(path, args.imageSize, args.queueDepth, flags.writerThread) != 0) return ERR_DEV_OPEN;
+	}
+	else
+	{
+		if(dev.open(path, args.queueDepth, flags.writerThread, flags.direct) != 0) return ERR_DEV_OPEN;
+		dropPrivileges();
+	}
+
+	Progress progress(path, args.progressFd, args.progressBar);
+	return formatDev(dev, path, util::getNs() - startNs, progress, label, flags, args);
+}
+
+u32 formatBatch(const std::vector<const char*> &paths, const std::string &label, const ArgFlags flags, const FormatArgs &args)
+{
+	if(initOutputCapture() != 0)
+	{
+		fputs("Error: Can't set up output capturing.\n", stderr);
+		return ERR_BATCH;
+	}
+
+	// All devices are opened before dropping privileges. The pool must outlive them.
+	const size_t count = paths.size();
+	BufferPool pool(g_batchPoolBudget);
+	std::vector<std::unique_ptr<BufferedFsWriter>> devs(count);
+	std::vector<std::string> devOuts(count), devErrs(count);
+	std::vector<u32> results(count, 0);
+	std::vector<u64> openNs(count);
+	for(size_t i = 0; i < count; i++)
+	{
+		startOutputCapture(devOuts[i], devErrs[i]);
+		const u64 startNs = util::getNs();
+		devs[i] = std::make_unique<BufferedFsWriter>();
+		if(devs[i]->open(paths[i], args.queueDepth, flags.writerThread, flags.direct, &pool) != 0)
+		{
+			devs[i].reset();
+			results[i] = ERR_DEV_OPEN;
+		}
+		openNs[i] = util::getNs() - startNs;
+		stopOutputCapture();
+	}
+	dropPrivileges();
+
+	// Each job is one device or with --broadcast all devices with the same layout.
+	std::vector<std::vector<size_t>> jobs;
+	for(size_t i = 0; i < count; i++)
+	{
+		auto sameLayout = [&](const std::vector<size_t> &job)
+		{
+			const BufferedFsWriter *const a = devs[job[0]].get();
+			const BufferedFsWriter *const b = devs[i].get();
+			return a != nullptr && b != nullptr &&
+			       getFormatSectors(a->getSectors(), args) == getFormatSectors(b->getSectors(), args) &&
+			       getPrefEraseSectors(*a) == getPrefEraseSectors(*b) &&
+			       a->getIoAlignment() == b->getIoAlignment() && a->getBufferSize() == b->getBufferSize() &&
+			       a->getQueueDepth() == b->getQueueDepth();
+		};
+
+		const auto it = (flags.broadcast ? std::find_if(jobs.begin(), jobs.end(), sameLayout) : jobs.end());
+		if(it != jobs.end()) it->push_back(i);
+		else                 jobs.push_back({i});
+	}
+
+	// Each worker takes the next job and prints its output as one block when done.
+	std::atomic<size_t> next = 0;
+	const auto worker = [&]
+	{
+		for(size_t j = next++; j < jobs.size(); j = next++)
+		{
+			const std::vector<size_t> &job = jobs[j];
+			std::string out("=== "), err;
+			for(const size_t i : job)
+			{
+				out += paths[i];
+				out += (i != job.back() ? ", " : " ===\n");
+			}
+			for(const size_t i : job)
+			{
+				out += devOuts[i];
+				err += devErrs[i];
+			}
+
+			startOutputCapture(out, err);
+			if(devs[job[0]])
+			{
+				try
+				{
+					if(job.size() == 1)
+					{
+						Progress progress(paths[job[0]], args.progressFd, false);
+						results[job[0]] = formatDev(*devs[job[0]], paths[job[0]], openNs[job[0]], progress, label, flags, args);
+					}
+					else
+					{
+						std::vector<BufferedFsWriter*> group;
+						for(const size_t i : job) group.push_back(devs[i].get());
+						std::vector<u32> groupResults;
+						formatBroadcast(group, job, label, flags, args, groupResults);
+						for(size_t k = 0; k < job.size(); k++) results[job[k]] = groupResults[k];
+					}
+					for(const size_t i : job) devs[i].reset();
+				}
+				catch(const std::exception &e)
+				{
+					fprintf(stderr, "An exception occurred: what(): '%s'\n", e.what());
+					for(const size_t i : job) results[i] = ERR_EXCEPTION;
+				}
+				catch(...)
+				{
+					fputs("Unknown exception.\n", stderr);
+					for(const size_t i : job) results[i] = ERR_UNK_EXCEPTION;
+				}
+
+				// Don't let the destructor throw again.
+				for(const size_t i : job)
+				{
+					if(!devs[i]) continue;
+					devs[i]->close();
+					devs[i].reset();
+				}
+			}
+			stopOutputCapture();
+
+			printCapturedOutput(out, err);
+		}
+	};
+
+	const size_t threadCount = std::min<size_t>(args.jobs, jobs.size());
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount);
+	for(size_t i = 0; i < threadCount; i++) threads.emplace_back(worker);
+	for(std::thread &thread : threads) thread.join();
+
+	u32 failed = 0;
+	std::string summary("Results:\n");
+	for(size_t i = 0; i < count; i++)
+	{
+		summary += std::string("  ") + paths[i] + ": ";
+		summary += (results[i] == 0 ? std::string("OK") : "Failed (error " + std::to_string(results[i]) + ')') + '\n';
+		failed += results[i] != 0;
+	}
+	printCapturedOutput(summary, (failed > 0 ? std::to_string(failed) + " of " + std::to_string(count) + " devices failed.\n" : ""));
+
+	return (failed > 0 ? ERR_BATCH : 0);
+}
+
+u32 benchSd(const char *const path, const ArgFlags flags, const FormatArgs &args)
+{
+	BlockDev dev;
+	if(dev.open(path, true, true) != 0) return ERR_DEV_OPEN;
+	dropPrivileges();
+
+	u64 totSec = dev.getSectors();
+	if(totSec < MIN_CAPACITY)
+	{
+		fputs("SD card capacity too small.\n", stderr);
+		return ERR_DEV_TOO_SMALL;
+	}
+
+	const u64 overrTotSec = args.overrTotSec;
+	if(overrTotSec >= MIN_CAPACITY && overrTotSec < totSec)
+		totSec = overrTotSec;
+
+	// Only needed for the alignment the card would be formatted with.
+	FormatParams params{};
+	if(!getFormatParams(totSec, flags, 0, params))
+	{
+		fputs("The SD card can not be formatted with the given parameters.\n", stderr);
+		return ERR_FORMAT_PARAMS;
+	}
+
+	const int benchRes = runBench(dev, totSec, params, args.benchJson);
+	dev.close();
+
+	return benchRes;
+}
@@ -1,14 +1,23 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2023 profi200
 
+#include <cctype>
+#include <climits>
 #include <clocale>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <fcntl.h>
 #include <getopt.h>
+#include <glob.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
 #include "errors.h"
+#include "daemon.h"
 #include "format.h"
+#include "overwrite.h"
 #include "verbose_printf.h"
 
 
@@ -16,69 +25,379 @@
 static void printHelp(void)
 {
 	puts("sdFormatLinux 0.2.0 by profi200\n"
-	     "Usage: sdFormatLinux [OPTIONS...] DEVICE\n\n"
+	     "Usage: sdFormatLinux [OPTIONS...] DEVICE...\n"
+	     "       sdFormatLinux [OPTIONS...] -i FILE -s SIZE\n"
+	     "       sdFormatLinux [OPTIONS...] --daemon\n\n"
 	     "Options:\n"
 	     "  -l, --label LABEL        Volume label. Maximum 11 uppercase characters.\n"
 	     "                           11 arbitrary unicode code points for exFAT.\n"
-	     "  -e, --erase TYPE         Erases the whole card before formatting (TRIM).\n"
-	     "                           No effect with USB card readers.\n"
-	     "                           TYPE should be 'trim'.\n"
+	     "  -e, --erase TYPE         Erases the whole card before formatting.\n"
+	     "                           TYPE is 'trim', 'zero', 'pattern' or 'random'.\n"
+	     "                           'trim' has no effect with USB card readers.\n"
+	     "                           The others overwrite every sector and also work\n"
+	     "                           there but take as long as writing the whole card.\n"
 	     "  -f, --force-fat32        Force FAT32 for SDXC cards.\n"
 	     "  -c, --capacity SECTORS   Override capacity for fake cards.\n"
+	     "      --verify-capacity[=full]\n"
+	     "                           Detect the real capacity of fake cards by writing\n"
+	     "                           and reading back samples. 'full' checks every sector.\n"
+	     "                           Destroys all data on the card!\n"
+	     "      --probe-au[=apply]   Detect the erase block (AU) size by timing writes.\n"
+	     "                           'apply' aligns the filesystem to it if it is bigger\n"
+	     "                           than the default alignment.\n"
 	     "  -b, --big-clusters       NOT RECOMMENDED. In combination with -f on SDXC cards\n"
 	     "                           this will set the logical sector size higher than 512\n"
 	     "                           to bypass the FAT32 64 KiB cluster size limit.\n"
 	     "                           Many FAT drivers including the one in Windows\n"
 	     "                           will not mount the filesystem or corrupt it!\n"
+	     "  -q, --queue-depth DEPTH  Number of writes kept in flight using io_uring.\n"
+	     "                           1-16. Default 4. 1 disables io_uring.\n"
+	     "  -t, --writer-thread      Flush buffers from a background thread\n"
+	     "                           instead of io_uring.\n"
+	     "  -d, --direct             Bypass the page cache (O_DIRECT).\n"
+	     "  -j, --jobs JOBS          Number of devices formatted at the same time\n"
+	     "                           when multiple are given. 1-64. Default 4.\n"
+	     "      --broadcast          Generate the layout once for all devices of the\n"
+	     "                           same size and write it to them at the same time.\n"
+	     "                           Only the disk and volume IDs differ per device.\n"
+	     "  -i, --image FILE         Format a (sparse) image file instead of a device.\n"
+	     "                           The file is created or resized to SIZE.\n"
+	     "  -s, --size SIZE          Image size in bytes. Suffixes K, M, G and T\n"
+	     "                           (powers of 1024) are supported.\n"
+	     "      --preallocate NAME:SIZE[:COUNT]\n"
+	     "                           Create COUNT (default 1) contiguous files of SIZE\n"
+	     "                           bytes in the root directory starting on alignment\n"
+	     "                           unit boundaries. The last number before the\n"
+	     "                           extension is counted up for each file.\n"
+	     "                           Can be given multiple times.\n"
+	     "                           File contents are not cleared.\n"
+	     "      --populate DIR       Copy the contents of DIR into the root directory.\n"
+	     "                           Files are stored contiguously after the root\n"
+	     "                           directory and before preallocated files.\n"
+	     "      --differential       Read the card first and only write blocks which\n"
+	     "                           change. Saves time and wear if TRIM isn't\n"
+	     "                           available (USB card readers).\n"
+	     "      --if-needed          Only format if the card differs from the layout\n"
+	     "                           that would be written. Compares the partition\n"
+	     "                           table, boot region, FAT/bitmap heads and root\n"
+	     "                           directory. Existing IDs are ignored.\n"
+	     "      --verify             Read back everything written after formatting\n"
+	     "                           bypassing the page cache. Zero regions and file\n"
+	     "                           contents are checked by sampling.\n"
+	     "      --progress-fd FD     Write progress of long phases as one JSON object\n"
+	     "                           per line to file descriptor FD. A progress bar is\n"
+	     "                           shown on terminals for a single device.\n"
+	     "                           SIGUSR1 prints the current status.\n"
+	     "      --stats[=json]       Print the time of each phase, I/O counters and\n"
+	     "                           a write latency histogram after formatting.\n"
+	     "                           With 'json' as one JSON object per card.\n"
+	     "      --bench              Benchmark the card after formatting.\n"
+	     "      --bench-only         Only benchmark the card. Overwrites a scratch\n"
+	     "                           region in the middle of the card!\n"
+	     "      --bench-json FILE    Also write benchmark results as JSON ('-' for stdout).\n"
+	     "      --daemon             Keep running and format every hotpluggable card\n"
+	     "                           (USB, MMC or removable) matching the rules as\n"
+	     "                           soon as it appears. Needs at least one rule.\n"
+	     "                           All other options are used for each card.\n"
+	     "                           -j limits how many are formatted at once.\n"
+	     "      --match-any          Daemon rule. Format every hotpluggable disk\n"
+	     "                           including USB drives and phones!\n"
+	     "      --match-size MIN-MAX Daemon rule. Only format cards of MIN to MAX bytes.\n"
+	     "                           Either can be left out. Same suffixes as --size.\n"
+	     "      --match-serial SERIAL\n"
+	     "                           Daemon rule. Only format cards in the reader with\n"
+	     "                           this serial number. Can be given multiple times.\n"
 	     "  -v, --verbose            Show format details.\n"
-	     "  -h, --help               Output this help.\n");
+	     "  -h, --help               Output this help.\n\n"
+	     "Multiple devices or quoted glob patterns like '/dev/sd[b-q]' are formatted\n"
+	     "concurrently with the same options. The output of each device is printed\n"
+	     "as one block when it is done.\n");
 }
 
+// Parses a size in bytes with optional K, M, G or T suffix. Returns 0 on error.
+static u64 parseSize(const char *const str)
+{
+	char *end;
+	u64 size = strtoull(str, &end, 0);
+	unsigned shift = 0;
+	switch(*end)
+	{
+		case 'T': shift += 10; [[fallthrough]];
+		case 'G': shift += 10; [[fallthrough]];
+		case 'M': shift += 10; [[fallthrough]];
+		case 'K': shift += 10; end++; [[fallthrough]];
+		case '\0': break;
+		default: return 0;
+	}
+	if(*end != '\0' || size > ~0ull>>shift) return 0;
+
+	return size<<shift;
+}
+
+// Parses NAME:SIZE[:COUNT] and appends COUNT files. Returns false on error.
+static bool parsePrealloc(const char *const arg, std::vector<PreallocFile> &prealloc)
+{
+	const char *const sizeStr = strchr(arg, ':');
+	if(sizeStr == NULL || sizeStr == arg) return false;
+
+	std::string size(sizeStr + 1);
+	u32 count = 1;
+	const size_t countPos = size.find(':');
+	if(countPos != std::string::npos)
+	{
+		char *end;
+		const unsigned long tmpCount = strtoul(&size[countPos + 1], &end, 10);
+		if(*end != '\0' || tmpCount == 0 || tmpCount > 65536) return false;
+		count = tmpCount;
+		size.resize(countPos);
+	}
+
+	PreallocFile file;
+	file.name = std::string(arg, sizeStr - arg);
+	file.size = parseSize(size.c_str());
+	if(file.size == 0) return false;
+
+	// Find the last number before the extension to count up.
+	const size_t numEnd = file.name.find_last_of("0123456789", file.name.rfind('.')) + 1;
+	if(count > 1 && numEnd == 0)
+	{
+		fputs("Error: NAME must contain a number before the extension when COUNT is given.\n", stderr);
+		return false;
+	}
+	size_t numStart = numEnd;
+	while(numStart > 0 && isdigit((unsigned char)file.name[numStart - 1])) numStart--;
+	const int width = numEnd - numStart;
+	const u64 first = (count > 1 ? strtoull(&file.name[numStart], NULL, 10) : 0);
+
+	for(u32 i = 0; i < count; i++)
+	{
+		if(count > 1)
+		{
+			const std::string num = std::to_string(first + i);
+			if(num.length() > (size_t)width)
+			{
+				fputs("Error: COUNT is too big for the number in NAME.\n", stderr);
+				return false;
+			}
+			file.name.replace(numStart, width, std::string(width - num.length(), '0') + num);
+		}
+		prealloc.push_back(file);
+	}
+
+	return true;
+}
+
+// Values for options without a short form.
+enum
+{
+	OPT_BENCH = 256,
+	OPT_BENCH_ONLY,
+	OPT_BENCH_JSON,
+	OPT_VERIFY_CAPACITY,
+	OPT_PROBE_AU,
+	OPT_PREALLOCATE,
+	OPT_POPULATE,
+	OPT_IF_NEEDED,
+	OPT_DIFFERENTIAL,
+	OPT_BROADCAST,
+	OPT_DAEMON,
+	OPT_MATCH_ANY,
+	OPT_MATCH_SIZE,
+	OPT_MATCH_SERIAL,
+	OPT_STATS,
+	OPT_PROGRESS_FD,
+	OPT_VERIFY
+};
+
 int main(const int argc, char *const argv[])
 {
 	setlocale(LC_CTYPE, ""); // We could also default to "en_US.UTF-8".
 
 	static const struct option long_options[] =
-	{{"big-clusters",       no_argument, NULL, 'b'},
-	 {    "capacity", required_argument, NULL, 'c'},
-	 {       "erase", required_argument, NULL, 'e'},
-	 { "force-fat32",       no_argument, NULL, 'f'},
-	 {       "label", required_argument, NULL, 'l'},
-	 {     "verbose",       no_argument, NULL, 'v'},
-	 {        "help",       no_argument, NULL, 'h'},
-	 {          NULL,                 0, NULL,   0}};
-
-	u64 overrTotSec = 0;
+	{{          "bench",       no_argument, NULL, OPT_BENCH},
+	 {     "bench-only",       no_argument, NULL, OPT_BENCH_ONLY},
+	 {     "bench-json", required_argument, NULL, OPT_BENCH_JSON},
+	 {   "big-clusters",       no_argument, NULL, 'b'},
+	 {      "broadcast",       no_argument, NULL, OPT_BROADCAST},
+	 {       "capacity", required_argument, NULL, 'c'},
+	 {   "differential",       no_argument, NULL, OPT_DIFFERENTIAL},
+	 {         "daemon",       no_argument, NULL, OPT_DAEMON},
+	 {         "direct",       no_argument, NULL, 'd'},
+	 {          "erase", required_argument, NULL, 'e'},
+	 {    "force-fat32",       no_argument, NULL, 'f'},
+	 {      "if-needed",       no_argument, NULL, OPT_IF_NEEDED},
+	 {          "image", required_argument, NULL, 'i'},
+	 {           "jobs", required_argument, NULL, 'j'},
+	 {          "label", required_argument, NULL, 'l'},
+	 {      "match-any",       no_argument, NULL, OPT_MATCH_ANY},
+	 {   "match-serial", required_argument, NULL, OPT_MATCH_SERIAL},
+	 {     "match-size", required_argument, NULL, OPT_MATCH_SIZE},
+	 {       "populate", required_argument, NULL, OPT_POPULATE},
+	 {    "preallocate", required_argument, NULL, OPT_PREALLOCATE},
+	 {    "progress-fd", required_argument, NULL, OPT_PROGRESS_FD},
+	 {       "probe-au", optional_argument, NULL, OPT_PROBE_AU},
+	 {    "queue-depth", required_argument, NULL, 'q'},
+	 {           "size", required_argument, NULL, 's'},
+	 {          "stats", optional_argument, NULL, OPT_STATS},
+	 {  "writer-thread",       no_argument, NULL, 't'},
+	 {        "verbose",       no_argument, NULL, 'v'},
+	 {         "verify",       no_argument, NULL, OPT_VERIFY},
+	 {"verify-capacity", optional_argument, NULL, OPT_VERIFY_CAPACITY},
+	 {           "help",       no_argument, NULL, 'h'},
+	 {             NULL,                 0, NULL,   0}};
+
+	FormatArgs args{};
+	args.queueDepth = 4;
+	args.jobs       = 4;
+	args.progressFd = -1;
+	const char *imagePath = NULL;
 	ArgFlags flags{};
+	bool daemon = false;
+	DaemonRules rules{};
 	char label[4 * 11 + 1]{}; // Worst case 4 bytes per char.
 	while(1)
 	{
-		const int c = getopt_long(argc, argv, "bc:e:fl:vh", long_options, NULL);
+		const int c = getopt_long(argc, argv, "bc:de:fi:j:l:q:s:tvh", long_options, NULL);
 		if(c == -1) break;
 
 		switch(c)
 		{
+			case OPT_BENCH:
+				flags.bench = 1;
+				break;
+			case OPT_BENCH_ONLY:
+				flags.benchOnly = 1;
+				break;
+			case OPT_BENCH_JSON:
+				args.benchJson = optarg;
+				break;
+			case OPT_VERIFY_CAPACITY:
+				flags.verifyCap = 1;
+				if(optarg != NULL)
+				{
+					if(strcmp(optarg, "full") != 0)
+					{
+						fprintf(stderr, "Error: Invalid capacity verification mode '%s'.\n", optarg);
+						return ERR_INVALID_ARG;
+					}
+					flags.verifyFull = 1;
+				}
+				break;
+			case OPT_PREALLOCATE:
+				if(!parsePrealloc(optarg, args.prealloc))
+				{
+					fprintf(stderr, "Error: Invalid file to preallocate '%s'.\n", optarg);
+					return ERR_INVALID_ARG;
+				}
+				break;
+			case OPT_DIFFERENTIAL:
+				flags.differential = 1;
+				break;
+			case OPT_BROADCAST:
+				flags.broadcast = 1;
+				break;
+			case OPT_VERIFY:
+				flags.verify = 1;
+				break;
+			case OPT_STATS:
+				flags.stats = 1;
+				if(optarg != NULL)
+				{
+					if(strcmp(optarg, "json") != 0)
+					{
+						fprintf(stderr, "Error: Invalid stats format '%s'.\n", optarg);
+						return ERR_INVALID_ARG;
+					}
+					flags.statsJson = 1;
+				}
+				break;
+			case OPT_PROGRESS_FD:
+				{
+					char *end;
+					const long fd = strtol(optarg, &end, 10);
+					if(*end != '\0' || fd < 0 || fd > INT_MAX || fcntl(fd, F_GETFD) == -1)
+					{
+						fprintf(stderr, "Error: Invalid progress file descriptor '%s'.\n", optarg);
+						return ERR_INVALID_ARG;
+					}
+					args.progressFd = fd;
+				}
+				break;
+			case OPT_DAEMON:
+				daemon = true;
+				break;
+			case OPT_MATCH_ANY:
+				rules.any = true;
+				break;
+			case OPT_MATCH_SIZE:
+				{
+					// MIN-MAX, MIN- or -MAX.
+					const char *const dash = strchr(optarg, '-');
+					const std::string minStr = (dash != NULL ? std::string(optarg, dash - optarg) : std::string());
+					rules.minSize = (minStr.empty() ? 0 : parseSize(minStr.c_str()));
+					rules.maxSize = (dash == NULL || dash[1] == '\0' ? 0 : parseSize(dash + 1));
+					if(dash == NULL || (!minStr.empty() && rules.minSize == 0) || (dash[1] != '\0' && rules.maxSize == 0) ||
+					   (rules.maxSize != 0 && rules.minSize > rules.maxSize))
+					{
+						fprintf(stderr, "Error: Invalid size range '%s'.\n", optarg);
+						return ERR_INVALID_ARG;
+					}
+				}
+				break;
+			case OPT_MATCH_SERIAL:
+				rules.serials.push_back(optarg);
+				break;
+			case OPT_IF_NEEDED:
+				flags.ifNeeded = 1;
+				break;
+			case OPT_POPULATE:
+				args.populateDir = optarg;
+				break;
+			case OPT_PROBE_AU:
+				flags.probeAu = 1;
+				if(optarg != NULL)
+				{
+					if(strcmp(optarg, "apply") != 0)
+					{
+						fprintf(stderr, "Error: Invalid erase block probe mode '%s'.\n", optarg);
+						return ERR_INVALID_ARG;
+					}
+					flags.probeAuApply = 1;
+				}
+				break;
 			case 'b':
 				flags.bigClusters = 1;
 				break;
 			case 'c':
 				{
 					// Temporary limit of 2 TiB.
-					overrTotSec = strtoull(optarg, NULL, 0);
+					const u64 overrTotSec = strtoull(optarg, NULL, 0);
 					if(overrTotSec == 0 || overrTotSec > 1ull<<32)
 					{
 						fputs("Error: Capacity 0 or out of range.\n", stderr);
 						return ERR_INVALID_ARG;
 					}
+					args.overrTotSec = overrTotSec;
 				}
 				break;
+			case 'd':
+				flags.direct = 1;
+				break;
 			case 'e':
 				{
-					// TODO: Support full overwrite?
+					flags.erase     = 0;
+					flags.secErase  = 0;
+					flags.overwrite = OVERWRITE_NONE;
 					if(strcmp(optarg, "trim") == 0)
 						flags.erase = 1;
 					else if(strcmp(optarg, "secure") == 0)
 						flags.secErase = 1;
+					else if(strcmp(optarg, "zero") == 0)
+						flags.overwrite = OVERWRITE_ZERO;
+					else if(strcmp(optarg, "pattern") == 0)
+						flags.overwrite = OVERWRITE_PATTERN;
+					else if(strcmp(optarg, "random") == 0)
+						flags.overwrite = OVERWRITE_RANDOM;
 					else
 					{
 						fprintf(stderr, "Error: Invalid erase type '%s'.\n", optarg);
@@ -89,11 +408,51 @@ int main(const int argc, char *const argv[])
 			case 'f':
 				flags.forceFat32 = 1;
 				break;
+			case 'i':
+				imagePath = optarg;
+				break;
+			case 'j':
+				{
+					const u32 jobs = strtoul(optarg, NULL, 0);
+					if(jobs == 0 || jobs > 64)
+					{
+						fputs("Error: Number of jobs 0 or out of range.\n", stderr);
+						return ERR_INVALID_ARG;
+					}
+					args.jobs = jobs;
+				}
+				break;
 			case 'l':
 				{
 					strncpy(label, optarg, 4 * 11);
 				}
 				break;
+			case 'q':
+				{
+					const u32 queueDepth = strtoul(optarg, NULL, 0);
+					if(queueDepth == 0 || queueDepth > 16)
+					{
+						fputs("Error: Queue depth 0 or out of range.\n", stderr);
+						return ERR_INVALID_ARG;
+					}
+					args.queueDepth = queueDepth;
+				}
+				break;
+			case 's':
+				{
+					// Same limits as for the capacity override.
+					const u64 imageSize = parseSize(optarg);
+					if(imageSize < MIN_CAPACITY * 512 || imageSize > 512ull<<32 || imageSize % 512 != 0)
+					{
+						fputs("Error: Image size out of range or not a multiple of 512.\n", stderr);
+						return ERR_INVALID_ARG;
+					}
+					args.imageSize = imageSize;
+				}
+				break;
+			case 't':
+				flags.writerThread = 1;
+				break;
 			case 'v':
 				flags.verbose = 1;
 				break;
@@ -109,18 +468,97 @@ int main(const int argc, char *const argv[])
 		}
 	}
 
-	if(argc - optind < 1 || argc - optind > 1)
+	if(daemon)
+	{
+		if(argc != optind || imagePath != NULL || args.imageSize > 0 || flags.benchOnly || args.benchJson != NULL || flags.broadcast)
+		{
+			fputs("Error: --daemon can't be combined with devices, --image, --size, --bench-only, --bench-json or --broadcast.\n", stderr);
+			return ERR_INVALID_ARG;
+		}
+
+		// Without rules any USB drive plugged in would be wiped.
+		const bool hasRule = rules.minSize != 0 || rules.maxSize != 0 || !rules.serials.empty();
+		if(hasRule == rules.any)
+		{
+			fputs("Error: --daemon needs either --match-size/--match-serial or --match-any.\n", stderr);
+			return ERR_INVALID_ARG;
+		}
+	}
+	else if(rules.minSize != 0 || rules.maxSize != 0 || !rules.serials.empty() || rules.any)
+	{
+		fputs("Error: --match-size, --match-serial and --match-any need --daemon.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+
+	// Either devices or an image with size.
+	if(!daemon && ((imagePath != NULL ? argc != optind : argc == optind) || (imagePath != NULL) != (args.imageSize > 0)))
 	{
 		printHelp();
 		return ERR_INVALID_ARG;
 	}
 
-	const char *const devPath = argv[optind];
+	std::vector<const char*> devPaths;
+	glob_t globBuf{};
+	for(int i = optind; i < argc; i++)
+	{
+		if(strpbrk(argv[i], "*?[") == NULL)
+		{
+			devPaths.push_back(argv[i]);
+			continue;
+		}
+
+		const size_t first = globBuf.gl_pathc;
+		if(glob(argv[i], (first > 0 ? GLOB_APPEND : 0), NULL, &globBuf) != 0 || globBuf.gl_pathc == first)
+		{
+			fprintf(stderr, "Error: No devices match '%s'.\n", argv[i]);
+			return ERR_INVALID_ARG;
+		}
+		for(size_t j = first; j < globBuf.gl_pathc; j++) devPaths.push_back(globBuf.gl_pathv[j]);
+	}
+	if(devPaths.size() > 1 && (flags.benchOnly || args.benchJson != NULL))
+	{
+		fputs("Error: --bench-only and --bench-json only support one device.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+	if((flags.benchOnly || flags.verifyCap || flags.probeAu || flags.direct) && imagePath != NULL)
+	{
+		fputs("Error: --bench-only, --verify-capacity, --probe-au and --direct need a device.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+
+	if(flags.bench && (args.populateDir != NULL || !args.prealloc.empty()))
+	{
+		fputs("Error: --bench can't be combined with --populate or --preallocate.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+
+	if(flags.ifNeeded && (flags.erase || flags.secErase || flags.overwrite != OVERWRITE_NONE || flags.verifyCap || flags.bench || args.populateDir != NULL || !args.prealloc.empty()))
+	{
+		fputs("Error: --if-needed can't be combined with --erase, --verify-capacity, --bench, --populate or --preallocate.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+
+	if(flags.broadcast && (flags.ifNeeded || flags.differential || flags.verifyCap || flags.probeAu || flags.bench || flags.stats || flags.verify))
+	{
+		fputs("Error: --broadcast can't be combined with --if-needed, --differential, --verify-capacity, --probe-au, --bench, --stats or --verify.\n", stderr);
+		return ERR_INVALID_ARG;
+	}
+
+	args.progressBar = !daemon && devPaths.size() <= 1 && isatty(STDERR_FILENO);
+
+	const char *const devPath = (imagePath != NULL ? imagePath : (!devPaths.empty() ? devPaths[0] : NULL));
 	int res;
 	try
 	{
 		setVerboseMode(flags.verbose);
-		res = formatSd(devPath, label, flags, overrTotSec);
+		if(daemon)
+			res = runDaemon(rules, label, flags, args);
+		else if(flags.benchOnly)
+			res = benchSd(devPath, flags, args);
+		else if(devPaths.size() > 1)
+			res = formatBatch(devPaths, label, flags, args);
+		else
+			res = formatSd(devPath, label, flags, args);
 	}
 	catch(const std::exception &e)
 	{
@@ -132,6 +570,7 @@ int main(const int argc, char *const argv[])
 		fprintf(stderr, "Unknown exception. Aborting...\n");
 		res = ERR_UNK_EXCEPTION;
 	}
+	globfree(&globBuf);
 
 	return res;
 }
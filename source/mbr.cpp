@@ -34,10 +34,11 @@ static u32 lba2chs(u64 lba, const u32 heads, const u32 secPerTrk)
 int createMbrAndPartition(const FormatParams &params, BufferedFsWriter &dev)
 {
 	// Master Boot Record (MBR).
-	// Generate a new, random disk signature.
+	// Generate a new, random disk signature unless one is given.
 	// TODO: If getrandom() returns -1 abort. We should probably make a wrapper.
 	Mbr mbr{};
-	while(getrandom(&mbr.diskSig, 4, 0) != 4);
+	mbr.diskSig = params.diskSig;
+	while(mbr.diskSig == 0 && getrandom(&mbr.diskSig, 4, 0) != 4);
 	verbosePrintf("Disk ID: 0x%08" PRIX32 "\n", mbr.diskSig);
 
 	// Set partition to inactive.
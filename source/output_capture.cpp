@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+#include "output_capture.h"
+
+
+static FILE *g_realOut = nullptr;
+static FILE *g_realErr = nullptr;
+static std::mutex g_printMutex;
+static thread_local std::string *t_out = nullptr;
+static thread_local std::string *t_err = nullptr;
+
+
+
+// The cookie is the original stream. The replacement streams are unbuffered
+// so this always runs on the thread which printed.
+static ssize_t captureWrite(void *cookie, const char *buf, size_t size)
+{
+	FILE *const real = static_cast<FILE*>(cookie);
+	std::string *const capture = (real == g_realErr ? t_err : t_out);
+	if(capture == nullptr) return fwrite(buf, 1, size, real);
+
+	try
+	{
+		capture->append(buf, size);
+	}
+	catch(...)
+	{
+		return -1;
+	}
+
+	return size;
+}
+
+static FILE* openCaptureStream(FILE *const real)
+{
+	static const cookie_io_functions_t funcs{nullptr, captureWrite, nullptr, nullptr};
+	FILE *const f = fopencookie(real, "w", funcs);
+	if(f != nullptr) setvbuf(f, nullptr, _IONBF, 0);
+
+	return f;
+}
+
+int initOutputCapture(void)
+{
+	if(g_realOut != nullptr) return 0;
+
+	fflush(stdout);
+	FILE *const out = openCaptureStream(stdout);
+	FILE *const err = openCaptureStream(stderr);
+	if(out == nullptr || err == nullptr)
+	{
+		if(out != nullptr) fclose(out);
+		if(err != nullptr) fclose(err);
+		return ENOMEM;
+	}
+
+	g_realOut = stdout;
+	g_realErr = stderr;
+	stdout = out;
+	stderr = err;
+
+	return 0;
+}
+
+void startOutputCapture(std::string &out, std::string &err)
+{
+	t_out = &out;
+	t_err = &err;
+}
+
+void stopOutputCapture(void)
+{
+	t_out = nullptr;
+	t_err = nullptr;
+}
+
+void printCapturedOutput(const std::string &out, const std::string &err)
+{
+	FILE *const realOut = (g_realOut != nullptr ? g_realOut : stdout);
+	FILE *const realErr = (g_realErr != nullptr ? g_realErr : stderr);
+
+	std::lock_guard lock(g_printMutex);
+	fwrite(out.data(), 1, out.size(), realOut);
+	fflush(realOut);
+	fwrite(err.data(), 1, err.size(), realErr);
+	fflush(realErr);
+}
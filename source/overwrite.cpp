@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/random.h>
+#include "types.h"
+#include "overwrite.h"
+#include "util.h"
+#include "verbose_printf.h"
+
+
+static constexpr u32 g_chunkSectors  = 1024 * 1024 * 4 / 512; // Size of each write request.
+static constexpr u32 g_sampleSectors = 1024 * 64 / 512;       // Size of each sample read back.
+static constexpr u32 g_samples       = 16;
+static constexpr u32 g_lanes         = 8;                     // Independent generators in fillRandom().
+static constexpr size_t g_chunkWords = (size_t)g_chunkSectors * 512 / 8;
+
+
+
+static u64 splitMix64(u64 &x)
+{
+	u64 z = (x += 0x9E3779B97F4A7C15u);
+	z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9u;
+	z = (z ^ (z>>27)) * 0x94D049BB133111EBu;
+	return z ^ (z>>31);
+}
+
+// Every chunk has its own generators seeded from its index so samples can be checked
+// without generating everything before them. The lanes are independent xorshift128+
+// generators. The inner loop only has shifts, xors and adds so the compiler vectorizes it.
+static void fillRandom(u64 *const buf, const u64 chunk, const u64 seed)
+{
+	u64 s0[g_lanes], s1[g_lanes];
+	u64 x = seed ^ (chunk * 0xD1B54A32D192ED03u);
+	for(u32 l = 0; l < g_lanes; l++)
+	{
+		s0[l] = splitMix64(x);
+		s1[l] = splitMix64(x);
+	}
+
+	for(size_t i = 0; i < g_chunkWords; i += g_lanes)
+	{
+		for(u32 l = 0; l < g_lanes; l++)
+		{
+			u64 a = s0[l];
+			const u64 b = s1[l];
+			s0[l] = b;
+			a ^= a<<23;
+			s1[l] = a ^ b ^ (a>>17) ^ (b>>26);
+			buf[i + l] = s1[l] + b;
+		}
+	}
+}
+
+// Zeros and the pattern are the same for every chunk.
+static void fillChunk(u64 *const buf, const OverwriteMode mode, const u64 chunk, const u64 seed)
+{
+	if(mode == OVERWRITE_RANDOM) fillRandom(buf, chunk, seed);
+	else std::fill(buf, buf + g_chunkWords, (mode == OVERWRITE_PATTERN ? 0xAA55AA55AA55AA55u : 0u));
+}
+
+// Writes every chunk keeping all tags in flight. Requests with the same tag use the same buffer.
+static int writeChunks(BlockDev &dev, u64 *const bufs, const u32 bufCount, const OverwriteMode mode, const u64 seed)
+{
+	const u32 queueDepth = dev.getQueueDepth();
+	const u64 sectors = dev.getSectors();
+	int res = 0;
+	u32 tag = 0;
+	for(u64 sector = 0; sector < sectors; sector += g_chunkSectors, tag = (tag + 1 < queueDepth ? tag + 1 : 0))
+	{
+		if(BlockDev::isEraseCancelled())
+		{
+			res = ECANCELED;
+			break;
+		}
+
+		res = dev.waitAsync(tag);
+		if(res != 0) break;
+
+		u64 *const buf = bufs + (size_t)(tag % bufCount) * g_chunkWords;
+		if(mode == OVERWRITE_RANDOM) fillRandom(buf, sector / g_chunkSectors, seed);
+		res = dev.writeAsync(buf, sector, std::min<u64>(g_chunkSectors, sectors - sector), tag);
+		if(res != 0) break;
+	}
+
+	const int waitRes = dev.waitAllAsync();
+
+	return (res != 0 ? res : waitRes);
+}
+
+// Samples are aligned to their size so they never cross a chunk.
+static int checkSamples(BlockDev &dev, u64 *const buf, u64 *const expected, const OverwriteMode mode, const u64 seed)
+{
+	const u64 sectors = dev.getSectors();
+	for(u32 i = 0; i < g_samples; i++)
+	{
+		u64 sector = (sectors - g_sampleSectors) * i / (g_samples - 1);
+		sector -= sector % g_sampleSectors;
+		const int res = dev.read(buf, sector, g_sampleSectors);
+		if(res != 0) return res;
+
+		fillChunk(expected, mode, sector / g_chunkSectors, seed);
+		if(memcmp(buf, &expected[(sector % g_chunkSectors) * 512 / 8], g_sampleSectors * 512) != 0)
+		{
+			fprintf(stderr, "Overwrite verification failed at sector %" PRIu64 ".\n", sector);
+			return EIO;
+		}
+	}
+
+	return 0;
+}
+
+int overwriteDev(BlockDev &dev, const OverwriteMode mode, BufferPool *const pool)
+{
+	if(mode == OVERWRITE_NONE || dev.getSectors() < g_sampleSectors) return EINVAL;
+	int res = dev.waitAllAsync();
+	if(res != 0) return res;
+
+	// Random data needs one buffer per request in flight. The others share one.
+	// The last buffer holds the expected data for verification.
+	// Pooled buffers count against the budget shared with other devices.
+	const u32 bufCount = (mode == OVERWRITE_RANDOM ? dev.getQueueDepth() : 1);
+	const size_t bufSize = (bufCount + 1) * g_chunkWords * 8;
+	const auto freeBufs = [pool, bufSize](u64 *const ptr)
+	{
+		if(pool != nullptr) pool->release(reinterpret_cast<u8*>(ptr), bufSize);
+		else free(ptr);
+	};
+	const std::unique_ptr<u64[], decltype(freeBufs)> bufs(reinterpret_cast<u64*>(pool != nullptr ? pool->acquire(bufSize) :
+	                                                      aligned_alloc(BlockDev::getBufAlignment(), bufSize)), freeBufs);
+	if(!bufs) return ENOMEM;
+	u64 *const expected = bufs.get() + bufCount * g_chunkWords;
+
+	u64 seed = 0;
+	if(mode == OVERWRITE_RANDOM && getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) seed = util::getNs();
+	if(mode != OVERWRITE_RANDOM) fillChunk(bufs.get(), mode, 0, seed);
+
+	const u64 startNs = util::getNs();
+	res = writeChunks(dev, bufs.get(), bufCount, mode, seed);
+	if(res != 0) return res;
+	const u64 ns = util::getNs() - startNs;
+	const u64 bytes = dev.getSectors() * 512;
+	verbosePrintf("Overwrote %" PRIu64 " MiB at %.2f MB/s.\n", bytes / 1024 / 1024, (ns > 0 ? bytes * 1000.0 / ns : 0.0));
+
+	bool wasDirect;
+	res = dev.beginDirectIo(wasDirect);
+	if(res == EOPNOTSUPP)
+	{
+		verbosePuts("O_DIRECT is not supported. Skipping overwrite verification.");
+		return 0;
+	}
+	if(res != 0) return res;
+	res = checkSamples(dev, bufs.get(), expected, mode, seed);
+	dev.endDirectIo(wasDirect);
+	if(res == 0) verbosePuts("Overwrite verified.");
+
+	return res;
+}
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cwctype>
+#include <dirent.h>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include "types.h"
+#include "populate.h"
+#include "fat.h"
+#include "vol_label.h"
+
+
+static constexpr u32 g_maxDepth = 64; // Also stops symlink loops.
+
+
+
+// For messages only.
+static std::string toUtf8(const std::u16string &str)
+{
+	std::string out;
+	for(size_t i = 0; i < str.length(); i++)
+	{
+		u32 c = str[i];
+		if(c >= 0xD800u && c <= 0xDBFFu && i + 1 < str.length())
+			c = 0x10000u + ((c - 0xD800u)<<10) + (str[++i] - 0xDC00u);
+
+		if(c < 0x80u) out += static_cast<char>(c);
+		else if(c < 0x800u) out += {static_cast<char>(0xC0u | c>>6), static_cast<char>(0x80u | (c & 0x3Fu))};
+		else if(c < 0x10000u) out += {static_cast<char>(0xE0u | c>>12), static_cast<char>(0x80u | (c>>6 & 0x3Fu)),
+		                              static_cast<char>(0x80u | (c & 0x3Fu))};
+		else out += {static_cast<char>(0xF0u | c>>18), static_cast<char>(0x80u | (c>>12 & 0x3Fu)),
+		             static_cast<char>(0x80u | (c>>6 & 0x3Fu)), static_cast<char>(0x80u | (c & 0x3Fu))};
+	}
+
+	return out;
+}
+
+// Generates unique short names with numeric tails for names which don't fit 8.3.
+// Lossless 8.3 names are taken first so they never collide with generated ones.
+static bool makeShortNames(std::vector<FsFile> &files, const char *const path)
+{
+	std::set<std::string> used;
+	std::vector<FsFile*> inexact;
+	for(FsFile &file : files)
+	{
+		bool lossy;
+		file.needsLfn = !makeFatBasisName(file.name, file.shortName, lossy);
+		if(lossy) inexact.push_back(&file);
+		else      used.emplace(file.shortName, 11);
+	}
+
+	for(FsFile *const file : inexact)
+	{
+		// Numeric tail "~N" at the end of the base name.
+		const std::string basis(file->shortName, 11);
+		const size_t baseLen = basis.find_last_not_of(' ', 7) + 1;
+		u32 n = 1;
+		for(; n < 1000000; n++)
+		{
+			const std::string tail = '~' + std::to_string(n);
+			std::string candidate = basis.substr(0, std::min(baseLen, 8 - tail.length())) + tail;
+			candidate.resize(8, ' ');
+			candidate += basis.substr(8);
+			if(used.emplace(candidate).second)
+			{
+				memcpy(file->shortName, candidate.c_str(), 11);
+				break;
+			}
+		}
+
+		if(n == 1000000)
+		{
+			fprintf(stderr, "Error: Can't generate a unique short name in '%s'.\n", path);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool scanDir(const std::string &path, const u8 fatBits, std::vector<FsFile> &files, const u32 depth)
+{
+	if(depth >= g_maxDepth)
+	{
+		fprintf(stderr, "Error: Directory tree '%s' is too deep.\n", path.c_str());
+		return false;
+	}
+
+	DIR *const dir = opendir(path.c_str());
+	if(dir == nullptr)
+	{
+		fprintf(stderr, "Error: Can't open directory '%s': %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	std::vector<std::string> names;
+	const struct dirent *ent;
+	while((ent = readdir(dir)) != nullptr)
+	{
+		if(strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+			names.emplace_back(ent->d_name);
+	}
+	closedir(dir);
+
+	// Same layout on every run.
+	std::sort(names.begin(), names.end());
+
+	for(const std::string &name : names)
+	{
+		FsFile file{};
+		file.srcPath = path + '/' + name;
+
+		struct stat st;
+		if(stat(file.srcPath.c_str(), &st) != 0)
+		{
+			fprintf(stderr, "Error: Can't stat '%s': %s\n", file.srcPath.c_str(), strerror(errno));
+			return false;
+		}
+		if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+		{
+			fprintf(stderr, "Warning: Skipping '%s'. Not a regular file or directory.\n", file.srcPath.c_str());
+			continue;
+		}
+
+		if(convertCheckExfatName(name.c_str(), file.name) == 0) return false;
+		file.isDir     = S_ISDIR(st.st_mode);
+		file.size      = (file.isDir ? 0 : st.st_size);
+		file.timestamp = makeFatTimestamp(st.st_mtime);
+		if(fatBits <= 32 && file.size > 0xFFFFFFFFu)
+		{
+			fprintf(stderr, "Error: File '%s' is bigger than the FAT limit of 4 GiB - 1.\n", file.srcPath.c_str());
+			return false;
+		}
+
+		if(file.isDir && !scanDir(file.srcPath, fatBits, file.children, depth + 1)) return false;
+		files.push_back(std::move(file));
+	}
+
+	if(fatBits <= 32 && !makeShortNames(files, path.c_str())) return false;
+
+	// The root directory is checked with the preallocated files by the caller.
+	return depth == 0 || checkFileNames(files, fatBits);
+}
+
+bool scanHostDir(const char *const path, const u8 fatBits, std::vector<FsFile> &files)
+{
+	return scanDir(path, fatBits, files, 0);
+}
+
+bool checkFileNames(const std::vector<FsFile> &files, const u8 fatBits)
+{
+	std::set<std::u16string> longNames;
+	std::set<std::string> shortNames;
+	for(const FsFile &file : files)
+	{
+		std::u16string upper(file.name);
+		for(char16_t &c : upper) c = towupper(c);
+
+		if(!longNames.insert(std::move(upper)).second ||
+		   (fatBits <= 32 && !shortNames.emplace(file.shortName, 11).second))
+		{
+			fprintf(stderr, "Error: Duplicate file name '%s'.\n", toUtf8(file.name).c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <mutex>
+#include <system_error>
+#include <unistd.h>
+#include "progress.h"
+#include "util.h"
+
+
+static constexpr u32 g_intervalMs = 500; // Time between reports.
+static constexpr u32 g_barWidth   = 30;
+
+// Incremented by SIGUSR1. Every reporter prints its status once per change.
+static std::atomic<u32> g_statusGen = 0;
+static_assert(std::atomic<u32>::is_always_lock_free, "The SIGUSR1 counter must be lock-free.");
+
+
+
+static void onStatusSignal(int)
+{
+	g_statusGen.fetch_add(1, std::memory_order_relaxed);
+}
+
+// SIGUSR1 terminates the process by default so the handler stays installed once set.
+static void installStatusHandler(void)
+{
+	static std::once_flag once;
+	std::call_once(once, []
+	{
+		struct sigaction sa{};
+		sa.sa_handler = onStatusSignal;
+		sa.sa_flags   = SA_RESTART;
+		sigaction(SIGUSR1, &sa, nullptr);
+	});
+}
+
+// Writes the whole buffer with one call if possible so lines of different devices don't mix.
+static void writeAll(const int fd, const char *buf, size_t size)
+{
+	while(size > 0)
+	{
+		const ssize_t written = write(fd, buf, size);
+		if(written == -1)
+		{
+			if(errno == EINTR) continue;
+			return;
+		}
+		buf += written;
+		size -= written;
+	}
+}
+
+void Progress::report(const bool final) noexcept
+{
+	const u64 elapsedNs = util::getNs() - m_startNs;
+	// Work which ended early is taken out of the total so the report still reaches 100%.
+	const u64 dropped = m_dev->getProgressDropped() - m_droppedBase;
+	const u64 total = (m_total > dropped ? m_total - dropped : 0);
+	u64 done = m_dev->getProgressBytes() - m_base;
+	if(total != 0 && done > total) done = total;
+
+	const double secs   = elapsedNs / 1e9;
+	const double mbps   = (elapsedNs > 0 ? done * 1000.0 / elapsedNs : 0.0);
+	const double pct    = (total != 0 ? done * 100.0 / total : 0.0);
+	const double etaSec = (total != 0 && done > 0 ? (double)(total - done) * elapsedNs / done / 1e9 : -1.0);
+
+	char line[PATH_MAX + 512];
+	if(m_fd != -1)
+	{
+		char name[PATH_MAX];
+		util::jsonEscape(name, sizeof(name), m_name);
+		int len = snprintf(line, sizeof(line), "{\"device\":\"%s\",\"phase\":\"%s\",\"done\":%" PRIu64 ",\"total\":%" PRIu64 ","
+		                   "\"elapsed_ms\":%" PRIu64 ",\"mb_per_s\":%.2f,", name, m_phase, done, total, elapsedNs / 1000000, mbps);
+		if(etaSec >= 0.0) len += snprintf(&line[len], sizeof(line) - len, "\"eta_s\":%.1f,", etaSec);
+		else              len += snprintf(&line[len], sizeof(line) - len, "\"eta_s\":null,");
+		len += snprintf(&line[len], sizeof(line) - len, "\"final\":%s}\n", (final ? "true" : "false"));
+		if(len > 0 && (size_t)len < sizeof(line)) writeAll(m_fd, line, len);
+	}
+
+	const u32 statusGen = g_statusGen.load(std::memory_order_relaxed);
+	if(statusGen != m_statusGen && !final)
+	{
+		m_statusGen = statusGen;
+		fprintf(stderr, "%s%s: %s %" PRIu64 " of %" PRIu64 " bytes (%.1f%%), %.1f s, %.1f MB/s\n",
+		        (m_bar ? "\n" : ""), m_name, m_phase, done, total, pct, secs, mbps);
+	}
+
+	if(m_bar && (!final || m_barDrawn))
+	{
+		int len;
+		if(total != 0)
+		{
+			char bar[g_barWidth + 1];
+			const u32 filled = (u32)(done * g_barWidth / total);
+			for(u32 i = 0; i < g_barWidth; i++) bar[i] = (i < filled ? '#' : '.');
+			bar[g_barWidth] = '\0';
+
+			len = snprintf(line, sizeof(line), "\r%-6s [%s] %5.1f%% %8.1f MB/s", m_phase, bar, pct, mbps);
+			if(etaSec >= 0.0 && !final)
+				len += snprintf(&line[len], sizeof(line) - len, "  ETA %" PRIu64 ":%02" PRIu64 " ", (u64)etaSec / 60, (u64)etaSec % 60);
+			else
+				len += snprintf(&line[len], sizeof(line) - len, "  %.1f s   ", secs);
+		}
+		else len = snprintf(line, sizeof(line), "\r%-6s %.1f s ", m_phase, secs);
+
+		fputs(line, stderr);
+		if(final) fputc('\n', stderr);
+		m_barDrawn = true;
+	}
+}
+
+void Progress::threadMain(void) noexcept
+{
+	std::unique_lock lock(m_mutex);
+	while(!m_stopCv.wait_for(lock, std::chrono::milliseconds(g_intervalMs), [this]{return m_stop;}))
+		report(false);
+}
+
+void Progress::start(const char *const phase, const BlockDev &dev, const u64 total) noexcept
+{
+	stop();
+	installStatusHandler();
+
+	m_phase       = phase;
+	m_dev         = &dev;
+	m_base        = dev.getProgressBytes();
+	m_droppedBase = dev.getProgressDropped();
+	m_total       = total;
+	m_startNs     = util::getNs();
+	m_statusGen   = g_statusGen.load(std::memory_order_relaxed);
+	m_barDrawn    = false;
+	m_stop        = false;
+	try
+	{
+		m_thread = std::thread(&Progress::threadMain, this);
+	}
+	catch(const std::system_error&)
+	{
+		// Formatting works without progress reports.
+		m_phase = nullptr;
+	}
+}
+
+void Progress::stop(void) noexcept
+{
+	if(m_phase == nullptr) return;
+
+	{
+		std::lock_guard lock(m_mutex);
+		m_stop = true;
+	}
+	m_stopCv.notify_one();
+	m_thread.join();
+
+	report(true);
+	m_phase = nullptr;
+}
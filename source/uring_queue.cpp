@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <cstring>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>    // mmap(), munmap()...
+#include <sys/syscall.h> // __NR_io_uring_setup...
+#include <unistd.h>      // syscall(), close()...
+#include "types.h"
+#include "uring_queue.h"
+
+
+
+static int sysIoUringSetup(const u32 entries, io_uring_params *const p)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sysIoUringEnter(const int fd, const u32 toSubmit, const u32 minComplete, const u32 flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int UringQueue::init(const u32 entries) noexcept
+{
+	if(m_fd != -1) return EBUSY;
+
+	io_uring_params p{};
+	const int fd = sysIoUringSetup(entries, &p);
+	if(fd == -1) return errno;
+
+	int res = 0;
+	do
+	{
+		m_sqMapSize = p.sq_off.array + p.sq_entries * sizeof(u32);
+		m_cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if(p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			if(m_cqMapSize > m_sqMapSize) m_sqMapSize = m_cqMapSize;
+			m_cqMapSize = m_sqMapSize;
+		}
+
+		void *const sqMap = mmap(nullptr, m_sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if(sqMap == MAP_FAILED)
+		{
+			res = errno;
+			break;
+		}
+		m_sqMap = sqMap;
+
+		void *cqMap = sqMap;
+		if(!(p.features & IORING_FEAT_SINGLE_MMAP))
+		{
+			cqMap = mmap(nullptr, m_cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if(cqMap == MAP_FAILED)
+			{
+				res = errno;
+				break;
+			}
+		}
+		m_cqMap = cqMap;
+
+		m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		void *const sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if(sqes == MAP_FAILED)
+		{
+			res = errno;
+			break;
+		}
+		m_sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+		u8 *const sq = reinterpret_cast<u8*>(sqMap);
+		m_sqTail  = reinterpret_cast<u32*>(&sq[p.sq_off.tail]);
+		m_sqArray = reinterpret_cast<u32*>(&sq[p.sq_off.array]);
+		m_sqMask  = *reinterpret_cast<u32*>(&sq[p.sq_off.ring_mask]);
+
+		u8 *const cq = reinterpret_cast<u8*>(cqMap);
+		m_cqHead = reinterpret_cast<u32*>(&cq[p.cq_off.head]);
+		m_cqTail = reinterpret_cast<u32*>(&cq[p.cq_off.tail]);
+		m_cqes   = reinterpret_cast<io_uring_cqe*>(&cq[p.cq_off.cqes]);
+		m_cqMask = *reinterpret_cast<u32*>(&cq[p.cq_off.ring_mask]);
+	} while(0);
+
+	m_fd = fd;
+	m_inFlight = 0;
+	m_enters = 1; // io_uring_setup().
+	if(res != 0) destroy();
+
+	return res;
+}
+
+int UringQueue::submit(const u8 opcode, const int fd, const void *const iov, const u64 offset, const u64 userData) noexcept
+{
+	// We are the only producer so no atomic load needed for our own tail.
+	const u32 tail = *m_sqTail;
+	const u32 idx  = tail & m_sqMask;
+	io_uring_sqe *const sqe = &m_sqes[idx];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	sqe->opcode    = opcode;
+	sqe->fd        = fd;
+	sqe->off       = offset;
+	sqe->addr      = reinterpret_cast<u64>(iov);
+	sqe->len       = 1; // Number of iovecs.
+	sqe->user_data = userData;
+	m_sqArray[idx] = idx;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	int res;
+	do
+	{
+		res = sysIoUringEnter(m_fd, 1, 0, 0);
+		m_enters++;
+	} while(res == -1 && errno == EINTR);
+
+	// Without SQPOLL the kernel only consumes entries inside io_uring_enter().
+	// If it took none take the entry back so a later call doesn't submit it with a stale buffer.
+	if(res != 1)
+	{
+		res = (res == -1 ? errno : EAGAIN);
+		__atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+		return res;
+	}
+
+	m_inFlight++;
+
+	return 0;
+}
+
+int UringQueue::wait(u64 &userData, s32 &result) noexcept
+{
+	while(1)
+	{
+		const u32 head = *m_cqHead;
+		if(head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe *const cqe = &m_cqes[head & m_cqMask];
+			userData = cqe->user_data;
+			result   = cqe->res;
+			__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+			m_inFlight--;
+
+			return 0;
+		}
+
+		m_enters++;
+		if(sysIoUringEnter(m_fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+			return errno;
+	}
+}
+
+void UringQueue::destroy(void) noexcept
+{
+	if(m_sqMap != nullptr)
+	{
+		if(m_sqes != nullptr) munmap(m_sqes, m_sqesSize);
+		if(m_cqMap != nullptr && m_cqMap != m_sqMap) munmap(m_cqMap, m_cqMapSize);
+		munmap(m_sqMap, m_sqMapSize);
+	}
+
+	if(m_fd != -1) ::close(m_fd);
+
+	m_fd       = -1;
+	m_inFlight = 0;
+	m_enters   = 0;
+	m_sqMap    = nullptr;
+	m_sqes     = nullptr;
+	m_cqMap    = nullptr;
+}
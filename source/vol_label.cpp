@@ -3,7 +3,9 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cwctype>
+#include <string>
 #include "types.h"
 
 
@@ -31,33 +33,33 @@ static const wchar_t cp850Lut[128] =
 
 
 
+// Returns the CP850 character or -1 if there is none.
+static int wchar2cp850Char(const wchar_t wc)
+{
+	if(wc > 0 && wc < 128) return wc;
+
+	for(unsigned i = 0; i < 128; i++)
+	{
+		if(wc == cp850Lut[i]) return 0x80 | i;
+	}
+
+	return -1;
+}
+
 // Make sure dosStr is big enough!
 static bool wchar2cp850(const wchar_t *wStr, char *dosStr)
 {
 	while(*wStr != L'\0')
 	{
 		const wchar_t wc = *wStr++;
-		if(wc > 0 && wc < 128)
-		{
-			*dosStr++ = wc;
-			continue;
-		}
-
-		unsigned i;
-		for(i = 0; i < 128; i++)
-		{
-			if(wc == cp850Lut[i])
-			{
-				*dosStr++ = 0x80 | i;
-				break;
-			}
-		}
-
-		if(i == 128)
+		const int c = wchar2cp850Char(wc);
+		if(c < 0)
 		{
 			fprintf(stderr, "Error: Can't convert wide character 0x%08" PRIX32 " to CP850.\n", wc);
 			return false;
 		}
+
+		*dosStr++ = c;
 	}
 
 	*dosStr = '\0';
@@ -65,6 +67,16 @@ static bool wchar2cp850(const wchar_t *wStr, char *dosStr)
 	return true;
 }
 
+static bool isInvalidShortNameChar(const unsigned char c)
+{
+	return c < 0x20 || c == 0x22 ||
+	       (c >= 0x2A && c <= 0x2C) ||
+	       c == 0x2E || c == 0x2F ||
+	       (c >= 0x3A && c <= 0x3F) ||
+	       (c >= 0x5B && c <= 0x5D) ||
+	       c == 0x7C;
+}
+
 // Caution! This expects wcs can hold 13 chars including termination.
 // This way we will know if the string contains more than 11 codepoints.
 static size_t label2wchar(const char *const label, wchar_t *const wcs)
@@ -160,3 +172,160 @@ size_t convertCheckExfatLabel(const char *const label, char16_t *utf16Label)
 
 	return length;
 }
+
+bool convertCheckFatShortName(const char *const name, char *shortName)
+{
+	wchar_t wName[14];
+	wName[13] = L'\0';
+	const size_t wLength = mbstowcs(wName, name, 13);
+	if(wLength == (size_t)-1)
+	{
+		fputs("Failed to convert file name to wide characters.\n", stderr);
+		return false;
+	}
+	if(wLength > 12)
+	{
+		fprintf(stderr, "Error: File name '%s' is not a valid 8.3 name.\n", name);
+		return false;
+	}
+
+	// Short names are stored in uppercase.
+	for(unsigned i = 0; wName[i] != L'\0'; i++) wName[i] = towupper(wName[i]);
+
+	char dosName[13];
+	if(!wchar2cp850(wName, dosName)) return false;
+
+	const char *const dot = strchr(dosName, '.');
+	const size_t baseLen = (dot != nullptr ? (size_t)(dot - dosName) : strlen(dosName));
+	const size_t extLen  = (dot != nullptr ? strlen(dot + 1) : 0);
+	if(baseLen == 0 || baseLen > 8 || extLen > 3 || (dot != nullptr && extLen == 0) || *dosName == ' ')
+	{
+		fprintf(stderr, "Error: File name '%s' is not a valid 8.3 name.\n", name);
+		return false;
+	}
+
+	memset(shortName, ' ', 11);
+	memcpy(shortName, dosName, baseLen);
+	if(extLen > 0) memcpy(&shortName[8], dot + 1, extLen);
+	for(unsigned i = 0; i < 11; i++)
+	{
+		if(isInvalidShortNameChar(shortName[i]))
+		{
+			fprintf(stderr, "Error: File name '%s' contains invalid characters.\n", name);
+			return false;
+		}
+	}
+
+	// 0xE5 marks deleted entries. 0x05 is stored instead.
+	if((unsigned char)*shortName == 0xE5u) *shortName = 0x05;
+
+	return true;
+}
+
+size_t convertCheckExfatName(const char *const name, std::u16string &utf16Name)
+{
+	wchar_t wName[257];
+	wName[256] = L'\0';
+	const size_t wLength = mbstowcs(wName, name, 256);
+	if(wLength == (size_t)-1)
+	{
+		fputs("Failed to convert file name to wide characters.\n", stderr);
+		return 0;
+	}
+
+	utf16Name.clear();
+	for(size_t i = 0; i < wLength; i++)
+	{
+		const wchar_t wc = wName[i];
+		if(wc < 0x20 || wc == L'"' || wc == L'*' || wc == L'/' || wc == L':' ||
+		   wc == L'<' || wc == L'>' || wc == L'?' || wc == L'\\' || wc == L'|')
+		{
+			fprintf(stderr, "Error: File name '%s' contains invalid characters.\n", name);
+			return 0;
+		}
+
+		if(wc < 0x10000)
+		{
+			utf16Name.push_back(wc);
+			continue;
+		}
+
+		// Encode as surrogate pair.
+		const wchar_t tmp = wc - 0x10000;
+		utf16Name.push_back(0xD800u + (tmp>>10));
+		utf16Name.push_back(0xDC00u + (tmp & 0x3FFu));
+	}
+
+	if(utf16Name.empty() || utf16Name.length() > 255 || utf16Name == u"." || utf16Name == u"..")
+	{
+		fprintf(stderr, "Error: File name '%s' is empty, too long or reserved.\n", name);
+		return 0;
+	}
+
+	return utf16Name.length();
+}
+
+// Basis name generation similar to fatgen103.doc. Spaces and periods are removed and
+// characters without a valid 8.3 representation are replaced with underscores.
+bool makeFatBasisName(const std::u16string &name, char *shortName, bool &lossy)
+{
+	memset(shortName, ' ', 11);
+
+	// Leading periods don't start an extension.
+	size_t baseEnd = name.length();
+	size_t extStart = name.length();
+	const size_t lastDot = name.rfind(u'.');
+	if(lastDot != std::u16string::npos && name.find_first_not_of(u'.') < lastDot)
+	{
+		baseEnd = lastDot;
+		extStart = lastDot + 1;
+	}
+
+	const auto convert = [](const char16_t c) -> int
+	{
+		if(c == u' ' || c == u'.') return -1; // Removed.
+		if(c >= 0xD800u && c <= 0xDFFFu) return '_';
+
+		const int dosChar = wchar2cp850Char(towupper(c));
+		return (dosChar < 0 || isInvalidShortNameChar(dosChar) ? '_' : dosChar);
+	};
+
+	unsigned len = 0;
+	for(size_t i = 0; i < baseEnd && len < 8; i++)
+	{
+		const int c = convert(name[i]);
+		if(c >= 0) shortName[len++] = c;
+	}
+	if(len == 0) shortName[len++] = '_';
+	const unsigned baseLen = len;
+
+	len = 0;
+	for(size_t i = extStart; i < name.length() && len < 3; i++)
+	{
+		const int c = convert(name[i]);
+		if(c >= 0) shortName[8 + len++] = c;
+	}
+	const unsigned extLen = len;
+
+	// The 8.3 name is exact if it reads back as the original name.
+	std::u16string readBack;
+	for(unsigned i = 0; i < baseLen; i++) readBack.push_back(static_cast<u8>(shortName[i]));
+	if(extLen > 0) readBack.push_back(u'.');
+	for(unsigned i = 0; i < extLen; i++) readBack.push_back(static_cast<u8>(shortName[8 + i]));
+
+	// Names only differing in case don't need a numeric tail but still need long name entries.
+	bool exact = readBack.length() == name.length();
+	lossy = !exact;
+	for(size_t i = 0; !lossy && i < name.length(); i++)
+	{
+		const char16_t c = name[i];
+		const bool isDot = c == u'.';
+		exact &= (isDot ? readBack[i] == u'.' : c < 0xD800u && wchar2cp850Char(c) == readBack[i]);
+		lossy = (isDot ? readBack[i] != u'.' : c >= 0xD800u || wchar2cp850Char(towupper(c)) != readBack[i]);
+	}
+
+	// 0xE5 marks deleted entries. 0x05 is stored instead.
+	if(static_cast<u8>(*shortName) == 0xE5u) *shortName = 0x05;
+
+	return exact;
+}
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2023 profi200
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include "blockdev.h"
+#include "util.h"
+
+
+// Measures how long BlockDev::open() + close() take including the device checks.
+
+
+
+int main(const int argc, char *const argv[])
+{
+	if(argc < 2 || argc > 3)
+	{
+		puts("Usage: openBench DEVICE [ITERATIONS]");
+		return EINVAL;
+	}
+
+	const u32 iterations = (argc == 3 ? strtoul(argv[2], NULL, 0) : 100);
+	if(iterations == 0) return EINVAL;
+
+	u64 total = 0;
+	u64 min = ~0ull;
+	u64 max = 0;
+	for(u32 i = 0; i < iterations; i++)
+	{
+		BlockDev dev;
+		const u64 start = util::getNs();
+		const int res = dev.open(argv[1]);
+		if(res != 0) return res;
+		dev.close();
+		const u64 elapsed = util::getNs() - start;
+
+		total += elapsed;
+		if(elapsed < min) min = elapsed;
+		if(elapsed > max) max = elapsed;
+	}
+
+	printf("%" PRIu32 " iterations. open + close: avg %.1f us, min %.1f us, max %.1f us\n",
+	       iterations, total / 1000.0 / iterations, min / 1000.0, max / 1000.0);
+
+	return 0;
+}